@@ -0,0 +1,164 @@
+/**
+@file
+wes.arena.h
+
+@brief
+Per-object scratch memory of the wes kernels
+
+@description
+Each wes object owns an arena from which a bang takes all of its working
+memory (planar channels, envelope tables, accumulators); nothing is freed
+one piece at a time, the whole arena is given back at the end of the bang.
+The arena keeps a single block sized after the largest bang so far, so that
+once the sizes settle a bang makes no heap allocation at all.
+What doesn't fit in the block is allocated on the side and released at the
+end of the bang, which then enlarges the block for the next one.
+The <m>scratch</m> attribute caps, in megabytes, the memory kept between
+bangs: setting it trims the arena right away, and a larger bang gets its
+memory back to the system once it's done.
+
+@owner
+Marco Marasciuolo
+*/
+
+#ifndef _WES_ARENA_H_
+#define _WES_ARENA_H_
+
+#include "ext.h"
+
+#define WES_ARENA_ALIGN                 64      ///< Alignment (and granularity) of every allocation
+#define WES_ARENA_DEFAULT_SCRATCH       256     ///< Default megabytes kept between bangs
+
+typedef struct _wes_arena {
+    char    *mem;       ///< Block kept between bangs, as allocated
+    char    *block;     ///< Its aligned start
+    size_t  size;       ///< Usable bytes of the block
+    size_t  used;       ///< Bytes of the block handed out
+    size_t  live;       ///< Bytes handed out, block and spills
+    size_t  peak;       ///< Highest <live> since the last wes_arena_end()
+    void    *spill;     ///< Chain of the allocations that didn't fit in the block
+} t_wes_arena;
+
+
+static inline size_t wes_arena_round(size_t bytes)
+{
+    return (MAX(1, bytes) + WES_ARENA_ALIGN - 1) & ~(size_t)(WES_ARENA_ALIGN - 1);
+}
+
+static inline size_t wes_arena_megabytes(double megabytes)
+{
+    return (size_t)(MAX(0, megabytes) * 1048576.);
+}
+
+static inline void wes_arena_init(t_wes_arena *a)
+{
+    memset(a, 0, sizeof(t_wes_arena));
+}
+
+
+/** Returns <bytes> of uninitialized memory, aligned to WES_ARENA_ALIGN, valid until wes_arena_end() or a
+    wes_arena_rewind() to a mark taken before */
+static inline void *wes_arena_alloc(t_wes_arena *a, size_t bytes)
+{
+    void *p;
+    size_t n = wes_arena_round(bytes);
+
+    // once something has spilled, everything else does, so that the block is handed out as a stack
+    if (!a->spill && a->used + n <= a->size) {
+        p = a->block + a->used;
+        a->used += n;
+    } else {
+        char *chunk = (char *)sysmem_newptr(n + 2 * WES_ARENA_ALIGN);
+        *(void **)chunk = a->spill;
+        a->spill = chunk;
+        p = (void *)(((t_ptr_uint)chunk + sizeof(void *) + WES_ARENA_ALIGN - 1) & ~(t_ptr_uint)(WES_ARENA_ALIGN - 1));
+    }
+    a->live += n;
+    a->peak = MAX(a->peak, a->live);
+    return p;
+}
+
+/** Returns the per-waveset envelope of <count> wavesets, envOnset[0] ... envOnset[<count> - 1] left to the kernel to fill;
+    envOnset[<count>] is silent, as kernels looking one waveset ahead peek past the last one */
+static inline float *wes_arena_envelope(t_wes_arena *a, long count)
+{
+    float *envOnset = (float *)wes_arena_alloc(a, (count + 1) * sizeof(float));
+    envOnset[count] = 0;
+    return envOnset;
+}
+
+/** Returns a mark to which wes_arena_rewind() can give back what is allocated afterwards */
+static inline size_t wes_arena_mark(const t_wes_arena *a)
+{
+    return a->live;
+}
+
+/** Hands out again the memory allocated since <mark> (spilled memory is only released by wes_arena_end()) */
+static inline void wes_arena_rewind(t_wes_arena *a, size_t mark)
+{
+    a->live = mark;
+    a->used = MIN(a->used, mark);
+}
+
+
+static inline void wes_arena_release(t_wes_arena *a)
+{
+    if (a->mem)
+        sysmem_freeptr(a->mem);
+    a->mem = a->block = NULL;
+    a->size = 0;
+}
+
+/** Frees the block if it's larger than <keep> bytes */
+static inline void wes_arena_trim(t_wes_arena *a, size_t keep)
+{
+    if (a->size > keep)
+        wes_arena_release(a);
+}
+
+/** Gives back everything allocated during a bang, then sizes the block after it, keeping at most <keep> bytes */
+static inline void wes_arena_end(t_wes_arena *a, size_t keep)
+{
+    while (a->spill) {
+        void *next = *(void **)a->spill;
+        sysmem_freeptr(a->spill);
+        a->spill = next;
+    }
+
+    if (a->peak > a->size && a->peak <= keep) {
+        wes_arena_release(a);
+        a->mem = (char *)sysmem_newptr(a->peak + WES_ARENA_ALIGN);
+        a->block = (char *)(((t_ptr_uint)a->mem + WES_ARENA_ALIGN - 1) & ~(t_ptr_uint)(WES_ARENA_ALIGN - 1));
+        a->size = a->peak;
+    }
+    wes_arena_trim(a, keep);
+    a->used = a->live = a->peak = 0;
+}
+
+static inline void wes_arena_free(t_wes_arena *a)
+{
+    wes_arena_end(a, 0);
+}
+
+
+/// Defines <name>_setattr_scratch(), the setter of the scratch attribute of the objects of struct <type>,
+/// which hold their arena in <arena> and the attribute in <scratch_in>
+#define WES_ARENA_ADD_SCRATCH_SETTER(name, type) \
+t_max_err name##_setattr_scratch(type *x, t_object *attr, long ac, t_atom *av) \
+{ \
+    if (ac && av) { \
+        earsbufobj_mutex_lock((t_earsbufobj *)x); \
+        x->scratch_in = MAX(0, atom_getfloat(av)); \
+        wes_arena_trim(&x->arena, wes_arena_megabytes(x->scratch_in)); \
+        earsbufobj_mutex_unlock((t_earsbufobj *)x); \
+    } \
+    return MAX_ERR_NONE; \
+}
+
+/// Declares the scratch attribute, whose setter is defined by WES_ARENA_ADD_SCRATCH_SETTER(name, type)
+#define WES_DECLARE_SCRATCH_ATTR(c, name, type) \
+    CLASS_ATTR_DOUBLE(c, "scratch", 0, type, scratch_in); \
+    CLASS_ATTR_STYLE_LABEL(c, "scratch", 0, "text", "Scratch Memory Kept (MB)"); \
+    CLASS_ATTR_ACCESSORS(c, "scratch", NULL, name##_setattr_scratch);
+
+#endif // _WES_ARENA_H_
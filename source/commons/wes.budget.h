@@ -0,0 +1,129 @@
+/**
+@file
+wes.budget.h
+
+@brief
+Projected cost of a bang and memory budget
+
+@description
+Since every kernel plans the length of its output from the feature table
+alone (see wes.output.h), the cost of a bang is known before any sample is
+synthesized: the output frames, the memory taken by the planar channels,
+the feature tables, the per-waveset tables, the kernel accumulators and the
+output buffer, and the time it will take, projected from the synthesis rate
+the object measured on its previous bangs.
+The <m>dryrun</m> message posts this projection for every input buffer and
+stops there, leaving the output buffers untouched.
+Bangs whose projected memory exceeds the <m>membudget</m> attribute (in
+megabytes) are refused, leaving the output buffer empty; objects that can
+spool their outputs (see wes.spool.h) downgrade them to spooling instead,
+whenever the memory left without the output buffer fits.
+
+@owner
+Marco Marasciuolo
+*/
+
+#ifndef _WES_BUDGET_H_
+#define _WES_BUDGET_H_
+
+#include "ext.h"
+#include "ext_obex.h"
+#include "wes.features.h"
+#include "wes.planar.h"
+
+#define WES_BUDGET_DEFAULT_RATE     20000000.   ///< Output samples per second assumed until a bang is timed
+#define WES_BUDGET_MINTIMED         20          ///< Shortest bang, in milliseconds, worth timing
+
+typedef struct _wes_budget {
+    double      rate;       ///< Output samples synthesized per second, as timed on the last bang
+    t_uint32    started;    ///< systime_ms() when the bang being timed started
+} t_wes_budget;
+
+typedef struct _wes_cost {
+    long    frames;         ///< Output frames
+    long    nchan;          ///< Output channels
+    double  work;           ///< Bytes of scratch memory and feature tables
+    double  output;         ///< Bytes of the output buffer
+    double  seconds;        ///< Projected synthesis time
+} t_wes_cost;
+
+
+static inline void wes_budget_init(t_wes_budget *b)
+{
+    b->rate = WES_BUDGET_DEFAULT_RATE;
+    b->started = 0;
+}
+
+static inline void wes_budget_start(t_wes_budget *b)
+{
+    b->started = systime_ms();
+}
+
+/** Updates the synthesis rate after a bang that produced <samples> output samples since wes_budget_start() */
+static inline void wes_budget_stop(t_wes_budget *b, double samples)
+{
+    t_uint32 elapsed = systime_ms() - b->started;
+    if (elapsed >= WES_BUDGET_MINTIMED && samples > 0)
+        b->rate = samples * 1000. / elapsed;
+}
+
+
+/** Projects the cost of turning <nchan> channels of <frames> frames, segmented into <crosscount> wavesets, into
+    <outframes> frames of <outchans> channels, the kernel itself taking <accum> more bytes of scratch memory */
+static inline void wes_budget_project(const t_wes_budget *b, t_wes_cost *c, long frames, long nchan, long crosscount,
+                                      long outframes, long outchans, double accum)
+{
+    double planar = (double)(frames + 1) * nchan * sizeof(float);
+
+    // channels too large to be deinterleaved at once are extracted one at a time
+    if (planar + WES_PLANAR_GUARD * sizeof(float) > WES_PLANAR_MAXBYTES)
+        planar = (double)(frames + 1) * sizeof(float);
+
+    c->frames = MAX(0, outframes);
+    c->nchan = outchans;
+    c->work = planar + WES_PLANAR_GUARD * sizeof(float)
+            + (double)nchan * wes_features_size(crosscount)         // one table per channel, in the shared cache
+            + (double)(crosscount + 1) * sizeof(float)              // per-waveset modulation values
+            + accum;
+    c->output = (double)c->frames * outchans * sizeof(float);
+    c->seconds = (double)c->frames * outchans / MAX(1., b->rate);
+}
+
+
+/** Tells whether a bang of cost <c> can go on; in a dry run, posts the cost instead and returns 0.
+    Objects that can spool pass whether the output is to be spooled in <spool> (NULL otherwise),
+    which is set if spooling keeps the bang within <megabytes> (0 for no budget) */
+static inline long wes_budget_admit(t_object *x, const t_wes_cost *c, double megabytes, long dryrun, long *spool)
+{
+    double budget = wes_arena_megabytes(megabytes);
+    double total = c->work + (spool && *spool ? 0 : c->output);
+
+    if (dryrun) {
+        object_post(x, "dry run: %ld frames, %ld channels, %.2f MB of memory%s, about %.2f s",
+                    c->frames, c->nchan, total / 1048576., spool && *spool ? " (output spooled)" : "", c->seconds);
+        if (budget > 0 && total > budget)
+            object_post(x, "dry run: exceeds the memory budget of %.2f MB, the output would be %s", megabytes,
+                        spool && !*spool && c->work <= budget ? "spooled" : "skipped");
+        return 0;
+    }
+
+    if (budget <= 0 || total <= budget)
+        return 1;
+
+    if (spool && !*spool && c->work <= budget) {
+        object_warn(x, "projected %.2f MB exceed the memory budget of %.2f MB, spooling the output", total / 1048576., megabytes);
+        *spool = 1;
+        return 1;
+    }
+
+    object_error(x, "projected %.2f MB exceed the memory budget of %.2f MB, buffer skipped", total / 1048576., megabytes);
+    return 0;
+}
+
+
+/// Declares the membudget attribute, held in <membudget_in>
+#define WES_DECLARE_BUDGET_ATTR(c, type) \
+    CLASS_ATTR_DOUBLE(c, "membudget", 0, type, membudget_in); \
+    CLASS_ATTR_STYLE_LABEL(c, "membudget", 0, "text", "Memory Budget (MB)");
+
+#endif // _WES_BUDGET_H_
@@ -0,0 +1,579 @@
+/**
+@file
+wes.cache.h
+
+@brief
+Process-wide cache of waveset segmentations
+
+@description
+Segmentations are keyed on the source buffer, its modification time, a
+fingerprint of the channel contents, the channel and the minsamp/cross
+settings, so that every wes object (and every repeated bang) working on the
+same material shares a single index, along with the per-waveset feature
+table of the segmentation (see wes.features.h).
+Only the base segmentation of a channel (every crossing) is ever computed
+from the samples; the segmentation for any minsamp/cross pair is derived
+from it, so that changing those attributes doesn't rescan the buffer.
+Each wes object is a separate external, hence the cache lives behind the
+<m>s_thing</m> of a private symbol, created by the first object class that
+is loaded.
+Entries are reference counted while a kernel uses them; unused entries are
+evicted least-recently-used first once the memory cap is exceeded.
+Objects with an <m>indexdir</m> look for the base segmentation in a sidecar
+file (see wes.sidecar.h) before scanning, and write one after scanning.
+Base indices carry a pyramid (see wes.pyramid.h) through which large
+minsamp values are resolved without walking every crossing; objects with
+the <m>pyramid</m> attribute on also have the segmentations at log-spaced
+minsamp values built in background, so that sweeping minsamp mostly hits
+the cache.
+
+@owner
+Marco Marasciuolo
+*/
+
+#ifndef _WES_CACHE_H_
+#define _WES_CACHE_H_
+
+#include "ext.h"
+#include "ext_obex.h"
+#include "ext_buffer.h"
+#include "ext_systhread.h"
+#include "wes.features.h"
+#include "wes.pyramid.h"
+#include "wes.sidecar.h"
+#include "wes.planar.h"
+
+#define WES_CACHE_VERSION               6
+#define WES_CACHE_DEFAULT_MAXBYTES      (256L * 1024L * 1024L)
+#define WES_CACHE_FINGERPRINT_POINTS    4096
+#define WES_CACHE_WARM_MINSAMP          4       ///< Lowest minsamp level warmed up in background
+#define WES_CACHE_WARM_MAXMINSAMP       2048    ///< Highest minsamp level warmed up in background
+
+#define WES_CHANNEL_MIX                 -1      ///< Channel key for indices built on a mix of all channels
+#define WES_CHANNEL_MID                 -2      ///< Channel key for indices built on the mean of all channels
+
+// linkchannels attribute values
+#define WES_LINK_OFF                    0       ///< Every channel is segmented on its own
+#define WES_LINK_MID                    1       ///< All channels are segmented on the mean of all channels
+#define WES_LINK_KEY                    2       ///< All channels are segmented on the key channel
+
+
+typedef struct _wes_index {
+    // key
+    t_buffer_obj    *buffer;
+    long            modtime;
+    t_uint64        fingerprint;
+    long            frames;
+    long            channel;
+    long            minsamp;        ///< Acceptance threshold, as passed to wes_segment()
+    long            ncross;
+
+    // segmentation
+    t_wes_features  features;
+    void            *data;              ///< Block holding the feature table, unless it was loaded from a sidecar
+    t_wes_sidecar   sidecar;            ///< Backing sidecar, if the table was loaded from one
+    t_wes_pyramid   *pyramid;           ///< Base indices only
+    long            warmed;             ///< Base indices only: the cross value whose minsamp levels were warmed up, if any
+
+    long            refcount;
+    long            bytes;
+    struct _wes_index *prev;
+    struct _wes_index *next;
+} t_wes_index;
+
+
+typedef struct _wes_cache {
+    long                version;
+    t_systhread_mutex   mutex;
+    t_wes_index         *head;      ///< Most recently used entry
+    t_wes_index         *tail;      ///< Least recently used entry
+    long                numentries;
+    long                bytes;
+    long                maxbytes;
+    t_uint64            hits;
+    t_uint64            misses;
+    t_uint64            evictions;
+    t_uint64            scans;          ///< Base indices computed from the samples
+    t_uint64            sidecarloads;
+    t_uint64            sidecarwrites;
+    t_systhread         warmthread;     ///< Last background warm-up thread
+    long                warming;        ///< Whether it is still running
+} t_wes_cache;
+
+
+/** Returns the process-wide cache, creating it on first use; call it once from ext_main() so creation happens on the main thread. */
+static inline t_wes_cache *wes_cache_get(void)
+{
+    static t_wes_cache *cache = NULL;
+    if (!cache) {
+        t_symbol *s = gensym("__wes_index_cache__");
+        cache = (t_wes_cache *)s->s_thing;
+        if (!cache) {
+            cache = (t_wes_cache *)sysmem_newptrclear(sizeof(t_wes_cache));
+            cache->version = WES_CACHE_VERSION;
+            cache->maxbytes = WES_CACHE_DEFAULT_MAXBYTES;
+            systhread_mutex_new(&cache->mutex, 0);
+            s->s_thing = (t_object *)cache;
+        } else if (cache->version != WES_CACHE_VERSION) {
+            // an object built against a different cache layout is loaded: keep a private cache
+            error("wes: mismatching index cache version, waveset indices won't be shared with other wes objects");
+            cache = (t_wes_cache *)sysmem_newptrclear(sizeof(t_wes_cache));
+            cache->version = WES_CACHE_VERSION;
+            cache->maxbytes = WES_CACHE_DEFAULT_MAXBYTES;
+            systhread_mutex_new(&cache->mutex, 0);
+        }
+    }
+    return cache;
+}
+
+
+/** Cheap content fingerprint of the samples in[1] ... in[frames], from a sparse sample of them; enough, along with
+    the buffer and its modification time, to key the in-memory cache */
+static inline t_uint64 wes_cache_fingerprint(const float *in, long frames)
+{
+    t_uint64 hash = 14695981039346656037ULL;
+    t_uint32 bits;
+    long step = MAX(1, frames / WES_CACHE_FINGERPRINT_POINTS);
+    long j;
+
+    for (j = 1; j <= frames; j += step) {
+        memcpy(&bits, in + j, sizeof(bits));
+        hash = (hash ^ bits) * 1099511628211ULL;
+    }
+    if (frames > 0) {
+        memcpy(&bits, in + frames, sizeof(bits));
+        hash = (hash ^ bits) * 1099511628211ULL;
+    }
+    return (hash ^ (t_uint64)frames) * 1099511628211ULL;
+}
+
+
+static inline void wes_cache_index_free(t_wes_index *index)
+{
+    wes_pyramid_free(index->pyramid);
+    if (index->sidecar.data)
+        wes_sidecar_close(&index->sidecar);
+    else
+        sysmem_freeptr(index->data);
+    sysmem_freeptr(index);
+}
+
+
+// list handling, all called with the cache mutex held
+static inline void wes_cache_unlink(t_wes_cache *cache, t_wes_index *index)
+{
+    if (index->prev)
+        index->prev->next = index->next;
+    else
+        cache->head = index->next;
+    if (index->next)
+        index->next->prev = index->prev;
+    else
+        cache->tail = index->prev;
+    index->prev = index->next = NULL;
+}
+
+static inline void wes_cache_push_front(t_wes_cache *cache, t_wes_index *index)
+{
+    index->prev = NULL;
+    index->next = cache->head;
+    if (cache->head)
+        cache->head->prev = index;
+    cache->head = index;
+    if (!cache->tail)
+        cache->tail = index;
+}
+
+static inline void wes_cache_trim(t_wes_cache *cache, long maxbytes)
+{
+    t_wes_index *index = cache->tail;
+    while (index && cache->bytes > maxbytes) {
+        t_wes_index *prev = index->prev;
+        if (index->refcount <= 0) {
+            wes_cache_unlink(cache, index);
+            cache->bytes -= index->bytes;
+            cache->numentries--;
+            cache->evictions++;
+            wes_cache_index_free(index);
+        }
+        index = prev;
+    }
+}
+
+static inline t_wes_index *wes_cache_find(t_wes_cache *cache, t_buffer_obj *buffer, long modtime, t_uint64 fingerprint,
+                                          long frames, long channel, long minsamp, long ncross)
+{
+    t_wes_index *index;
+    for (index = cache->head; index; index = index->next) {
+        if (index->buffer == buffer && index->modtime == modtime && index->fingerprint == fingerprint &&
+            index->frames == frames && index->channel == channel && index->minsamp == minsamp && index->ncross == ncross)
+            return index;
+    }
+    return NULL;
+}
+
+
+/** Segments the planar channel <in> into a standalone (uncached) base index: every crossing, with its feature table */
+static inline t_wes_index *wes_cache_index_new(const float *in, long frames)
+{
+    t_wes_index *index = (t_wes_index *)sysmem_newptrclear(sizeof(t_wes_index));
+    long maxcross = MAX(16, frames / 16);
+    long *zerocrossindex = (long *)sysmem_newptr(maxcross * sizeof(long));
+    long crosscount = wes_segment_parallel(in, frames, 0, 1, &zerocrossindex, &maxcross);
+
+    index->data = sysmem_newptrclear(wes_features_size(crosscount));
+    wes_features_bind(&index->features, index->data, crosscount);
+    memcpy(index->features.zerocrossindex, zerocrossindex, (crosscount + 1) * sizeof(long));
+    sysmem_freeptr(zerocrossindex);
+    wes_features_compute(in, &index->features);
+    index->pyramid = wes_pyramid_new(&index->features);
+
+    index->frames = frames;
+    index->minsamp = 0;
+    index->ncross = 1;
+    index->bytes = sizeof(t_wes_index) + wes_features_size(crosscount) + index->pyramid->bytes;
+    return index;
+}
+
+
+/** Derives a standalone (uncached) index for <minsamp> and <ncross> from a base index */
+static inline t_wes_index *wes_cache_index_derive(const t_wes_index *base, long minsamp, long ncross)
+{
+    t_wes_index *index = (t_wes_index *)sysmem_newptrclear(sizeof(t_wes_index));
+    const t_wes_features *bf = &base->features;
+    t_wes_features *wf = &index->features;
+    t_wes_features tmp;
+    void *tmpdata = sysmem_newptr(wes_features_size(bf->count));
+    long n;
+
+    // derive into a table as large as the base, then pack it
+    wes_features_bind(&tmp, tmpdata, bf->count);
+    if (base->pyramid && wes_pyramid_worthwhile(bf, base->frames, minsamp))
+        wes_pyramid_derive(bf, base->pyramid, minsamp, ncross, &tmp);
+    else
+        wes_features_derive(bf, minsamp, ncross, &tmp);
+    n = tmp.count + 1;
+    index->data = sysmem_newptrclear(wes_features_size(tmp.count));
+    wes_features_bind(wf, index->data, tmp.count);
+    memcpy(wf->zerocrossindex, tmp.zerocrossindex, n * sizeof(long));
+    memcpy(wf->start, tmp.start, n * sizeof(long));
+    memcpy(wf->period, tmp.period, n * sizeof(long));
+    memcpy(wf->absPeak, tmp.absPeak, n * sizeof(double));
+    memcpy(wf->posPeak, tmp.posPeak, n * sizeof(double));
+    memcpy(wf->negPeak, tmp.negPeak, n * sizeof(double));
+    memcpy(wf->energy, tmp.energy, n * sizeof(double));
+    memcpy(wf->rms, tmp.rms, n * sizeof(double));
+    memcpy(wf->first, tmp.first, n * sizeof(double));
+    memcpy(wf->last, tmp.last, n * sizeof(double));
+    memcpy(wf->crossing, tmp.crossing, n * sizeof(double));
+    memcpy(wf->exactPeriod, tmp.exactPeriod, n * sizeof(double));
+    sysmem_freeptr(tmpdata);
+
+    index->buffer = base->buffer;
+    index->modtime = base->modtime;
+    index->fingerprint = base->fingerprint;
+    index->frames = base->frames;
+    index->channel = base->channel;
+    index->minsamp = minsamp;
+    index->ncross = ncross;
+    index->refcount = 1;
+    index->bytes = sizeof(t_wes_index) + wes_features_size(wf->count);
+    return index;
+}
+
+
+/** Loads an index from the sidecar at <path>, keyed on wes_sidecar_fingerprint(), or returns NULL if there is no valid one */
+static inline t_wes_index *wes_cache_index_load(const char *path, t_uint64 fingerprint, long frames, long channel, long minsamp, long ncross)
+{
+    t_wes_index *index;
+    t_wes_sidecar sc;
+
+    if (wes_sidecar_open(path, fingerprint, frames, channel, minsamp, ncross, &sc))
+        return NULL;
+
+    index = (t_wes_index *)sysmem_newptrclear(sizeof(t_wes_index));
+    index->sidecar = sc;
+    index->features = sc.features;
+    index->pyramid = wes_pyramid_new(&index->features);
+    index->frames = frames;
+    index->minsamp = minsamp;
+    index->ncross = ncross;
+    index->bytes = sizeof(t_wes_index) + sc.size + index->pyramid->bytes;
+    return index;
+}
+
+
+/** Looks an entry up and, if found, takes a reference on it; <stats> tells whether the lookup counts as a hit or miss */
+static inline t_wes_index *wes_cache_lookup(t_wes_cache *cache, t_buffer_obj *buffer, long modtime, t_uint64 fingerprint,
+                                            long frames, long channel, long minsamp, long ncross, long stats)
+{
+    t_wes_index *index;
+    systhread_mutex_lock(cache->mutex);
+    index = wes_cache_find(cache, buffer, modtime, fingerprint, frames, channel, minsamp, ncross);
+    if (index) {
+        index->refcount++;
+        wes_cache_unlink(cache, index);
+        wes_cache_push_front(cache, index);
+    }
+    if (stats) {
+        if (index)
+            cache->hits++;
+        else
+            cache->misses++;
+    }
+    systhread_mutex_unlock(cache->mutex);
+    return index;
+}
+
+
+/** Inserts a referenced index, unless an equivalent one was inserted meanwhile, in which case <index> is freed;
+    returns the index held by the cache. */
+static inline t_wes_index *wes_cache_insert(t_wes_cache *cache, t_wes_index *index)
+{
+    t_wes_index *other;
+    systhread_mutex_lock(cache->mutex);
+    other = wes_cache_find(cache, index->buffer, index->modtime, index->fingerprint, index->frames, index->channel, index->minsamp, index->ncross);
+    if (other) {
+        // someone else got there first
+        other->refcount++;
+        systhread_mutex_unlock(cache->mutex);
+        wes_cache_index_free(index);
+        return other;
+    }
+    wes_cache_push_front(cache, index);
+    cache->numentries++;
+    cache->bytes += index->bytes;
+    wes_cache_trim(cache, cache->maxbytes);
+    systhread_mutex_unlock(cache->mutex);
+    return index;
+}
+
+
+static inline void wes_cache_release(t_wes_index *index);
+
+// background warm-up of the log-spaced minsamp levels of a referenced base index, released when done
+static inline void *wes_cache_warm_threadproc(t_wes_index *base)
+{
+    t_wes_cache *cache = wes_cache_get();
+    long minsamp;
+
+    for (minsamp = WES_CACHE_WARM_MINSAMP; minsamp <= WES_CACHE_WARM_MAXMINSAMP; minsamp *= 2) {
+        t_wes_index *index = wes_cache_lookup(cache, base->buffer, base->modtime, base->fingerprint,
+                                              base->frames, base->channel, minsamp, base->warmed, 0);
+        if (!index)
+            index = wes_cache_insert(cache, wes_cache_index_derive(base, minsamp, base->warmed));
+        wes_cache_release(index);
+    }
+
+    wes_cache_release(base);
+    systhread_mutex_lock(cache->mutex);
+    cache->warming = 0;
+    systhread_mutex_unlock(cache->mutex);
+    systhread_exit(0);
+    return NULL;
+}
+
+/** Starts warming up the minsamp levels of a base index for <ncross>, unless they are or another warm-up is underway */
+static inline void wes_cache_warm(t_wes_cache *cache, t_wes_index *base, long ncross)
+{
+    t_systhread previous = NULL;
+    unsigned int ret;
+
+    systhread_mutex_lock(cache->mutex);
+    if (cache->warming || base->warmed == ncross) {
+        systhread_mutex_unlock(cache->mutex);
+        return;
+    }
+    previous = cache->warmthread;
+    cache->warmthread = NULL;
+    cache->warming = 1;
+    base->warmed = ncross;
+    base->refcount++;
+    systhread_mutex_unlock(cache->mutex);
+
+    // the previous warm-up is over, or about to be
+    if (previous)
+        systhread_join(previous, &ret);
+
+    // the thread can't report it's done before its handle is stored
+    systhread_mutex_lock(cache->mutex);
+    if (systhread_create((method)wes_cache_warm_threadproc, base, 0, 0, 0, &cache->warmthread)) {
+        cache->warmthread = NULL;
+        cache->warming = 0;
+        base->refcount--;
+    }
+    systhread_mutex_unlock(cache->mutex);
+}
+
+/** Returns the segmentation of one planar channel of <buffer> (in[1] ... in[frames]), reusing a cached one when possible.
+    Segmentations are derived from the base index of the channel, which is only computed from the samples
+    if it is neither cached nor stored in <indexdir> (where it is then written).
+    With <warm> set, the segmentations at log-spaced minsamp values are then built in background.
+    <channel> is 1-based, WES_CHANNEL_MIX or WES_CHANNEL_MID. The index must be given back with wes_cache_release(). */
+static inline t_wes_index *wes_cache_acquire(t_buffer_obj *buffer, long channel, const float *in, long frames, long minsamp, long ncross,
+                                             t_symbol *indexdir, long warm)
+{
+    char path[MAX_PATH_CHARS];
+    long hassidecar, loaded = 0, written = 0, scanned = 0;
+    t_wes_cache *cache = wes_cache_get();
+    t_buffer_info info;
+    t_uint64 fingerprint = wes_cache_fingerprint(in, frames);
+    t_wes_index *index, *base;
+
+    info.b_modtime = 0;
+    buffer_getinfo(buffer, &info);
+    minsamp = MAX(0, minsamp);
+    ncross = MAX(1, ncross);
+
+    if ((index = wes_cache_lookup(cache, buffer, info.b_modtime, fingerprint, frames, channel, minsamp, ncross, 1)))
+        return index;
+
+    // load or segment outside of the lock, so that other objects aren't held up meanwhile
+    if (!(base = wes_cache_lookup(cache, buffer, info.b_modtime, fingerprint, frames, channel, 0, 1, 0))) {
+        // sidecars outlive the buffer, so they are keyed on every sample rather than on the fingerprint
+        t_uint64 contents = indexdir && indexdir->s_name[0] ? wes_sidecar_fingerprint(in, frames) : 0;
+        hassidecar = wes_sidecar_path(indexdir, contents, frames, channel, 0, 1, path);
+        if (hassidecar && (base = wes_cache_index_load(path, contents, frames, channel, 0, 1))) {
+            loaded = 1;
+        } else {
+            base = wes_cache_index_new(in, frames);
+            scanned = 1;
+            if (hassidecar)
+                written = !wes_sidecar_write(path, contents, frames, channel, 0, 1, &base->features);
+        }
+        base->buffer = buffer;
+        base->modtime = info.b_modtime;
+        base->fingerprint = fingerprint;
+        base->channel = channel;
+        base->refcount = 1;
+        base = wes_cache_insert(cache, base);
+
+        systhread_mutex_lock(cache->mutex);
+        cache->sidecarloads += loaded;
+        cache->sidecarwrites += written;
+        cache->scans += scanned;
+        systhread_mutex_unlock(cache->mutex);
+    }
+
+    if (warm)
+        wes_cache_warm(cache, base, ncross);
+
+    if (minsamp == 0 && ncross == 1)
+        return base;
+
+    index = wes_cache_index_derive(base, minsamp, ncross);
+    wes_cache_release(base);
+    return wes_cache_insert(cache, index);
+}
+
+
+static inline void wes_cache_release(t_wes_index *index)
+{
+    t_wes_cache *cache = wes_cache_get();
+    if (!index)
+        return;
+    systhread_mutex_lock(cache->mutex);
+    index->refcount--;
+    wes_cache_trim(cache, cache->maxbytes);
+    systhread_mutex_unlock(cache->mutex);
+}
+
+
+/** Takes one more reference on an acquired index */
+static inline t_wes_index *wes_cache_retain(t_wes_index *index)
+{
+    t_wes_cache *cache = wes_cache_get();
+    systhread_mutex_lock(cache->mutex);
+    index->refcount++;
+    systhread_mutex_unlock(cache->mutex);
+    return index;
+}
+
+
+/** For a <linkchannels> mode other than WES_LINK_OFF, returns the index all the channels of <buffer> are synthesized from,
+    segmenting either the mean of all channels or the (1-based) <keychannel> of <planar>;
+    returns NULL when channels aren't linked. The index must be given back with wes_cache_release(). */
+static inline t_wes_index *wes_cache_acquire_linked(t_buffer_obj *buffer, t_wes_planar *planar,
+                                                    long linkchannels, long keychannel, long minsamp, long ncross, t_symbol *indexdir, long warm)
+{
+    long frames = planar->frames, nchan = planar->nchan, j, c;
+    size_t mark = wes_arena_mark(planar->arena);
+    t_wes_index *index;
+    float *in;
+
+    if (linkchannels == WES_LINK_KEY) {
+        long channel = CLAMP(keychannel, 1, nchan);
+        return wes_cache_acquire(buffer, channel, wes_planar_channel(planar, channel), frames, minsamp, ncross, indexdir, warm);
+    }
+    if (linkchannels != WES_LINK_MID)
+        return NULL;
+
+    // a single pass over the interleaved samples
+    in = (float *)wes_arena_alloc(planar->arena, (frames + 1) * sizeof(float));
+    in[0] = 0;
+    for (j = 0; j < frames; j++) {
+        const float *frame = planar->tab + j * nchan;
+        double sum = 0;
+        for (c = 0; c < nchan; c++)
+            sum += frame[c];
+        in[j + 1] = sum / nchan;
+    }
+
+    index = wes_cache_acquire(buffer, WES_CHANNEL_MID, in, frames, minsamp, ncross, indexdir, warm);
+    wes_arena_rewind(planar->arena, mark);
+    return index;
+}
+
+
+/** Returns the index the (1-based) channel <z> of <planar> is synthesized from: with linked channels, every channel is
+    synthesized from the same segmentation, <linked> (see wes_cache_acquire_linked()), of which it takes one more reference;
+    otherwise each is segmented on its own. The index must be given back with wes_cache_release(). */
+static inline t_wes_index *wes_cache_acquire_channel(t_buffer_obj *buffer, t_wes_planar *planar, long z, t_wes_index *linked,
+                                                     long minsamp, long ncross, t_symbol *indexdir, long warm)
+{
+    if (linked)
+        return wes_cache_retain(linked);
+    return wes_cache_acquire(buffer, z, wes_planar_channel(planar, z), planar->frames, minsamp, ncross, indexdir, warm);
+}
+
+
+/**********************************************************************/
+// Messages shared by all wes objects
+
+static inline void wes_cache_cacheinfo(t_object *x)
+{
+    t_wes_cache *cache = wes_cache_get();
+    systhread_mutex_lock(cache->mutex);
+    object_post(x, "waveset index cache: %ld entries, %.2f of %.2f MB, %llu hits, %llu misses, %llu evictions, %llu buffer scans, %llu sidecars loaded, %llu written",
+                cache->numentries, cache->bytes / 1048576., cache->maxbytes / 1048576.,
+                (unsigned long long)cache->hits, (unsigned long long)cache->misses, (unsigned long long)cache->evictions, (unsigned long long)cache->scans,
+                (unsigned long long)cache->sidecarloads, (unsigned long long)cache->sidecarwrites);
+    systhread_mutex_unlock(cache->mutex);
+}
+
+static inline void wes_cache_cachesize(t_object *x, double megabytes)
+{
+    t_wes_cache *cache = wes_cache_get();
+    systhread_mutex_lock(cache->mutex);
+    cache->maxbytes = (long)(MAX(0, megabytes) * 1048576.);
+    wes_cache_trim(cache, cache->maxbytes);
+    systhread_mutex_unlock(cache->mutex);
+}
+
+static inline void wes_cache_cacheclear(t_object *x)
+{
+    t_wes_cache *cache = wes_cache_get();
+    systhread_mutex_lock(cache->mutex);
+    wes_cache_trim(cache, 0);
+    cache->hits = cache->misses = cache->evictions = cache->scans = cache->sidecarloads = cache->sidecarwrites = 0;
+    systhread_mutex_unlock(cache->mutex);
+}
+
+/// Declares the cacheinfo, cachesize and cacheclear messages, and creates the cache
+#define WES_DECLARE_CACHE_METHODS(c) \
+    class_addmethod(c, (method)wes_cache_cacheinfo, "cacheinfo", 0); \
+    class_addmethod(c, (method)wes_cache_cachesize, "cachesize", A_FLOAT, 0); \
+    class_addmethod(c, (method)wes_cache_cacheclear, "cacheclear", 0); \
+    wes_cache_get();
+
+#endif // _WES_CACHE_H_
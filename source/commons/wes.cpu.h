@@ -0,0 +1,55 @@
+/**
+@file
+wes.cpu.h
+
+@brief
+Run-time choice of the x86 vector paths
+
+@description
+The externals are built for the baseline x86_64 instruction set (SSE2), so
+that they load on every Intel Mac, while the hot loops of resampling (see
+wes.resample.h and wes.sinc.h) have AVX2 paths as well. Those are compiled
+for AVX2 on their own and taken whenever the processor, and the system,
+support it; builds that target AVX2 altogether take them unconditionally.
+
+@owner
+Marco Marasciuolo
+*/
+
+#ifndef _WES_CPU_H_
+#define _WES_CPU_H_
+
+#if defined(__AVX2__)
+
+#include <immintrin.h>
+#define WES_CPU_AVX2                        ///< AVX2 paths are compiled
+#define WES_CPU_AVX2_TARGET                 ///< Attribute of the functions holding them
+#define wes_cpu_avx2()          1           ///< Whether they can be taken
+
+#elif defined(__GNUC__) && defined(__x86_64__)
+
+#include <immintrin.h>
+#include <cpuid.h>
+#define WES_CPU_AVX2
+#define WES_CPU_AVX2_TARGET     __attribute__((target("avx2")))
+
+/** Whether the processor has AVX2 and the system saves the AVX registers */
+static inline long wes_cpu_avx2(void)
+{
+    static int avx2 = -1;
+    if (avx2 < 0) {
+        unsigned int a, b, c, d, lo, hi;
+        int found = 0;
+        if (__get_cpuid_max(0, NULL) >= 7 && __get_cpuid(1, &a, &b, &c, &d) && (c & bit_OSXSAVE) && (c & bit_AVX)) {
+            __asm__ ("xgetbv" : "=a" (lo), "=d" (hi) : "c" (0));
+            __cpuid_count(7, 0, a, b, c, d);
+            found = (lo & 6) == 6 && (b & bit_AVX2);
+        }
+        avx2 = found;
+    }
+    return avx2;
+}
+
+#endif
+
+#endif // _WES_CPU_H_
@@ -0,0 +1,117 @@
+/**
+@file
+wes.curves.h
+
+@brief
+Envelope curves kept across wavesets
+
+@description
+Kernels that shape the repeats of a waveset along a curve, such as
+wes.repeat.enveloping~, read it at the repeats u = 1 ... <m>repeat</m> as
+(u/<m>repeat</m>)^<m>slope</m> when rising, 1 - (1 - u/<m>repeat</m>)^<m>slope</m>
+when falling. Curves only depend on the repeat count, the slope and their
+kind, so each one is computed once into a table that the object keeps for
+the next wavesets and bangs; a new one takes the place of an old one when
+all the slots it may take are full.
+The tables handed out for the waveset being synthesized are pinned until
+the next waveset starts (see wes_curves_next()), so that looking one curve
+up never evicts another one the waveset is still reading.
+
+@owner
+Marco Marasciuolo
+*/
+
+#ifndef _WES_CURVES_H_
+#define _WES_CURVES_H_
+
+#include "ext.h"
+#include "ext_obex.h"
+
+#define WES_CURVES_SLOTS    64      ///< Power of 2
+#define WES_CURVES_PROBES   4       ///< Slots a curve may take, from the one its repeat count hashes to
+#define WES_CURVES_PINNED   2       ///< Most curves a waveset may hold, less than WES_CURVES_PROBES
+
+typedef struct _wes_curve {
+    int     repeat;     ///< Repeat count, 0 for a free slot
+    float   slope;
+    char    fall;       ///< Falling curve rather than rising
+    long    waveset;    ///< Waveset it was last handed out for
+    float   *values;    ///< Curve at the repeats u = 1 ... repeat
+} t_wes_curve;
+
+typedef struct _wes_curves {
+    t_wes_curve slots[WES_CURVES_SLOTS];
+    long        waveset;    ///< Waveset being synthesized, whose curves can't be evicted
+} t_wes_curves;
+
+
+/** Empties the curves of a new object */
+static inline void wes_curves_init(t_wes_curves *c)
+{
+    for (long i = 0; i < WES_CURVES_SLOTS; i++) {
+        c->slots[i].repeat = 0;
+        c->slots[i].waveset = 0;
+    }
+    c->waveset = 1;
+}
+
+
+/** Frees the tables of the curves */
+static inline void wes_curves_free(t_wes_curves *c)
+{
+    for (long i = 0; i < WES_CURVES_SLOTS; i++)
+        if (c->slots[i].repeat)
+            sysmem_freeptr(c->slots[i].values);
+}
+
+
+/** Starts the next waveset: the curves handed out for the previous one may be evicted again */
+static inline void wes_curves_next(t_wes_curves *c)
+{
+    c->waveset++;
+}
+
+
+/** Curve of <repeat> values at the given <slope>, rising or falling, valid until the next waveset starts
+    (at most WES_CURVES_PINNED curves per waveset) */
+static inline const float *wes_curves_get(t_wes_curves *c, int repeat, float slope, char fall)
+{
+    long slot = repeat & (WES_CURVES_SLOTS - 1), free = -1, victim = -1, i, s;
+    t_wes_curve *curve;
+    float *values;
+    int u;
+
+    for (i = 0; i < WES_CURVES_PROBES; i++) {
+        s = (slot + i) & (WES_CURVES_SLOTS - 1);
+        curve = &c->slots[s];
+        if (curve->repeat == repeat && curve->slope == slope && curve->fall == fall) {
+            curve->waveset = c->waveset;
+            return curve->values;
+        }
+        // a free slot if any, otherwise the first one the current waveset isn't holding (its other curves leave one)
+        if (curve->repeat == 0 && free < 0)
+            free = s;
+        if (curve->waveset != c->waveset && victim < 0)
+            victim = s;
+    }
+
+    curve = &c->slots[free >= 0 ? free : victim >= 0 ? victim : slot];
+    if (curve->repeat)
+        sysmem_freeptr(curve->values);
+    values = (float *)sysmem_newptr(repeat * sizeof(float));
+    if (fall) {
+        for (u = 1 ; u <= repeat ; u++)
+            values[u - 1] = 1. - pow(1. - (float)u/repeat, slope);
+    } else {
+        for (u = 1 ; u <= repeat ; u++)
+            values[u - 1] = pow((float)u/repeat, slope);
+    }
+    curve->repeat = repeat;
+    curve->slope = slope;
+    curve->fall = fall;
+    curve->waveset = c->waveset;
+    curve->values = values;
+    return values;
+}
+
+#endif // _WES_CURVES_H_
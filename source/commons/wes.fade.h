@@ -0,0 +1,58 @@
+/**
+@file
+wes.fade.h
+
+@brief
+Equal-power crossfade curves
+
+@description
+Crossfading kernels weigh the waveset fading out by cos(<m>x</m> * pi/2) and
+the one fading in by sin(<m>x</m> * pi/2), <m>x</m> running from 0 to 1 over
+the fade. Rather than calling both on every output sample, they read a
+table of one cycle of sine, <m>WES_FADE_QUARTER</m> points per quarter,
+interpolating linearly between points: the error stays below 3e-7, under
+the precision of the float gains the kernels always used. Positions past
+the end of the fade wrap around the cycle, as the sine and cosine did.
+The table is filled once, from ext_main().
+
+@owner
+Marco Marasciuolo
+*/
+
+#ifndef _WES_FADE_H_
+#define _WES_FADE_H_
+
+#include "ext.h"
+
+#define WES_FADE_QUARTER        1024    ///< Table points per quarter of a cycle
+#define WES_FADE_CYCLE          (4 * WES_FADE_QUARTER)
+
+static float wes_fade_table[WES_FADE_CYCLE + 1];
+
+
+/** Fills the sine table; call it once from ext_main() */
+static inline void wes_fade_init(void)
+{
+    long i;
+    for (i = 0; i <= WES_FADE_CYCLE; i++)
+        wes_fade_table[i] = sin(i * (2 * PI / WES_FADE_CYCLE));
+}
+
+/** Table points per sample of a fade lasting <dur> samples; fades of no duration stay at their start */
+static inline double wes_fade_rate(double dur)
+{
+    return dur > 0 ? WES_FADE_QUARTER / dur : 0;
+}
+
+/** Gains of the waveset fading in and of the one fading out, <pos> table points (see wes_fade_rate()) into the fade */
+static inline void wes_fade_gains(double pos, float *fadeIn, float *fadeOut)
+{
+    long a = (long)pos;
+    float frac = pos - a;
+    const float *in = wes_fade_table + (a & (WES_FADE_CYCLE - 1));
+    const float *out = wes_fade_table + ((a + WES_FADE_QUARTER) & (WES_FADE_CYCLE - 1));
+    *fadeIn = in[0] + frac * (in[1] - in[0]);
+    *fadeOut = out[0] + frac * (out[1] - out[0]);
+}
+
+#endif // _WES_FADE_H_
@@ -0,0 +1,257 @@
+/**
+@file
+wes.features.h
+
+@brief
+Per-waveset feature tables shared by all wes objects
+
+@description
+A feature table describes every waveset of a segmented channel: where it
+starts, its period, its positive, negative and absolute peaks, its energy
+and RMS, the values of its first and last samples, and the interpolated
+(sub-sample) position of its closing crossing along with the resulting
+fractional period.
+The table is a struct of arrays living in a single block, laid out so that
+it can be written to and mapped from a sidecar file as is, and it is filled
+in one vectorized pass over the samples.
+Waveset <m>g</m> covers the samples from <m>start[g]</m> up to (excluded)
+<m>zerocrossindex[g]</m>; its peaks are measured after <m>start[g]</m> up
+to and including <m>zerocrossindex[g]</m>, as the wes objects always did.
+Every array holds <m>count</m> + 1 entries, entry 0 being 0.
+
+@owner
+Marco Marasciuolo
+*/
+
+#ifndef _WES_FEATURES_H_
+#define _WES_FEATURES_H_
+
+#include "wes.segment.h"
+
+typedef struct _wes_features {
+    long    count;              ///< Number of wavesets
+    long    *zerocrossindex;    ///< Waveset ends
+    long    *start;             ///< First sample of each waveset, i.e. the previous end
+    long    *period;            ///< zerocrossindex[g] - start[g]
+    double  *absPeak;
+    double  *posPeak;           ///< Never below 0
+    double  *negPeak;           ///< Never above 0
+    double  *energy;            ///< Sum of the squared samples
+    double  *rms;
+    double  *first;             ///< in[start[g]]
+    double  *last;              ///< in[zerocrossindex[g] - 1]
+    double  *crossing;          ///< Where the line through in[zerocrossindex[g] - 1] and in[zerocrossindex[g]] crosses 0
+    double  *exactPeriod;       ///< crossing[g] - crossing[g - 1]
+} t_wes_features;
+
+
+// offset of the double arrays
+static inline long wes_features_doubles_offset(long count)
+{
+    return 3 * (count + 1) * sizeof(long);
+}
+
+/** Size of the block holding the table of <count> wavesets */
+static inline long wes_features_size(long count)
+{
+    return wes_features_doubles_offset(count) + 9 * (count + 1) * sizeof(double);
+}
+
+/** Points the arrays of <wf> into <data>, a block of wes_features_size(<count>) bytes */
+static inline void wes_features_bind(t_wes_features *wf, void *data, long count)
+{
+    long n = count + 1;
+    wf->count = count;
+    wf->zerocrossindex = (long *)data;
+    wf->start = wf->zerocrossindex + n;
+    wf->period = wf->start + n;
+    wf->absPeak = (double *)((char *)data + wes_features_doubles_offset(count));
+    wf->posPeak = wf->absPeak + n;
+    wf->negPeak = wf->posPeak + n;
+    wf->energy = wf->negPeak + n;
+    wf->rms = wf->energy + n;
+    wf->first = wf->rms + n;
+    wf->last = wf->first + n;
+    wf->crossing = wf->last + n;
+    wf->exactPeriod = wf->crossing + n;
+}
+
+static inline void wes_features_clear_first(t_wes_features *wf)
+{
+    wf->zerocrossindex[0] = wf->start[0] = wf->period[0] = 0;
+    wf->absPeak[0] = wf->posPeak[0] = wf->negPeak[0] = 0;
+    wf->energy[0] = wf->rms[0] = wf->first[0] = wf->last[0] = 0;
+    wf->crossing[0] = wf->exactPeriod[0] = 0;
+}
+
+
+/** Sub-sample position of the upward crossing between in[e - 1] <= 0 and in[e] >= 0 */
+static inline double wes_features_crossing(const float *in, long e)
+{
+    double a = in[e - 1], b = in[e];
+    return b > a ? (e - 1) - a / (b - a) : e;
+}
+
+
+typedef struct _wes_features_job {
+    const float     *in;
+    t_wes_features  *wf;
+} t_wes_features_job;
+
+// fills wavesets from + 1 to to (included)
+static inline void wes_features_compute_range(t_wes_features_job *job, long chunk, long from, long to)
+{
+    const float *in = job->in;
+    t_wes_features *wf = job->wf;
+    long g;
+
+    for (g = from + 1; g <= to; g++) {
+        long s = wf->zerocrossindex[g - 1], e = wf->zerocrossindex[g], j = s + 1;
+        double maxPosPeak = 0, maxNegPeak = 0, energy = (double)in[s] * in[s];
+
+        // the samples strictly inside the waveset count both for the peaks and the energy
+        // peaks are taken on the samples as they are, squares are summed in double
+#if defined(WES_SEGMENT_AVX2)
+        if (j + 8 <= e) {
+            __m256 vmax = _mm256_setzero_ps(), vmin = _mm256_setzero_ps();
+            __m256d vsum = _mm256_setzero_pd();
+            float lanes[8];
+            double sums[4];
+            for (; j + 8 <= e; j += 8) {
+                __m256 v = _mm256_loadu_ps(in + j);
+                __m256d lo = _mm256_cvtps_pd(_mm256_castps256_ps128(v)), hi = _mm256_cvtps_pd(_mm256_extractf128_ps(v, 1));
+                vmax = _mm256_max_ps(vmax, v);
+                vmin = _mm256_min_ps(vmin, v);
+                vsum = _mm256_add_pd(vsum, _mm256_add_pd(_mm256_mul_pd(lo, lo), _mm256_mul_pd(hi, hi)));
+            }
+            _mm256_storeu_ps(lanes, vmax);
+            maxPosPeak = MAX(MAX(MAX(lanes[0], lanes[1]), MAX(lanes[2], lanes[3])), MAX(MAX(lanes[4], lanes[5]), MAX(lanes[6], lanes[7])));
+            _mm256_storeu_ps(lanes, vmin);
+            maxNegPeak = MIN(MIN(MIN(lanes[0], lanes[1]), MIN(lanes[2], lanes[3])), MIN(MIN(lanes[4], lanes[5]), MIN(lanes[6], lanes[7])));
+            _mm256_storeu_pd(sums, vsum);
+            energy += (sums[0] + sums[1]) + (sums[2] + sums[3]);
+        }
+#elif defined(WES_SEGMENT_SSE2)
+        if (j + 4 <= e) {
+            __m128 vmax = _mm_setzero_ps(), vmin = _mm_setzero_ps();
+            __m128d vsum = _mm_setzero_pd();
+            float lanes[4];
+            double sums[2];
+            for (; j + 4 <= e; j += 4) {
+                __m128 v = _mm_loadu_ps(in + j);
+                __m128d lo = _mm_cvtps_pd(v), hi = _mm_cvtps_pd(_mm_movehl_ps(v, v));
+                vmax = _mm_max_ps(vmax, v);
+                vmin = _mm_min_ps(vmin, v);
+                vsum = _mm_add_pd(vsum, _mm_add_pd(_mm_mul_pd(lo, lo), _mm_mul_pd(hi, hi)));
+            }
+            _mm_storeu_ps(lanes, vmax);
+            maxPosPeak = MAX(MAX(lanes[0], lanes[1]), MAX(lanes[2], lanes[3]));
+            _mm_storeu_ps(lanes, vmin);
+            maxNegPeak = MIN(MIN(lanes[0], lanes[1]), MIN(lanes[2], lanes[3]));
+            _mm_storeu_pd(sums, vsum);
+            energy += sums[0] + sums[1];
+        }
+#elif defined(WES_SEGMENT_NEON)
+        if (j + 4 <= e) {
+            float32x4_t vmax = vdupq_n_f32(0.f), vmin = vdupq_n_f32(0.f);
+            float64x2_t vsum = vdupq_n_f64(0.);
+            for (; j + 4 <= e; j += 4) {
+                float32x4_t v = vld1q_f32(in + j);
+                float64x2_t lo = vcvt_f64_f32(vget_low_f32(v)), hi = vcvt_high_f64_f32(v);
+                vmax = vmaxq_f32(vmax, v);
+                vmin = vminq_f32(vmin, v);
+                vsum = vfmaq_f64(vfmaq_f64(vsum, lo, lo), hi, hi);
+            }
+            maxPosPeak = vmaxvq_f32(vmax);
+            maxNegPeak = vminvq_f32(vmin);
+            energy += vaddvq_f64(vsum);
+        }
+#endif
+        for (; j < e; j++) {
+            double v = in[j];
+            maxPosPeak = MAX(maxPosPeak, v);
+            maxNegPeak = MIN(maxNegPeak, v);
+            energy += v * v;
+        }
+        maxPosPeak = MAX(maxPosPeak, in[e]);
+        maxNegPeak = MIN(maxNegPeak, in[e]);
+
+        wf->start[g] = s;
+        wf->period[g] = e - s;
+        wf->posPeak[g] = maxPosPeak;
+        wf->negPeak[g] = maxNegPeak;
+        wf->absPeak[g] = MAX(maxPosPeak, -maxNegPeak);
+        wf->energy[g] = energy;
+        wf->rms[g] = e > s ? sqrt(energy / (e - s)) : 0;
+        wf->first[g] = in[s];
+        wf->last[g] = in[e - 1];
+        wf->crossing[g] = wes_features_crossing(in, e);
+    }
+}
+
+
+/** Fills a table whose zerocrossindex array (and count) is already set, reading the planar channel <in> once;
+    wavesets are independent, so long channels are shared among all cores. */
+static inline void wes_features_compute(const float *in, t_wes_features *wf)
+{
+    t_wes_features_job job;
+    long frames = wf->zerocrossindex[wf->count], g;
+
+    job.in = in;
+    job.wf = wf;
+    wes_parallel_run(wf->count, wes_parallel_numchunks(frames, WES_SEGMENT_MINCHUNK), (t_wes_parallel_fn)wes_features_compute_range, &job);
+    wes_features_clear_first(wf);
+    for (g = 1; g <= wf->count; g++)
+        wf->exactPeriod[g] = wf->crossing[g] - wf->crossing[g - 1];
+}
+
+
+/** Fills <wf> with the segmentation for <minsamp> and <ncross> derived from a base table (minsamp 0, cross 1),
+    in time proportional to the number of crossings; <wf> must be able to hold base->count wavesets.
+    Waveset ends and peaks are the same as segmenting the samples directly. */
+static inline void wes_features_derive(const t_wes_features *base, long minsamp, long ncross, t_wes_features *wf)
+{
+    long i, crosscount = 0, ncrossindex = 0, last = -1, from = 1;
+    double maxPosPeak = 0, maxNegPeak = 0, energy = 0;
+
+    minsamp = MAX(0, minsamp);
+    ncross = MAX(1, ncross);
+
+    for (i = 1; i <= base->count; i++) {
+        long j = base->zerocrossindex[i];
+
+        maxPosPeak = MAX(maxPosPeak, base->posPeak[i]);
+        maxNegPeak = MIN(maxNegPeak, base->negPeak[i]);
+        energy += base->energy[i];
+
+        if (j - last > minsamp) {
+            last = j;
+            ncrossindex++;
+
+            if (ncrossindex == ncross) {
+                long s = base->start[from];
+                ncrossindex = 0;
+                crosscount++;
+                wf->zerocrossindex[crosscount] = j;
+                wf->start[crosscount] = s;
+                wf->period[crosscount] = j - s;
+                wf->posPeak[crosscount] = maxPosPeak;
+                wf->negPeak[crosscount] = maxNegPeak;
+                wf->absPeak[crosscount] = MAX(maxPosPeak, -maxNegPeak);
+                wf->energy[crosscount] = energy;
+                wf->rms[crosscount] = j > s ? sqrt(energy / (j - s)) : 0;
+                wf->first[crosscount] = base->first[from];
+                wf->last[crosscount] = base->last[i];
+                wf->crossing[crosscount] = base->crossing[i];
+                wf->exactPeriod[crosscount] = base->crossing[i] - base->crossing[from - 1];
+                maxPosPeak = maxNegPeak = energy = 0;
+                from = i + 1;
+            }
+        }
+    }
+
+    wf->count = crosscount;
+    wes_features_clear_first(wf);
+}
+
+#endif // _WES_FEATURES_H_
@@ -0,0 +1,129 @@
+/**
+@file
+wes.output.h
+
+@brief
+Output buffers of the wes kernels
+
+@description
+Every kernel first works out, from the feature table alone, how many
+samples a channel will produce, so that the output buffer is sized before
+synthesis starts.
+Kernels whose samples are final as soon as they are computed write them
+straight into the locked, interleaved output buffer: every run of samples
+(a block, a waveset, a run of input samples copied as they are or of
+silence, repeats played as wavetables, see wes.wavetable.h) is clipped to
+the output frames once, and its samples are then written unchecked.
+Those that sum into their output (running averages) take from the scratch
+arena of the object (see wes.arena.h) a double buffer holding exactly the
+planned number of samples, so that the per-sample loops never need a
+bounds check; overlap-add keeps only a sliding window of it.
+As the wes objects always did, the first synthesized sample is dropped and
+the length of the output is set by the first channel.
+
+@owner
+Marco Marasciuolo
+*/
+
+#ifndef _WES_OUTPUT_H_
+#define _WES_OUTPUT_H_
+
+#include "ext.h"
+
+typedef struct _wes_output {
+    float   *tab;       ///< Interleaved samples of the (locked) output buffer
+    long    frames;
+    long    nchan;
+    long    channel;    ///< 0-based channel being written
+} t_wes_output;
+
+
+/** Starts writing the (1-based) channel <z> of the <nchan> channels of <frames> samples interleaved in <tab> */
+static inline void wes_output_begin(t_wes_output *o, float *tab, long frames, long nchan, long z)
+{
+    o->tab = tab;
+    o->frames = MAX(0, frames);
+    o->nchan = nchan;
+    o->channel = z - 1;
+}
+
+/** Clips the run of <n> samples synthesized from the sample <h> on to the output frames: returns how many of them
+    are written, starting from the <*skip>-th one (none before the first output frame or past the last one) */
+static inline long wes_output_clip(const t_wes_output *o, long h, long n, long *skip)
+{
+    long from = MAX(h, 1), to = MIN(h + n, o->frames + 1);
+    *skip = from - h;
+    return MAX(0, to - from);
+}
+
+/** Writes the synthesized sample <h> of the channel to frame <h> - 1, unchecked: <h> lies within a run clipped by wes_output_clip() */
+static inline void wes_output_write(const t_wes_output *o, long h, double v)
+{
+    o->tab[(h - 1) * o->nchan + o->channel] = v;
+}
+
+/** Writes the <n> samples of <src> as the synthesized samples <h> ... <h> + <n> - 1 of the channel */
+static inline void wes_output_copy(const t_wes_output *o, long h, const float *src, long n)
+{
+    long skip, count = wes_output_clip(o, h, n, &skip), i;
+    float *dst;
+
+    if (!count)
+        return;
+    dst = o->tab + (h + skip - 1) * o->nchan + o->channel;
+    src += skip;
+    if (o->nchan == 1)
+        memcpy(dst, src, count * sizeof(float));
+    else
+        for (i = 0; i < count; i++)
+            dst[i * o->nchan] = src[i];
+}
+
+/** Writes the <n> samples of <src> as the synthesized samples <h> ... <h> + <n> - 1 of the channel */
+static inline void wes_output_block(const t_wes_output *o, long h, const double *src, long n)
+{
+    long skip, count = wes_output_clip(o, h, n, &skip), i;
+    float *dst;
+
+    if (!count)
+        return;
+    dst = o->tab + (h + skip - 1) * o->nchan + o->channel;
+    src += skip;
+    for (i = 0; i < count; i++)
+        dst[i * o->nchan] = src[i];
+}
+
+/** Writes <n> zeros as the synthesized samples <h> ... <h> + <n> - 1 of the channel */
+static inline void wes_output_silence(const t_wes_output *o, long h, long n)
+{
+    long skip, count = wes_output_clip(o, h, n, &skip), i;
+    float *dst;
+
+    if (!count)
+        return;
+    dst = o->tab + (h + skip - 1) * o->nchan + o->channel;
+    if (o->nchan == 1)
+        memset(dst, 0, count * sizeof(float));
+    else
+        for (i = 0; i < count; i++)
+            dst[i * o->nchan] = 0;
+}
+
+/** Silences the frames left over by a channel of <h> synthesized samples, shorter than the first one */
+static inline void wes_output_finish(const t_wes_output *o, long h)
+{
+    long i;
+    float *dst = o->tab + o->channel;
+    for (i = MAX(0, h - 1); i < o->frames; i++)
+        dst[i * o->nchan] = 0;
+}
+
+
+/** Zeroes what a channel of <h> samples leaves over of the first <frames> ones, which are all written to the output */
+static inline void wes_output_pad(double *dataout, long h, long frames)
+{
+    if (h < frames)
+        memset(dataout + MAX(0, h), 0, (frames - MAX(0, h)) * sizeof(double));
+}
+
+#endif // _WES_OUTPUT_H_
@@ -0,0 +1,106 @@
+/**
+@file
+wes.parallel.h
+
+@brief
+Splitting of long analysis passes across cores
+
+@description
+A pass over <m>count</m> items is split into contiguous chunks, the first
+one running on the calling thread and the others on systhreads, and the
+call returns once every chunk is done.
+Short passes are not worth the thread startup and run as a single chunk.
+
+@owner
+Marco Marasciuolo
+*/
+
+#ifndef _WES_PARALLEL_H_
+#define _WES_PARALLEL_H_
+
+#include "ext.h"
+#include "ext_systhread.h"
+
+#ifdef MAC_VERSION
+#include <unistd.h>
+#endif
+
+#define WES_PARALLEL_MAXTHREADS     64
+
+/** Processes items <from> (included) to <to> (excluded) as chunk number <chunk> */
+typedef void (*t_wes_parallel_fn)(void *arg, long chunk, long from, long to);
+
+typedef struct _wes_parallel_job {
+    t_wes_parallel_fn   fn;
+    void                *arg;
+    long                chunk;
+    long                from;
+    long                to;
+} t_wes_parallel_job;
+
+
+static inline long wes_parallel_numcores(void)
+{
+    static long numcores = 0;
+    if (!numcores) {
+#ifdef MAC_VERSION
+        numcores = sysconf(_SC_NPROCESSORS_ONLN);
+#else
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        numcores = info.dwNumberOfProcessors;
+#endif
+        numcores = CLAMP(numcores, 1, WES_PARALLEL_MAXTHREADS);
+    }
+    return numcores;
+}
+
+
+/** Number of chunks a pass over <count> items is split into, each holding at least <minchunk> items */
+static inline long wes_parallel_numchunks(long count, long minchunk)
+{
+    return CLAMP(count / MAX(1, minchunk), 1, wes_parallel_numcores());
+}
+
+
+static inline void *wes_parallel_threadproc(t_wes_parallel_job *job)
+{
+    job->fn(job->arg, job->chunk, job->from, job->to);
+    systhread_exit(0);
+    return NULL;
+}
+
+
+/** Runs <fn> over <count> items split into <numchunks> chunks (see wes_parallel_numchunks()) */
+static inline void wes_parallel_run(long count, long numchunks, t_wes_parallel_fn fn, void *arg)
+{
+    t_wes_parallel_job jobs[WES_PARALLEL_MAXTHREADS];
+    t_systhread threads[WES_PARALLEL_MAXTHREADS];
+    unsigned int ret;
+    long i;
+
+    numchunks = CLAMP(numchunks, 1, WES_PARALLEL_MAXTHREADS);
+    for (i = 0; i < numchunks; i++) {
+        jobs[i].fn = fn;
+        jobs[i].arg = arg;
+        jobs[i].chunk = i;
+        jobs[i].from = (long)((double)count * i / numchunks);
+        jobs[i].to = (long)((double)count * (i + 1) / numchunks);
+        threads[i] = NULL;
+    }
+
+    for (i = 1; i < numchunks; i++) {
+        if (systhread_create((method)wes_parallel_threadproc, jobs + i, 0, 0, 0, threads + i))
+            threads[i] = NULL;
+    }
+    fn(arg, 0, jobs[0].from, jobs[0].to);
+
+    for (i = 1; i < numchunks; i++) {
+        if (threads[i])
+            systhread_join(threads[i], &ret);
+        else // couldn't start a thread: do its share here
+            fn(arg, i, jobs[i].from, jobs[i].to);
+    }
+}
+
+#endif // _WES_PARALLEL_H_
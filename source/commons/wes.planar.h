@@ -0,0 +1,183 @@
+/**
+@file
+wes.planar.h
+
+@brief
+Conversion between interleaved buffer samples and planar channels
+
+@description
+The kernels work on one planar channel at a time, laid out as <m>frames</m>
++ 1 floats whose first one is 0 (see wes.segment.h).
+Channels keep the single precision of the buffer samples, which a double
+copy wouldn't make any more accurate: the kernels promote samples to double
+as they read them, so computing from floats gives the very same results
+while moving half the bytes, and vectorized scans handle twice the samples
+per instruction.
+All the channels of a buffer are deinterleaved in a single pass over its
+samples, unless they wouldn't fit in <m>WES_PLANAR_MAXBYTES</m>, in which
+case each channel is extracted when it is asked for.
+Output channels are interleaved back one at a time, each touching only its
+own samples.
+The planar channels are taken from the scratch arena of the object (see
+wes.arena.h), and given back with it at the end of the bang.
+
+@owner
+Marco Marasciuolo
+*/
+
+#ifndef _WES_PLANAR_H_
+#define _WES_PLANAR_H_
+
+#include "ext.h"
+#include "wes.arena.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define WES_PLANAR_SSE2
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define WES_PLANAR_NEON
+#endif
+
+#define WES_PLANAR_MAXBYTES     (1024L * 1024L * 1024L)
+#define WES_PLANAR_GUARD        4       ///< Zeroes after the last channel, read by interpolations ending on the last sample
+
+typedef struct _wes_planar {
+    const float *tab;
+    long        frames;
+    long        nchan;
+    long        all;        ///< Whether every channel was deinterleaved at once
+    long        current;    ///< Otherwise, the channel held by data
+    float       *data;
+    t_wes_arena *arena;     ///< Where data comes from
+} t_wes_planar;
+
+
+// splits n stereo frames
+static inline void wes_planar_split2(const float *src, float *left, float *right, long n)
+{
+    long i = 0;
+#if defined(WES_PLANAR_SSE2)
+    for (; i + 4 <= n; i += 4) {
+        __m128 a = _mm_loadu_ps(src + 2 * i), b = _mm_loadu_ps(src + 2 * i + 4);     // l0 r0 l1 r1, l2 r2 l3 r3
+        _mm_storeu_ps(left + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+        _mm_storeu_ps(right + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+    }
+#elif defined(WES_PLANAR_NEON)
+    for (; i + 4 <= n; i += 4) {
+        float32x4x2_t v = vld2q_f32(src + 2 * i);
+        vst1q_f32(left + i, v.val[0]);
+        vst1q_f32(right + i, v.val[1]);
+    }
+#endif
+    for (; i < n; i++) {
+        left[i] = src[2 * i];
+        right[i] = src[2 * i + 1];
+    }
+}
+
+
+/** Sets up the planar view of <nchan> interleaved channels of <frames> samples, in memory taken from <arena>;
+    <tab> must stay locked meanwhile */
+static inline void wes_planar_init(t_wes_planar *p, t_wes_arena *arena, const float *tab, long frames, long nchan)
+{
+    long j, c, stride = frames + 1;
+
+    p->tab = tab;
+    p->frames = frames;
+    p->nchan = nchan;
+    p->all = (double)nchan * stride * sizeof(float) <= WES_PLANAR_MAXBYTES;
+    p->current = 0;
+    p->arena = arena;
+    p->data = (float *)wes_arena_alloc(arena, ((p->all ? nchan : 1) * stride + WES_PLANAR_GUARD) * sizeof(float));
+    memset(p->data + (p->all ? nchan : 1) * stride, 0, WES_PLANAR_GUARD * sizeof(float));
+
+    if (!p->all)
+        return;
+
+    // each channel is followed by the leading 0 of the next one
+    for (c = 0; c < nchan; c++)
+        p->data[c * stride] = 0;
+
+    if (nchan == 1) {
+        memcpy(p->data + 1, tab, frames * sizeof(float));
+    } else if (nchan == 2) {
+        wes_planar_split2(tab, p->data + 1, p->data + stride + 1, frames);
+    } else {
+        for (j = 0; j < frames; j++) {
+            const float *frame = tab + j * nchan;
+            float *dst = p->data + j + 1;
+            for (c = 0; c < nchan; c++)
+                dst[c * stride] = frame[c];
+        }
+    }
+}
+
+
+/** Returns the planar channel <z> (1-based): data[0] is 0, the samples are data[1] ... data[frames] */
+static inline float *wes_planar_channel(t_wes_planar *p, long z)
+{
+    long j, stride = p->frames + 1;
+
+    if (p->all)
+        return p->data + (z - 1) * stride;
+
+    if (p->current != z) {
+        const float *src = p->tab + (z - 1);
+        p->data[0] = 0;
+        if (p->nchan == 1) {
+            memcpy(p->data + 1, src, p->frames * sizeof(float));
+        } else {
+            for (j = 0; j < p->frames; j++)
+                p->data[j + 1] = src[j * p->nchan];
+        }
+        p->current = z;
+    }
+    return p->data;
+}
+
+
+/** Fills <mix> (<frames> + 1 floats, the first being 0) with the running mix of all channels, each one being averaged
+    with the mix of the previous ones as the overlap kernel always did, in a single pass over <tab> */
+static inline void wes_planar_mix(const float *tab, long frames, long nchan, float *mix)
+{
+    long j, c;
+
+    mix[0] = 0;
+    if (nchan == 1) {
+        memcpy(mix + 1, tab, frames * sizeof(float));
+        return;
+    }
+    for (j = 0; j < frames; j++) {
+        const float *frame = tab + j * nchan;
+        double m = frame[0];
+        for (c = 1; c < nchan; c++)
+            m = (m + frame[c]) * 0.5;
+        mix[j + 1] = m;
+    }
+}
+
+
+/** Writes <frames> planar samples <data> into the (1-based) channel <z> of the interleaved <outtab> */
+static inline void wes_planar_interleave(float *outtab, long frames, long nchan, long z, const double *data)
+{
+    long i = 0;
+    float *dst = outtab + (z - 1);
+
+    if (nchan == 1) {
+#if defined(WES_PLANAR_SSE2)
+        for (; i + 4 <= frames; i += 4)
+            _mm_storeu_ps(dst + i, _mm_movelh_ps(_mm_cvtpd_ps(_mm_loadu_pd(data + i)), _mm_cvtpd_ps(_mm_loadu_pd(data + i + 2))));
+#elif defined(WES_PLANAR_NEON)
+        for (; i + 4 <= frames; i += 4)
+            vst1q_f32(dst + i, vcvt_high_f32_f64(vcvt_f32_f64(vld1q_f64(data + i)), vld1q_f64(data + i + 2)));
+#endif
+        for (; i < frames; i++)
+            dst[i] = data[i];
+    } else {
+        for (; i < frames; i++)
+            dst[i * nchan] = data[i];
+    }
+}
+
+#endif // _WES_PLANAR_H_
@@ -0,0 +1,182 @@
+/**
+@file
+wes.pyramid.h
+
+@brief
+Multi-resolution summaries of a base segmentation
+
+@description
+A pyramid sums up the base feature table of a channel (see wes.features.h)
+at coarser and coarser resolutions: level <m>k</m> holds the positive peak,
+negative peak and energy of every block of 2^<m>k</m> consecutive base
+wavesets.
+Any run of base wavesets is then summed up from at most two blocks per
+level, so that the segmentation for a large minsamp is resolved by jumping
+from one accepted crossing to the next and refining the run in between
+through the pyramid, in time proportional to the number of resulting
+wavesets rather than to the number of base crossings.
+Peaks resolved this way are the same as a linear derivation; energies may
+differ in the last bits, as they are summed in a different order.
+
+@owner
+Marco Marasciuolo
+*/
+
+#ifndef _WES_PYRAMID_H_
+#define _WES_PYRAMID_H_
+
+#include "wes.features.h"
+
+#define WES_PYRAMID_MAXLEVELS       32
+#define WES_PYRAMID_SPARSENESS      8       ///< Minsamp, in average base periods, above which the pyramid beats a linear derivation
+
+typedef struct _wes_pyramid {
+    long    count;                                  ///< Number of base wavesets
+    long    numlevels;                              ///< Levels above the base one
+    double  *posPeak[WES_PYRAMID_MAXLEVELS];        ///< Level k holds (count >> k) blocks, block b covering wavesets (b << k) + 1 ... (b + 1) << k
+    double  *negPeak[WES_PYRAMID_MAXLEVELS];
+    double  *energy[WES_PYRAMID_MAXLEVELS];
+    void    *data;
+    long    bytes;
+} t_wes_pyramid;
+
+
+/** Builds the pyramid of a base table, which must outlive it; level 0 is the table itself */
+static inline t_wes_pyramid *wes_pyramid_new(const t_wes_features *base)
+{
+    t_wes_pyramid *pyr = (t_wes_pyramid *)sysmem_newptrclear(sizeof(t_wes_pyramid));
+    long k, b, size = 0;
+    double *p;
+
+    pyr->count = base->count;
+    pyr->posPeak[0] = base->posPeak + 1;
+    pyr->negPeak[0] = base->negPeak + 1;
+    pyr->energy[0] = base->energy + 1;
+
+    for (k = 1; k < WES_PYRAMID_MAXLEVELS && (base->count >> k) > 0; k++)
+        size += base->count >> k;
+    pyr->numlevels = k - 1;
+    pyr->bytes = sizeof(t_wes_pyramid) + 3 * size * sizeof(double);
+    p = (double *)(pyr->data = sysmem_newptr(MAX(1, 3 * size) * sizeof(double)));
+
+    for (k = 1; k <= pyr->numlevels; k++) {
+        long n = base->count >> k;
+        pyr->posPeak[k] = p;
+        pyr->negPeak[k] = p + n;
+        pyr->energy[k] = p + 2 * n;
+        for (b = 0; b < n; b++) {
+            pyr->posPeak[k][b] = MAX(pyr->posPeak[k - 1][2 * b], pyr->posPeak[k - 1][2 * b + 1]);
+            pyr->negPeak[k][b] = MIN(pyr->negPeak[k - 1][2 * b], pyr->negPeak[k - 1][2 * b + 1]);
+            pyr->energy[k][b] = pyr->energy[k - 1][2 * b] + pyr->energy[k - 1][2 * b + 1];
+        }
+        p += 3 * n;
+    }
+    return pyr;
+}
+
+
+static inline void wes_pyramid_free(t_wes_pyramid *pyr)
+{
+    if (pyr) {
+        sysmem_freeptr(pyr->data);
+        sysmem_freeptr(pyr);
+    }
+}
+
+
+/** Sums up base wavesets <from> to <to> (1-based, included) */
+static inline void wes_pyramid_range(const t_wes_pyramid *pyr, long from, long to, double *posPeak, double *negPeak, double *energy)
+{
+    double maxPosPeak = 0, maxNegPeak = 0, sum = 0;
+    long i = from - 1;      // 0-based
+
+    while (i < to) {
+        long k = 0;
+        // largest aligned block starting at i and ending within the range
+        while (k < pyr->numlevels && !(i & ((2L << k) - 1)) && i + (2L << k) <= to)
+            k++;
+        maxPosPeak = MAX(maxPosPeak, pyr->posPeak[k][i >> k]);
+        maxNegPeak = MIN(maxNegPeak, pyr->negPeak[k][i >> k]);
+        sum += pyr->energy[k][i >> k];
+        i += 1L << k;
+    }
+    *posPeak = maxPosPeak;
+    *negPeak = maxNegPeak;
+    *energy = sum;
+}
+
+
+/** Returns the first of the base wavesets <i> ... <count> ending at or after <target>, or <count> + 1 */
+static inline long wes_pyramid_seek(const long *zerocrossindex, long i, long count, long target)
+{
+    long lo, hi, step = 1;
+
+    if (i > count || zerocrossindex[i] >= target)
+        return i;
+
+    // gallop, then bisect: zerocrossindex[lo] < target, and zerocrossindex[hi] >= target unless hi = count + 1
+    lo = i;
+    while (lo + step <= count && zerocrossindex[lo + step] < target) {
+        lo += step;
+        step *= 2;
+    }
+    hi = MIN(lo + step, count + 1);
+    while (hi - lo > 1) {
+        long mid = (lo + hi) / 2;
+        if (zerocrossindex[mid] < target)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return hi;
+}
+
+
+/** Same as wes_features_derive(), visiting only the accepted crossings of the base table */
+static inline void wes_pyramid_derive(const t_wes_features *base, const t_wes_pyramid *pyr, long minsamp, long ncross, t_wes_features *wf)
+{
+    long i = 1, crosscount = 0, ncrossindex = 0, last = -1, from = 1;
+
+    minsamp = MAX(0, minsamp);
+    ncross = MAX(1, ncross);
+
+    while ((i = wes_pyramid_seek(base->zerocrossindex, i, base->count, last + minsamp + 1)) <= base->count) {
+        long j = base->zerocrossindex[i];
+        last = j;
+        ncrossindex++;
+
+        if (ncrossindex == ncross) {
+            long s = base->start[from];
+            double maxPosPeak, maxNegPeak, energy;
+            wes_pyramid_range(pyr, from, i, &maxPosPeak, &maxNegPeak, &energy);
+            ncrossindex = 0;
+            crosscount++;
+            wf->zerocrossindex[crosscount] = j;
+            wf->start[crosscount] = s;
+            wf->period[crosscount] = j - s;
+            wf->posPeak[crosscount] = maxPosPeak;
+            wf->negPeak[crosscount] = maxNegPeak;
+            wf->absPeak[crosscount] = MAX(maxPosPeak, -maxNegPeak);
+            wf->energy[crosscount] = energy;
+            wf->rms[crosscount] = j > s ? sqrt(energy / (j - s)) : 0;
+            wf->first[crosscount] = base->first[from];
+            wf->last[crosscount] = base->last[i];
+            wf->crossing[crosscount] = base->crossing[i];
+            wf->exactPeriod[crosscount] = base->crossing[i] - base->crossing[from - 1];
+            from = i + 1;
+        }
+        i++;
+    }
+
+    wf->count = crosscount;
+    wes_features_clear_first(wf);
+}
+
+
+/** Whether resolving <minsamp> through the pyramid is worth it, rather than walking every base crossing */
+static inline long wes_pyramid_worthwhile(const t_wes_features *base, long frames, long minsamp)
+{
+    return base->count > 0 && (minsamp + 1) * base->count > WES_PYRAMID_SPARSENESS * frames;
+}
+
+#endif // _WES_PYRAMID_H_
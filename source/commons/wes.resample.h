@@ -0,0 +1,205 @@
+/**
+@file
+wes.resample.h
+
+@brief
+Resampling of wavesets
+
+@description
+Most kernels stretch a waveset to a new period by reading it at positions
+<m>from</m> + <m>scale</m> * <m>f</m>, <m>f</m> running over consecutive
+integers (downwards for retrogradations), and interpolating linearly between
+the two samples around each position.
+wes_resample() does so for a block of output samples, which the kernel then
+shapes with its own gains and envelopes: the phase <m>f</m> advances
+incrementally and every position is a single multiply-add away from it, so
+that positions never drift as an accumulated fractional phase would, and
+the results are the very same as computing each sample on its own.
+Positions, weights and interpolations are vectorized (AVX2 gathers on x86
+processors that have them, see wes.cpu.h, SSE2 on the others, NEON on ARM,
+scalar elsewhere), all giving the very same samples.
+Reads may go one sample past the end of a channel, where the planar guard
+(see wes.planar.h) is silent.
+With the <m>quality</m> attribute set to Sinc, every position is read
+through a band-limited filter instead (see wes.sinc.h), chosen for each
+waveset from its scale; samples around it beyond either end of the channel
+read as silence.
+
+@owner
+Marco Marasciuolo
+*/
+
+#ifndef _WES_RESAMPLE_H_
+#define _WES_RESAMPLE_H_
+
+#include "ext.h"
+#include "ext_obex.h"
+#include "wes.sinc.h"
+#include "wes.cpu.h"
+
+#if !defined(__AVX2__) && (defined(__SSE2__) || defined(_M_X64))
+#include <emmintrin.h>
+#define WES_RESAMPLE_SSE2
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define WES_RESAMPLE_NEON
+#endif
+
+#define WES_RESAMPLE_BLOCK      256     ///< Output samples resampled at once by the kernels
+
+// quality attribute values
+#define WES_QUALITY_LINEAR      0       ///< Linear interpolation between the two samples around each position
+#define WES_QUALITY_SINC        1       ///< Band-limited, windowed-sinc interpolation
+
+typedef struct _wes_resampler {
+    const t_wes_sinc    *bank;      ///< Filters for band-limited reads, NULL for linear interpolation
+    const float         *first;     ///< First sample of the channel (the silent one at index 0)
+    const float         *last;      ///< Last sample of the channel
+} t_wes_resampler;
+
+
+/** Scale stretching <period> samples to <newPeriod>, keeping the first and last ones;
+    a single output sample is the first one (rather than reading at an infinite position) */
+static inline double wes_resample_scale(long period, long newPeriod)
+{
+    return newPeriod > 1 ? ((double)period - 1) / ((double)newPeriod - 1) : 0;
+}
+
+
+/** Sets a resampler of the given <quality> up for the <frames> samples of a planar channel */
+static inline void wes_resampler_init(t_wes_resampler *rs, long quality, const float *channel, long frames)
+{
+    rs->bank = quality == WES_QUALITY_SINC ? wes_sinc_get() : NULL;
+    rs->first = channel;
+    rs->last = channel + frames;
+}
+
+
+#if defined(WES_CPU_AVX2)
+/** AVX2 part of wes_resample_linear(): writes the first samples, 4 at a time, and returns how many */
+static WES_CPU_AVX2_TARGET long wes_resample_linear_avx2(const float *in, double from, double scale, long first, long step, long n, double *out)
+{
+    // truncated positions below 2^52 turn into integers through the mantissa of 2^52 + position
+    const __m256d magic = _mm256_set1_pd(4503599627370496.);
+    const __m256d one = _mm256_set1_pd(1.), vscale = _mm256_set1_pd(scale), vfrom = _mm256_set1_pd(from);
+    const __m256d vstep = _mm256_set1_pd(4. * step);
+    __m256d f = _mm256_set_pd(first + 3. * step, first + 2. * step, first + (double)step, (double)first);
+    long i;
+    for (i = 0; i + 4 <= n; i += 4) {
+        __m256d idx = _mm256_add_pd(vfrom, _mm256_mul_pd(vscale, f));
+        __m256d a = _mm256_round_pd(idx, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+        __m256i ia = _mm256_sub_epi64(_mm256_castpd_si256(_mm256_add_pd(a, magic)), _mm256_castpd_si256(magic));
+        __m256d bCF = _mm256_sub_pd(idx, a);
+        __m256d aCF = _mm256_sub_pd(one, bCF);
+        __m256d wa = _mm256_cvtps_pd(_mm256_i64gather_ps(in, ia, 4));
+        __m256d wb = _mm256_cvtps_pd(_mm256_i64gather_ps(in + 1, ia, 4));
+        _mm256_storeu_pd(out + i, _mm256_add_pd(_mm256_mul_pd(aCF, wa), _mm256_mul_pd(bCF, wb)));
+        f = _mm256_add_pd(f, vstep);
+    }
+    return i;
+}
+#endif
+
+/** Writes to <out> the <n> samples of <in> read at <from> + <scale> * (<first> + <step> * i), all positions being positive */
+static inline void wes_resample_linear(const float *in, double from, double scale, long first, long step, long n, double *out)
+{
+    long i = 0;
+
+#if defined(WES_CPU_AVX2)
+    if (n >= 4 && wes_cpu_avx2())
+        i = wes_resample_linear_avx2(in, from, scale, first, step, n, out);
+#endif
+#if defined(WES_RESAMPLE_SSE2)
+    if (n - i >= 2) {
+        // no truncation or gathers: rounding through 2^52 + position, then stepping back where it rounded up
+        const __m128d magic = _mm_set1_pd(4503599627370496.);
+        const __m128d one = _mm_set1_pd(1.), vscale = _mm_set1_pd(scale), vfrom = _mm_set1_pd(from);
+        const __m128d vstep = _mm_set1_pd(2. * step);
+        __m128d f = _mm_set_pd((double)(first + step * (i + 1)), (double)(first + step * i));
+        for (; i + 2 <= n; i += 2) {
+            __m128d idx = _mm_add_pd(vfrom, _mm_mul_pd(vscale, f));
+            __m128d a = _mm_sub_pd(_mm_add_pd(idx, magic), magic);
+            a = _mm_sub_pd(a, _mm_and_pd(_mm_cmpgt_pd(a, idx), one));
+            __m128i ia = _mm_sub_epi64(_mm_castpd_si128(_mm_add_pd(a, magic)), _mm_castpd_si128(magic));
+            __m128d bCF = _mm_sub_pd(idx, a);
+            __m128d aCF = _mm_sub_pd(one, bCF);
+            long a0 = (long)_mm_cvtsi128_si64(ia), a1 = (long)_mm_cvtsi128_si64(_mm_unpackhi_epi64(ia, ia));
+            __m128d wa = _mm_set_pd(in[a1], in[a0]);
+            __m128d wb = _mm_set_pd(in[a1 + 1], in[a0 + 1]);
+            _mm_storeu_pd(out + i, _mm_add_pd(_mm_mul_pd(aCF, wa), _mm_mul_pd(bCF, wb)));
+            f = _mm_add_pd(f, vstep);
+        }
+    }
+#elif defined(WES_RESAMPLE_NEON)
+    if (n >= 2) {
+        const float64x2_t one = vdupq_n_f64(1.), vscale = vdupq_n_f64(scale), vfrom = vdupq_n_f64(from);
+        const float64x2_t vstep = vdupq_n_f64(2. * step);
+        float64x2_t f = vcombine_f64(vdup_n_f64((double)first), vdup_n_f64((double)(first + step)));
+        for (; i + 2 <= n; i += 2) {
+            // no fused multiply-add, to match the scalar samples
+            float64x2_t idx = vaddq_f64(vfrom, vmulq_f64(vscale, f));
+            int64x2_t ia = vcvtq_s64_f64(idx);
+            float64x2_t bCF = vsubq_f64(idx, vcvtq_f64_s64(ia));
+            float64x2_t aCF = vsubq_f64(one, bCF);
+            long a0 = vgetq_lane_s64(ia, 0), a1 = vgetq_lane_s64(ia, 1);
+            float64x2_t wa = vcombine_f64(vdup_n_f64(in[a0]), vdup_n_f64(in[a1]));
+            float64x2_t wb = vcombine_f64(vdup_n_f64(in[a0 + 1]), vdup_n_f64(in[a1 + 1]));
+            vst1q_f64(out + i, vaddq_f64(vmulq_f64(aCF, wa), vmulq_f64(bCF, wb)));
+            f = vaddq_f64(f, vstep);
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        double idxD = from + scale * (double)(first + step * i);
+        long a = (long)idxD;
+        double bCF = idxD - a;
+        double aCF = 1.0 - bCF;
+        out[i] = aCF * in[a] + bCF * in[a + 1];
+    }
+}
+
+/** Sample of <in> read at the position <idxD> through the filter of the bank of <rs> at <level> (see wes_sinc_level()) */
+static inline double wes_resample_sinc_read(const t_wes_resampler *rs, const float *in, long level, double idxD)
+{
+    long taps = rs->bank->taps[level], j;
+    long a = (long)idxD;
+    const float *row = rs->bank->coefs[level] + (long)((idxD - a) * WES_SINC_PHASES + 0.5) * taps;
+    const float *src = in + a - (taps / 2 - 1);
+    double acc = 0;
+
+    if (src >= rs->first && src + taps - 1 <= rs->last)
+        return wes_sinc_dot(src, row, taps);
+    // near either end of the channel
+    for (j = 0; j < taps; j++)
+        if (src + j >= rs->first && src + j <= rs->last)
+            acc += src[j] * row[j];
+    return acc;
+}
+
+/** Same as wes_resample_linear(), reading every position through the filter of the bank suited to <scale> */
+static inline void wes_resample_sinc(const t_wes_resampler *rs, const float *in, double from, double scale, long first, long step, long n, double *out)
+{
+    long level = wes_sinc_level(rs->bank, scale), i;
+
+    for (i = 0; i < n; i++)
+        out[i] = wes_resample_sinc_read(rs, in, level, from + scale * (double)(first + step * i));
+}
+
+/** Writes to <out> the <n> samples of <in>, within the channel of <rs>, read at <from> + <scale> * (<first> + <step> * i) */
+static inline void wes_resample(const t_wes_resampler *rs, const float *in, double from, double scale, long first, long step, long n, double *out)
+{
+    if (rs->bank)
+        wes_resample_sinc(rs, in, from, scale, first, step, n, out);
+    else
+        wes_resample_linear(in, from, scale, first, step, n, out);
+}
+
+
+/// Declares the quality attribute, held in <quality_in>, and builds the filter bank it may need
+#define WES_DECLARE_QUALITY_ATTR(c, type) \
+    CLASS_ATTR_CHAR(c, "quality", 0, type, quality_in); \
+    CLASS_ATTR_STYLE_LABEL(c, "quality", 0, "enumindex", "Resampling Quality"); \
+    CLASS_ATTR_ENUMINDEX(c, "quality", 0, "Linear Sinc"); \
+    wes_sinc_get();
+
+#endif // _WES_RESAMPLE_H_
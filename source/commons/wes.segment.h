@@ -0,0 +1,218 @@
+/**
+@file
+wes.segment.h
+
+@brief
+Waveset segmentation shared by all wes objects
+
+@description
+A waveset ends at every <m>cross</m>-th upward zero crossing (a sample
+<m>j</m> with <m>in[j] >= 0</m> and <m>in[j - 1] <= 0</m>), a crossing being
+accepted only when more than <m>minsamp</m> samples have elapsed since the
+previously accepted one.
+The crossing search is vectorized (AVX2 or SSE2 on x86, NEON on ARM, scalar
+elsewhere), and the samples that follow an accepted crossing and cannot hold
+another one are skipped altogether.
+Long buffers are scanned by wes_segment_parallel(): every core collects all
+the crossings of one chunk, then a sequential pass reapplies the minsamp and
+cross grouping across the chunk seams, giving the same result as the serial
+scan.
+Segmenting with minsamp 0 and cross 1 yields every crossing of the channel
+(the "base" segmentation): any other segmentation, along with its features,
+can be derived from it with wes_features_derive() (see wes.features.h)
+without reading the samples again.
+
+@owner
+Marco Marasciuolo
+*/
+
+#ifndef _WES_SEGMENT_H_
+#define _WES_SEGMENT_H_
+
+#include "ext.h"
+#include "wes.parallel.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define WES_SEGMENT_AVX2
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define WES_SEGMENT_SSE2
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define WES_SEGMENT_NEON
+#endif
+
+#define WES_SEGMENT_MINCHUNK    262144  ///< Samples below which a parallel scan isn't worth its threads
+
+
+// index of the lowest set bit of a non-zero mask
+static inline long wes_segment_ctz(unsigned int mask)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctz(mask);
+#else
+    long n = 0;
+    while (!(mask & 1)) {
+        mask >>= 1;
+        n++;
+    }
+    return n;
+#endif
+}
+
+
+/** Returns the first upward crossing at or after <j> (which must be >= 1), or <frames> if there is none. */
+static inline long wes_segment_find(const float *in, long j, long frames)
+{
+#if defined(WES_SEGMENT_AVX2)
+    const __m256 zero = _mm256_setzero_ps();
+    for (; j + 8 <= frames; j += 8) {
+        __m256 cur = _mm256_loadu_ps(in + j);
+        __m256 prev = _mm256_loadu_ps(in + j - 1);
+        int mask = _mm256_movemask_ps(_mm256_and_ps(_mm256_cmp_ps(cur, zero, _CMP_GE_OQ),
+                                                    _mm256_cmp_ps(prev, zero, _CMP_LE_OQ)));
+        if (mask)
+            return j + wes_segment_ctz(mask);
+    }
+#elif defined(WES_SEGMENT_SSE2)
+    const __m128 zero = _mm_setzero_ps();
+    for (; j + 8 <= frames; j += 8) {
+        __m128 curA = _mm_loadu_ps(in + j), curB = _mm_loadu_ps(in + j + 4);
+        __m128 prevA = _mm_loadu_ps(in + j - 1), prevB = _mm_loadu_ps(in + j + 3);
+        int mask = _mm_movemask_ps(_mm_and_ps(_mm_cmpge_ps(curA, zero), _mm_cmple_ps(prevA, zero)))
+                | (_mm_movemask_ps(_mm_and_ps(_mm_cmpge_ps(curB, zero), _mm_cmple_ps(prevB, zero))) << 4);
+        if (mask)
+            return j + wes_segment_ctz(mask);
+    }
+#elif defined(WES_SEGMENT_NEON)
+    const float32x4_t zero = vdupq_n_f32(0.f);
+    const uint32x4_t bits = {1, 2, 4, 8};
+    for (; j + 8 <= frames; j += 8) {
+        uint32x4_t mA = vandq_u32(vcgeq_f32(vld1q_f32(in + j), zero), vcleq_f32(vld1q_f32(in + j - 1), zero));
+        uint32x4_t mB = vandq_u32(vcgeq_f32(vld1q_f32(in + j + 4), zero), vcleq_f32(vld1q_f32(in + j + 3), zero));
+        if (vmaxvq_u32(vorrq_u32(mA, mB))) {
+            unsigned int mask = vaddvq_u32(vandq_u32(mA, bits)) | (vaddvq_u32(vandq_u32(mB, bits)) << 4);
+            return j + wes_segment_ctz(mask);
+        }
+    }
+#endif
+    for (; j < frames; j++) {
+        if (in[j] >= 0 && in[j - 1] <= 0)
+            return j;
+    }
+    return frames;
+}
+
+
+/** Makes room for <count> entries in a sysmem index array, growing it by a quarter at a time. */
+static inline void wes_segment_reserve(long **zerocrossindex, long *maxcross, long count)
+{
+    if (count > *maxcross) {
+        while (count > *maxcross)
+            *maxcross = *maxcross + MAX(round(*maxcross/4), 16);
+        *zerocrossindex = (long *)sysmem_resizeptrclear(*zerocrossindex, *maxcross * sizeof(long));
+    }
+}
+
+
+/** Segments one planar channel of <frames> samples into wavesets.
+    Crossings are accepted when more than <minsamp> samples separate them from the previously accepted one
+    (objects counting "at least <minsamp>" pass <minsamp> - 1), and every <ncross>-th accepted crossing closes a waveset.
+    <in[0]> is only ever read as the sample preceding <in[1]>.
+    On return <*zerocrossindex> (a sysmem array of <*maxcross> entries, grown as needed) holds 0 followed by
+    the end of each waveset; the number of wavesets is returned. */
+static inline long wes_segment(const float *in, long frames, long minsamp, long ncross, long **zerocrossindex, long *maxcross)
+{
+    long crosscount = 0, ncrossindex = 0;
+    long j = MAX(1, minsamp);
+
+    minsamp = MAX(0, minsamp);
+    ncross = MAX(1, ncross);
+    wes_segment_reserve(zerocrossindex, maxcross, 1);
+
+    while ((j = wes_segment_find(in, j, frames)) < frames) {
+        ncrossindex++;
+
+        if (ncrossindex == ncross) {
+            ncrossindex = 0;
+            crosscount++;
+            wes_segment_reserve(zerocrossindex, maxcross, crosscount + 1);
+            (*zerocrossindex)[crosscount] = j;
+        }
+
+        // no crossing can be accepted before minsamp samples have elapsed
+        j += minsamp + 1;
+    }
+
+    (*zerocrossindex)[0] = 0;
+    return crosscount;
+}
+
+
+typedef struct _wes_segment_chunks {
+    const float     *in;
+    long            frames;
+    long            *cross[WES_PARALLEL_MAXTHREADS];
+    long            maxcross[WES_PARALLEL_MAXTHREADS];
+    long            count[WES_PARALLEL_MAXTHREADS];
+} t_wes_segment_chunks;
+
+// collects every crossing in samples [from, to)
+static inline void wes_segment_chunk(t_wes_segment_chunks *chunks, long chunk, long from, long to)
+{
+    long j = MAX(1, from), count = 0;
+    long maxcross = MAX(16, (to - from) / 16);
+    long *cross = (long *)sysmem_newptr(maxcross * sizeof(long));
+
+    while ((j = wes_segment_find(chunks->in, j, to)) < to) {
+        wes_segment_reserve(&cross, &maxcross, count + 1);
+        cross[count++] = j;
+        j++;
+    }
+    chunks->cross[chunk] = cross;
+    chunks->maxcross[chunk] = maxcross;
+    chunks->count[chunk] = count;
+}
+
+
+/** Same as wes_segment(), but scans long buffers on all cores. */
+static inline long wes_segment_parallel(const float *in, long frames, long minsamp, long ncross, long **zerocrossindex, long *maxcross)
+{
+    t_wes_segment_chunks chunks;
+    long numchunks = wes_parallel_numchunks(frames, WES_SEGMENT_MINCHUNK);
+    long c, i, crosscount = 0, ncrossindex = 0, last = -1;
+
+    if (numchunks <= 1)
+        return wes_segment(in, frames, minsamp, ncross, zerocrossindex, maxcross);
+
+    minsamp = MAX(0, minsamp);
+    ncross = MAX(1, ncross);
+    chunks.in = in;
+    chunks.frames = frames;
+    wes_parallel_run(frames, numchunks, (t_wes_parallel_fn)wes_segment_chunk, &chunks);
+
+    // stitch: the grouping only depends on the previously accepted crossing, so it carries over the seams
+    wes_segment_reserve(zerocrossindex, maxcross, 1);
+    for (c = 0; c < numchunks; c++) {
+        for (i = 0; i < chunks.count[c]; i++) {
+            long j = chunks.cross[c][i];
+            if (j - last > minsamp) {
+                last = j;
+                ncrossindex++;
+                if (ncrossindex == ncross) {
+                    ncrossindex = 0;
+                    crosscount++;
+                    wes_segment_reserve(zerocrossindex, maxcross, crosscount + 1);
+                    (*zerocrossindex)[crosscount] = j;
+                }
+            }
+        }
+        sysmem_freeptr(chunks.cross[c]);
+    }
+
+    (*zerocrossindex)[0] = 0;
+    return crosscount;
+}
+
+#endif // _WES_SEGMENT_H_
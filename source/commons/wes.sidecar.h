@@ -0,0 +1,243 @@
+/**
+@file
+wes.sidecar.h
+
+@brief
+Waveset index sidecar files
+
+@description
+A sidecar stores the base segmentation of one channel (see wes.segment.h),
+so that a source only needs to be scanned once across sessions; the
+minsamp/cross pair is part of the key nonetheless.
+Sidecars live in the folder set by the <m>indexdir</m> attribute and are
+named after a hash of every sample of the channel, so that any buffer
+holding the same material finds them, and an edited file, even of the same
+length, never does: the sparse fingerprint keying the in-memory cache (see
+wes.cache.h) would miss edits between the samples it reads.
+The file is a fixed header followed by the feature table block of the
+segmentation (see wes.features.h), so that it can be memory-mapped and used
+in place; the waveset ends and crossings of a table are checked before it is
+used, so that a corrupt file is rescanned rather than read past the channel.
+
+@owner
+Marco Marasciuolo
+*/
+
+#ifndef _WES_SIDECAR_H_
+#define _WES_SIDECAR_H_
+
+#include "ext.h"
+#include "ext_obex.h"
+#include "wes.features.h"
+
+#ifdef MAC_VERSION
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#define WES_SIDECAR_MAGIC       "WESIDX01"
+#define WES_SIDECAR_VERSION     5
+#define WES_SIDECAR_ENDIANNESS  0x01020304
+
+typedef struct _wes_sidecar_header {
+    char        magic[8];
+    t_int32     version;
+    t_int32     endianness;
+    t_uint64    fingerprint;
+    t_int64     frames;
+    t_int64     channel;
+    t_int64     minsamp;
+    t_int64     ncross;
+    t_int64     crosscount;
+} t_wes_sidecar_header;
+
+
+/** A sidecar loaded in memory: the table points either into a file mapping or into a single sysmem block */
+typedef struct _wes_sidecar {
+    t_wes_sidecar_header    *header;
+    t_wes_features          features;
+    void                    *data;
+    long                    size;
+    char                    mapped;
+} t_wes_sidecar;
+
+
+static inline long wes_sidecar_size(long crosscount)
+{
+    return sizeof(t_wes_sidecar_header) + wes_features_size(crosscount);
+}
+
+
+/** Hash of every sample in[1] ... in[frames], keying the sidecars of a channel */
+static inline t_uint64 wes_sidecar_fingerprint(const float *in, long frames)
+{
+    // four interleaved FNV-1a lanes, so that the multiplies don't wait on each other
+    t_uint64 lanes[4] = {14695981039346656037ULL, 1099511628211ULL, 6364136223846793005ULL, 1442695040888963407ULL};
+    t_uint64 hash = 14695981039346656037ULL;
+    t_uint32 bits[4];
+    long j = 1, i;
+
+    for (; j + 4 <= frames + 1; j += 4) {
+        memcpy(bits, in + j, sizeof(bits));
+        for (i = 0; i < 4; i++)
+            lanes[i] = (lanes[i] ^ bits[i]) * 1099511628211ULL;
+    }
+    for (; j <= frames; j++) {
+        memcpy(bits, in + j, sizeof(t_uint32));
+        lanes[0] = (lanes[0] ^ bits[0]) * 1099511628211ULL;
+    }
+    for (i = 0; i < 4; i++)
+        hash = (hash ^ lanes[i]) * 1099511628211ULL;
+    return (hash ^ (t_uint64)frames) * 1099511628211ULL;
+}
+
+
+/** Builds the native path of the sidecar of a channel segmentation into <path> (MAX_PATH_CHARS long), <fingerprint>
+    being wes_sidecar_fingerprint() of the channel; returns 0 if <indexdir> is unset or the path would be too long. */
+static inline long wes_sidecar_path(t_symbol *indexdir, t_uint64 fingerprint, long frames, long channel, long minsamp, long ncross, char *path)
+{
+    char folder[MAX_PATH_CHARS];
+    long len;
+    if (!indexdir || !indexdir->s_name[0] || strlen(indexdir->s_name) >= MAX_PATH_CHARS)
+        return 0;
+    if (path_nameconform(indexdir->s_name, folder, PATH_STYLE_NATIVE, PATH_TYPE_BOOT))
+        strcpy(folder, indexdir->s_name);
+    // a truncated path would name another sidecar
+    len = snprintf(path, MAX_PATH_CHARS, "%s/%016llx-%ld-c%ld-m%ld-x%ld.wesidx", folder,
+                   (unsigned long long)fingerprint, frames, channel, minsamp, ncross);
+    return len > 0 && len < MAX_PATH_CHARS;
+}
+
+
+static inline void wes_sidecar_close(t_wes_sidecar *sc)
+{
+    if (!sc->data)
+        return;
+#ifdef MAC_VERSION
+    if (sc->mapped)
+        munmap(sc->data, sc->size);
+    else
+#endif
+        sysmem_freeptr(sc->data);
+    sc->data = NULL;
+}
+
+
+/** Checks that the table of a sidecar for a channel of <frames> samples can be read by the kernels: waveset ends strictly
+    increasing from 0 and within the channel, starts and periods following them, crossings between the samples around
+    each end; returns 0 if so */
+static inline long wes_sidecar_check(const t_wes_features *wf, long frames)
+{
+    long g;
+    if (wf->zerocrossindex[0] != 0 || (wf->count > 0 && wf->zerocrossindex[wf->count] >= frames))
+        return 1;
+    for (g = 1; g <= wf->count; g++) {
+        long e = wf->zerocrossindex[g];
+        if (e <= wf->zerocrossindex[g - 1] || wf->start[g] != wf->zerocrossindex[g - 1] || wf->period[g] != e - wf->start[g] ||
+            !(wf->crossing[g] >= e - 1 && wf->crossing[g] <= e) || wf->exactPeriod[g] != wf->crossing[g] - wf->crossing[g - 1])
+            return 1;
+    }
+    return 0;
+}
+
+
+/** Opens the sidecar at <path> and checks it against the expected key; returns 0 on success */
+static inline long wes_sidecar_open(const char *path, t_uint64 fingerprint, long frames, long channel, long minsamp, long ncross, t_wes_sidecar *sc)
+{
+    t_wes_sidecar_header *h;
+    long size;
+
+    memset(sc, 0, sizeof(t_wes_sidecar));
+
+#ifdef MAC_VERSION
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 1;
+    if (fstat(fd, &st) || st.st_size < (off_t)sizeof(t_wes_sidecar_header)) {
+        close(fd);
+        return 1;
+    }
+    size = st.st_size;
+    sc->data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (sc->data == MAP_FAILED) {
+        sc->data = NULL;
+        return 1;
+    }
+    sc->mapped = 1;
+#else
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return 1;
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if (size < (long)sizeof(t_wes_sidecar_header)) {
+        fclose(f);
+        return 1;
+    }
+    sc->data = sysmem_newptr(size);
+    if (fread(sc->data, 1, size, f) != (size_t)size) {
+        fclose(f);
+        wes_sidecar_close(sc);
+        return 1;
+    }
+    fclose(f);
+#endif
+    sc->size = size;
+
+    h = sc->header = (t_wes_sidecar_header *)sc->data;
+    if (memcmp(h->magic, WES_SIDECAR_MAGIC, 8) || h->version != WES_SIDECAR_VERSION || h->endianness != WES_SIDECAR_ENDIANNESS ||
+        h->fingerprint != fingerprint || h->frames != frames || h->channel != channel || h->minsamp != minsamp || h->ncross != ncross ||
+        h->crosscount < 0 || size != wes_sidecar_size(h->crosscount)) {
+        wes_sidecar_close(sc);
+        return 1;
+    }
+
+    wes_features_bind(&sc->features, (char *)sc->data + sizeof(t_wes_sidecar_header), h->crosscount);
+    if (wes_sidecar_check(&sc->features, frames)) {
+        wes_sidecar_close(sc);
+        return 1;
+    }
+    return 0;
+}
+
+
+/** Writes a feature table (bound with wes_features_bind()) to <path>, through a temporary file so that readers never see a partial sidecar;
+    returns 0 on success */
+static inline long wes_sidecar_write(const char *path, t_uint64 fingerprint, long frames, long channel, long minsamp, long ncross,
+                                     const t_wes_features *wf)
+{
+    char tmppath[MAX_PATH_CHARS];
+    t_wes_sidecar_header h;
+    long size = wes_features_size(wf->count);
+    long ok, len;
+    FILE *f;
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, WES_SIDECAR_MAGIC, 8);
+    h.version = WES_SIDECAR_VERSION;
+    h.endianness = WES_SIDECAR_ENDIANNESS;
+    h.fingerprint = fingerprint;
+    h.frames = frames;
+    h.channel = channel;
+    h.minsamp = minsamp;
+    h.ncross = ncross;
+    h.crosscount = wf->count;
+
+    len = snprintf(tmppath, MAX_PATH_CHARS, "%s.tmp", path);
+    if (len <= 0 || len >= MAX_PATH_CHARS || !(f = fopen(tmppath, "wb")))
+        return 1;
+    ok = fwrite(&h, sizeof(h), 1, f) == 1 &&
+         fwrite(wf->zerocrossindex, 1, size, f) == (size_t)size;
+    if (fclose(f) || !ok || rename(tmppath, path)) {
+        remove(tmppath);
+        return 1;
+    }
+    return 0;
+}
+
+#endif // _WES_SIDECAR_H_
@@ -0,0 +1,187 @@
+/**
+@file
+wes.sinc.h
+
+@brief
+Polyphase windowed-sinc filter bank
+
+@description
+Band-limited resampling reads a waveset through a windowed-sinc filter
+centered on each position, rather than between its two neighbouring samples.
+The filters are precomputed once per process, shared by all wes objects the
+same way the waveset index cache is, for <m>WES_SINC_PHASES</m> + 1
+fractional positions (the nearest one is used) and <m>WES_SINC_LEVELS</m>
+cutoffs, half an octave apart.
+Stretching a waveset needs no more than the full band, while shrinking it by
+a ratio <m>r</m> must first remove what lies above 1/<m>r</m> of it, or it
+folds back as aliasing: every waveset is read through the widest filter
+whose cutoff is below the inverse ratio of its old to new period.
+Filters grow longer as their cutoff goes down, so that their transition
+band stays as sharp, up to <m>WES_SINC_MAXTAPS</m> taps: the cost of an
+output sample is bounded by that many multiply-adds, vectorized (AVX2 on
+x86 processors that have it, see wes.cpu.h, SSE2 on the others, NEON on
+ARM, scalar elsewhere).
+
+@owner
+Marco Marasciuolo
+*/
+
+#ifndef _WES_SINC_H_
+#define _WES_SINC_H_
+
+#include "ext.h"
+#include "wes.cpu.h"
+
+#if !defined(__AVX2__) && (defined(__SSE2__) || defined(_M_X64))
+#include <emmintrin.h>
+#define WES_SINC_SSE2
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define WES_SINC_NEON
+#endif
+
+#define WES_SINC_VERSION        1
+#define WES_SINC_PHASES         256     ///< Fractional positions per sample
+#define WES_SINC_LEVELS         8       ///< Cutoffs, from the full band down by half an octave each
+#define WES_SINC_MINTAPS        16      ///< Taps of the full-band filter
+#define WES_SINC_MAXTAPS        64      ///< Taps of the narrowest filters
+#define WES_SINC_ROLLOFF        0.94    ///< Cutoff of the filters, relative to the band they keep
+
+typedef struct _wes_sinc {
+    long    version;
+    long    taps[WES_SINC_LEVELS];      ///< Taps of each filter, a multiple of 8
+    double  band[WES_SINC_LEVELS];      ///< Band kept by each filter, relative to the Nyquist frequency
+    float   *coefs[WES_SINC_LEVELS];    ///< <m>WES_SINC_PHASES</m> + 1 rows of taps for each filter
+} t_wes_sinc;
+
+
+/** Fills the <taps> coefficients of the filter keeping <band> for the fractional position <frac>, tap 0 reading
+    the sample <taps> / 2 - 1 before the position; Blackman-windowed, with unit gain at DC */
+static inline void wes_sinc_fill(float *row, long taps, double band, double frac)
+{
+    double cutoff = band * WES_SINC_ROLLOFF, half = taps / 2, sum = 0, h[WES_SINC_MAXTAPS];
+    long j;
+
+    for (j = 0; j < taps; j++) {
+        double t = j - (half - 1) - frac;
+        double u = t / half, s = cutoff * t;
+        double w = fabs(u) < 1 ? 0.42 + 0.5 * cos(PI * u) + 0.08 * cos(2 * PI * u) : 0;
+        h[j] = w * (s == 0 ? 1 : sin(PI * s) / (PI * s));
+        sum += h[j];
+    }
+    for (j = 0; j < taps; j++)
+        row[j] = h[j] / sum;
+}
+
+static inline t_wes_sinc *wes_sinc_new(void)
+{
+    t_wes_sinc *bank = (t_wes_sinc *)sysmem_newptrclear(sizeof(t_wes_sinc));
+    long k, p, size = 0;
+    float *coefs;
+
+    bank->version = WES_SINC_VERSION;
+    for (k = 0; k < WES_SINC_LEVELS; k++) {
+        bank->band[k] = pow(2., -0.5 * k);
+        bank->taps[k] = MIN(WES_SINC_MAXTAPS, 8 * (long)ceil(WES_SINC_MINTAPS / bank->band[k] / 8));
+        size += (WES_SINC_PHASES + 1) * bank->taps[k];
+    }
+    coefs = (float *)sysmem_newptr(size * sizeof(float));
+    for (k = 0; k < WES_SINC_LEVELS; k++) {
+        bank->coefs[k] = coefs;
+        for (p = 0; p <= WES_SINC_PHASES; p++, coefs += bank->taps[k])
+            wes_sinc_fill(coefs, bank->taps[k], bank->band[k], (double)p / WES_SINC_PHASES);
+    }
+    return bank;
+}
+
+/** Returns the process-wide filter bank, building it on first use; call it once from ext_main() so that it is built on the main thread */
+static inline const t_wes_sinc *wes_sinc_get(void)
+{
+    static t_wes_sinc *bank = NULL;
+    if (!bank) {
+        t_symbol *s = gensym("__wes_sinc_bank__");
+        bank = (t_wes_sinc *)s->s_thing;
+        if (!bank) {
+            bank = wes_sinc_new();
+            s->s_thing = (t_object *)bank;
+        } else if (bank->version != WES_SINC_VERSION) {
+            // an object built against a different bank layout is loaded: keep a private bank
+            bank = wes_sinc_new();
+        }
+    }
+    return bank;
+}
+
+
+/** Filter for a waveset read <scale> input samples apart: the widest one whose band is below 1 / <scale> */
+static inline long wes_sinc_level(const t_wes_sinc *bank, double scale)
+{
+    long k = 0;
+    while (k < WES_SINC_LEVELS - 1 && bank->band[k] * scale > 1.)
+        k++;
+    return k;
+}
+
+#if defined(WES_CPU_AVX2)
+/** AVX2 version of wes_sinc_dot() */
+static WES_CPU_AVX2_TARGET float wes_sinc_dot_avx2(const float *in, const float *row, long taps)
+{
+    // two chains of adds, so that they overlap
+    __m256 acc0 = _mm256_mul_ps(_mm256_loadu_ps(in), _mm256_loadu_ps(row));
+    __m256 acc1 = _mm256_setzero_ps();
+    __m128 s;
+    long j;
+    for (j = 8; j + 16 <= taps; j += 16) {
+        acc0 = _mm256_add_ps(acc0, _mm256_mul_ps(_mm256_loadu_ps(in + j), _mm256_loadu_ps(row + j)));
+        acc1 = _mm256_add_ps(acc1, _mm256_mul_ps(_mm256_loadu_ps(in + j + 8), _mm256_loadu_ps(row + j + 8)));
+    }
+    if (j < taps)
+        acc1 = _mm256_add_ps(acc1, _mm256_mul_ps(_mm256_loadu_ps(in + j), _mm256_loadu_ps(row + j)));
+    acc0 = _mm256_add_ps(acc0, acc1);
+    s = _mm_add_ps(_mm256_castps256_ps128(acc0), _mm256_extractf128_ps(acc0, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+}
+#endif
+
+/** Dot product of <taps> samples of <in> with a row of coefficients, <taps> being a multiple of 8 */
+static inline float wes_sinc_dot(const float *in, const float *row, long taps)
+{
+    long j;
+#if defined(WES_CPU_AVX2)
+    if (wes_cpu_avx2())
+        return wes_sinc_dot_avx2(in, row, taps);
+#endif
+#if defined(WES_SINC_SSE2)
+    __m128 acc0 = _mm_mul_ps(_mm_loadu_ps(in), _mm_loadu_ps(row));
+    __m128 acc1 = _mm_mul_ps(_mm_loadu_ps(in + 4), _mm_loadu_ps(row + 4));
+    for (j = 8; j < taps; j += 8) {
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(in + j), _mm_loadu_ps(row + j)));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(in + j + 4), _mm_loadu_ps(row + j + 4)));
+    }
+    acc0 = _mm_add_ps(acc0, acc1);
+    acc0 = _mm_add_ps(acc0, _mm_movehl_ps(acc0, acc0));
+    acc0 = _mm_add_ss(acc0, _mm_shuffle_ps(acc0, acc0, 1));
+    return _mm_cvtss_f32(acc0);
+#elif defined(WES_SINC_NEON)
+    float32x4_t acc0 = vmulq_f32(vld1q_f32(in), vld1q_f32(row));
+    float32x4_t acc1 = vmulq_f32(vld1q_f32(in + 4), vld1q_f32(row + 4));
+    for (j = 8; j < taps; j += 8) {
+        acc0 = vfmaq_f32(acc0, vld1q_f32(in + j), vld1q_f32(row + j));
+        acc1 = vfmaq_f32(acc1, vld1q_f32(in + j + 4), vld1q_f32(row + j + 4));
+    }
+    return vaddvq_f32(vaddq_f32(acc0, acc1));
+#else
+    float acc[4] = {0, 0, 0, 0};
+    for (j = 0; j < taps; j += 4) {
+        acc[0] += in[j] * row[j];
+        acc[1] += in[j + 1] * row[j + 1];
+        acc[2] += in[j + 2] * row[j + 2];
+        acc[3] += in[j + 3] * row[j + 3];
+    }
+    return (acc[0] + acc[1]) + (acc[2] + acc[3]);
+#endif
+}
+
+#endif // _WES_SINC_H_
@@ -0,0 +1,190 @@
+/**
+@file
+wes.spool.h
+
+@brief
+Spooling of huge outputs to disk
+
+@description
+Expansions with thousands of repeats can produce far more samples than fit
+in memory. Since every kernel knows the length of its output before
+synthesis starts (see wes.output.h), objects with a <m>spool</m> threshold
+(in megabytes) render any output larger than it straight into a
+memory-mapped WAV file instead of the output buffer: the file has the same
+interleaved float layout as a buffer, so the kernels write to it the very
+same way, and the system pages the samples out to disk as they are written.
+Outputs beyond 4 GB are written as RF64, and outputs of more than two
+channels carry a WAVE_FORMAT_EXTENSIBLE format, as readers expect.
+The file is the one set by the <m>spoolfile</m> attribute, or a new one in
+the temporary folder; the output buffer is left empty.
+
+@owner
+Marco Marasciuolo
+*/
+
+#ifndef _WES_SPOOL_H_
+#define _WES_SPOOL_H_
+
+#include "ext.h"
+#include "ext_obex.h"
+
+#ifdef MAC_VERSION
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#define WES_SPOOL_HEADER        92      ///< RIFF/RF64 header, ds64 (or JUNK), fmt, fact and data chunk headers
+#define WES_SPOOL_EXTENSIBLE    24      ///< Extra bytes of an extensible fmt chunk
+
+typedef struct _wes_spool {
+    char    path[MAX_PATH_CHARS];
+    char    *map;
+    size_t  size;
+    float   *samples;   ///< Interleaved, as in a buffer
+    long    frames;
+    long    nchan;
+} t_wes_spool;
+
+
+/** Tells whether <frames> frames of <nchan> channels exceed the spool threshold of <megabytes> (0 never spools) */
+static inline long wes_spool_wanted(double megabytes, long frames, long nchan)
+{
+    return megabytes > 0 && (double)frames * nchan * sizeof(float) > megabytes * 1048576.;
+}
+
+
+/** Bytes of the header of a file of <nchan> channels, after which the samples start */
+static inline long wes_spool_header_size(long nchan)
+{
+    return WES_SPOOL_HEADER + (nchan > 2 ? WES_SPOOL_EXTENSIBLE : 0);
+}
+
+
+// little-endian fields of the header
+static inline void wes_spool_put16(char *p, t_uint32 v)
+{
+    p[0] = v & 0xFF; p[1] = (v >> 8) & 0xFF;
+}
+
+static inline void wes_spool_put32(char *p, t_uint32 v)
+{
+    p[0] = v & 0xFF; p[1] = (v >> 8) & 0xFF; p[2] = (v >> 16) & 0xFF; p[3] = (v >> 24) & 0xFF;
+}
+
+static inline void wes_spool_put64(char *p, t_uint64 v)
+{
+    wes_spool_put32(p, (t_uint32)v);
+    wes_spool_put32(p + 4, (t_uint32)(v >> 32));
+}
+
+// 32-bit float WAV header; files beyond 4 GB turn the JUNK chunk into the ds64 chunk of an RF64 file
+static inline void wes_spool_header(char *h, long frames, long nchan, long sr)
+{
+    long size = wes_spool_header_size(nchan), fmt = size - WES_SPOOL_HEADER + 16;
+    t_uint64 data = (t_uint64)frames * nchan * sizeof(float);
+    t_uint64 riff = data + size - 8;
+    long rf64 = riff > 0xFFFFFFFFULL;
+    // KSDATAFORMAT_SUBTYPE_IEEE_FLOAT, the sub-format of extensible float files
+    static const char floatguid[16] = {3, 0, 0, 0, 0, 0, 0x10, 0, (char)0x80, 0, 0, (char)0xAA, 0, 0x38, (char)0x9B, 0x71};
+    char *fact = h + 56 + fmt;
+
+    memset(h, 0, size);
+    memcpy(h, rf64 ? "RF64" : "RIFF", 4);
+    wes_spool_put32(h + 4, rf64 ? 0xFFFFFFFF : (t_uint32)riff);
+    memcpy(h + 8, "WAVE", 4);
+    memcpy(h + 12, rf64 ? "ds64" : "JUNK", 4);
+    wes_spool_put32(h + 16, 28);
+    if (rf64) {
+        wes_spool_put64(h + 20, riff);
+        wes_spool_put64(h + 28, data);
+        wes_spool_put64(h + 36, frames);
+    }
+    memcpy(h + 48, "fmt ", 4);
+    wes_spool_put32(h + 52, fmt);
+    wes_spool_put16(h + 56, nchan > 2 ? 0xFFFE : 3);            // extensible, or IEEE float
+    wes_spool_put16(h + 58, nchan);
+    wes_spool_put32(h + 60, (t_uint32)sr);
+    wes_spool_put32(h + 64, (t_uint32)(sr * nchan * sizeof(float)));
+    wes_spool_put16(h + 68, nchan * sizeof(float));
+    wes_spool_put16(h + 70, 32);
+    if (nchan > 2) {
+        wes_spool_put16(h + 72, 22);
+        wes_spool_put16(h + 74, 32);                            // valid bits
+        wes_spool_put32(h + 76, 0);                             // no speaker positions
+        memcpy(h + 80, floatguid, 16);
+    }
+    memcpy(fact, "fact", 4);
+    wes_spool_put32(fact + 4, 4);
+    wes_spool_put32(fact + 8, rf64 ? 0xFFFFFFFF : (t_uint32)frames);
+    memcpy(fact + 12, "data", 4);
+    wes_spool_put32(fact + 16, rf64 ? 0xFFFFFFFF : (t_uint32)data);
+}
+
+
+/** Creates the WAV file of <frames> frames of <nchan> channels at <spoolfile> (or in the temporary folder if unset)
+    and maps it; returns 0 on success, after which <sp->samples> can be written like a locked buffer */
+static inline long wes_spool_open(t_object *x, t_wes_spool *sp, t_symbol *spoolfile, long frames, long nchan, long sr)
+{
+    static long count = 0;
+
+    memset(sp, 0, sizeof(t_wes_spool));
+    sp->frames = frames;
+    sp->nchan = nchan;
+    sp->size = wes_spool_header_size(nchan) + (size_t)frames * nchan * sizeof(float);
+
+#ifdef MAC_VERSION
+    if (spoolfile && spoolfile->s_name[0]) {
+        if (path_nameconform(spoolfile->s_name, sp->path, PATH_STYLE_NATIVE, PATH_TYPE_BOOT))
+            strncpy(sp->path, spoolfile->s_name, MAX_PATH_CHARS - 1);
+    } else {
+        const char *tmp = getenv("TMPDIR");
+        snprintf(sp->path, MAX_PATH_CHARS, "%s/wes-spool-%d-%ld.wav", tmp && tmp[0] ? tmp : "/tmp", (int)getpid(), ++count);
+    }
+    sp->path[MAX_PATH_CHARS - 1] = 0;
+
+    int fd = open(sp->path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, sp->size)) {
+        if (fd >= 0)
+            close(fd);
+        object_error(x, "can't create the spool file %s, rendering in memory", sp->path);
+        return 1;
+    }
+    sp->map = (char *)mmap(NULL, sp->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (sp->map == MAP_FAILED) {
+        sp->map = NULL;
+        object_error(x, "can't map the spool file %s, rendering in memory", sp->path);
+        return 1;
+    }
+    wes_spool_header(sp->map, frames, nchan, sr);
+    sp->samples = (float *)(sp->map + wes_spool_header_size(nchan));
+    return 0;
+#else
+    object_warn(x, "spooling is not supported on this platform, rendering in memory");
+    return 1;
+#endif
+}
+
+
+/** Unmaps the file once all channels are written; the samples reach the disk as the system flushes them */
+static inline void wes_spool_close(t_object *x, t_wes_spool *sp)
+{
+#ifdef MAC_VERSION
+    if (sp->map)
+        munmap(sp->map, sp->size);
+#endif
+    sp->map = NULL;
+    sp->samples = NULL;
+    object_post(x, "%ld frames spooled to %s", sp->frames, sp->path);
+}
+
+
+/// Declares the spool and spoolfile attributes, held in <spool_in> and <spoolfile_in>
+#define WES_DECLARE_SPOOL_ATTRS(c, type) \
+    CLASS_ATTR_DOUBLE(c, "spool", 0, type, spool_in); \
+    CLASS_ATTR_STYLE_LABEL(c, "spool", 0, "text", "Spool Outputs Above (MB)"); \
+    CLASS_ATTR_SYM(c, "spoolfile", 0, type, spoolfile_in); \
+    CLASS_ATTR_STYLE_LABEL(c, "spoolfile", 0, "text", "Spool File");
+
+#endif // _WES_SPOOL_H_
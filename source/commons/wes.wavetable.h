@@ -0,0 +1,211 @@
+/**
+@file
+wes.wavetable.h
+
+@brief
+Wavetable playback of repeated wavesets
+
+@description
+Kernels that repeat a waveset many times, at slowly changing periods and
+gains, describe all the repeats of a waveset up front (output samples,
+scale and gains of each one) and let a wavetable oscillator render them,
+a block at a time. The planar channel (see wes.planar.h) already holds the
+waveset as a contiguous table, so nothing is copied.
+The oscillator runs a phase accumulator over the table: every sample adds
+the phase increment to the phase, the frequency ramp to the increment and
+the gain ramps to the gains, so that no repeat sets an interpolation up of
+its own. The phase wraps back to the start of the waveset at the end of
+every repeat, where the waveset crosses zero.
+Within a repeat the increment glides from the period of the previous
+repeat towards that of the next one, halfway each side, and the gains
+glide from halfway to those of the previous repeat to halfway to those of
+the next one, so that pitch and loudness move smoothly across repeats
+rather than stepping at every one. The frequency ramp is centred on the
+scale of the repeat, so that its last sample still reads at <m>scale</m>
+* (<m>period</m> - 1), and it is kept within half the scale either way so
+that the phase always moves forward.
+The loop is vectorized with AVX2 gathers on x86 processors that have them
+(see wes.cpu.h), and scalar elsewhere; with the <m>quality</m> attribute set
+to Sinc, every position is read through the filter suited to the scale of
+its repeat (see wes.resample.h).
+
+@owner
+Marco Marasciuolo
+*/
+
+#ifndef _WES_WAVETABLE_H_
+#define _WES_WAVETABLE_H_
+
+#include "ext.h"
+#include "wes.resample.h"
+#include "wes.cpu.h"
+
+typedef struct _wes_repeat {
+    long    period;     ///< Output samples, none if not positive
+    double  scale;      ///< Input samples per output sample
+    double  posGain;    ///< Gain of the positive samples
+    double  negGain;    ///< Gain of the negative samples
+} t_wes_repeat;
+
+typedef struct _wes_wavetable {
+    const t_wes_resampler   *rs;
+    const float             *in;        ///< Samples the positions are relative to
+    double                  from;       ///< Position of the first sample of the waveset
+    const t_wes_repeat      *repeats;
+    long                    count;      ///< Number of repeats
+    long                    r;          ///< Next repeat to start
+    long                    left;       ///< Output samples of the current repeat still to play
+    long                    level;      ///< Filter of the current repeat, for band-limited reads
+    double                  phase;      ///< Position of the next sample, from the start of the waveset
+    double                  inc;        ///< Phase increment after the next sample
+    double                  ramp;       ///< Change of the increment at every sample
+    double                  posGain;    ///< Gains of the next sample
+    double                  negGain;
+    double                  posRamp;    ///< Change of the gains at every sample
+    double                  negRamp;
+} t_wes_wavetable;
+
+
+/** Starts playing the <count> <repeats> of the waveset starting at the position <from> of <in> */
+static inline void wes_wavetable_start(t_wes_wavetable *t, const t_wes_resampler *rs, const float *in, double from,
+                                       const t_wes_repeat *repeats, long count)
+{
+    t->rs = rs;
+    t->in = in;
+    t->from = from;
+    t->repeats = repeats;
+    t->count = count;
+    t->r = 0;
+    t->left = 0;
+}
+
+// phase, increment and gains at the start of repeat <r>, and their ramps
+static inline void wes_wavetable_next(t_wes_wavetable *t)
+{
+    const t_wes_repeat *rep = t->repeats + t->r;
+    const t_wes_repeat *prev = t->r > 0 ? rep - 1 : rep, *next = t->r + 1 < t->count ? rep + 1 : rep;
+    long period = rep->period;
+    double half = rep->scale / 2, depth = (next->scale - prev->scale) / 4, c;
+    double posStart = (prev->posGain + rep->posGain) / 2, posEnd = (rep->posGain + next->posGain) / 2;
+    double negStart = (prev->negGain + rep->negGain) / 2, negEnd = (rep->negGain + next->negGain) / 2;
+
+    // the increment runs from scale - depth to scale + depth, positions being scale * k + c * k * (k - (period - 1))
+    if (!(depth >= -half && depth <= half))
+        depth = depth > half ? half : (depth < -half ? -half : 0);
+    c = period > 1 ? depth / (period - 1) : 0;
+
+    t->left = MAX(0, period);
+    t->phase = 0;
+    t->inc = rep->scale + c * (2 - period);
+    t->ramp = 2 * c;
+    t->posGain = posStart;
+    t->negGain = negStart;
+    t->posRamp = period > 0 ? (posEnd - posStart) / period : 0;
+    t->negRamp = period > 0 ? (negEnd - negStart) / period : 0;
+    if (t->rs->bank)
+        t->level = wes_sinc_level(t->rs->bank, rep->scale);
+    t->r++;
+}
+
+#if defined(WES_CPU_AVX2)
+/** AVX2 part of wes_wavetable_run(), reading linearly: plays the first samples, 4 at a time, and returns how many */
+static WES_CPU_AVX2_TARGET long wes_wavetable_run_avx2(t_wes_wavetable *t, double *out, long n)
+{
+    // truncated positions below 2^52 turn into integers through the mantissa of 2^52 + position
+    const __m256d magic = _mm256_set1_pd(4503599627370496.);
+    const __m256d one = _mm256_set1_pd(1.), zero = _mm256_setzero_pd(), vfrom = _mm256_set1_pd(t->from);
+    const float *in = t->in;
+    double p = t->phase, i0 = t->inc, c = t->ramp / 2, pg = t->posGain, ng = t->negGain;
+    double pr = t->posRamp, nr = t->negRamp;
+    // four consecutive phases, each one moving on by the sum of the next four increments
+    __m256d phase = _mm256_set_pd(p + 3 * i0 + 6 * c, p + 2 * i0 + 2 * c, p + i0, p);
+    __m256d step = _mm256_set_pd(4 * i0 + 36 * c, 4 * i0 + 28 * c, 4 * i0 + 20 * c, 4 * i0 + 12 * c);
+    const __m256d ramp = _mm256_set1_pd(32 * c);
+    __m256d posGain = _mm256_set_pd(pg + 3 * pr, pg + 2 * pr, pg + pr, pg);
+    __m256d negGain = _mm256_set_pd(ng + 3 * nr, ng + 2 * nr, ng + nr, ng);
+    const __m256d posRamp = _mm256_set1_pd(4 * pr), negRamp = _mm256_set1_pd(4 * nr);
+    long i;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        __m256d idx = _mm256_add_pd(vfrom, phase);
+        __m256d a = _mm256_round_pd(idx, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+        __m256i ia = _mm256_sub_epi64(_mm256_castpd_si256(_mm256_add_pd(a, magic)), _mm256_castpd_si256(magic));
+        __m256d bCF = _mm256_sub_pd(idx, a);
+        __m256d aCF = _mm256_sub_pd(one, bCF);
+        __m256d wa = _mm256_cvtps_pd(_mm256_i64gather_ps(in, ia, 4));
+        __m256d wb = _mm256_cvtps_pd(_mm256_i64gather_ps(in + 1, ia, 4));
+        __m256d v = _mm256_add_pd(_mm256_mul_pd(aCF, wa), _mm256_mul_pd(bCF, wb));
+        __m256d gain = _mm256_blendv_pd(negGain, posGain, _mm256_cmp_pd(v, zero, _CMP_GE_OQ));
+        _mm256_storeu_pd(out + i, _mm256_mul_pd(v, gain));
+        phase = _mm256_add_pd(phase, step);
+        step = _mm256_add_pd(step, ramp);
+        posGain = _mm256_add_pd(posGain, posRamp);
+        negGain = _mm256_add_pd(negGain, negRamp);
+    }
+    t->phase = _mm256_cvtsd_f64(phase);
+    t->inc = i0 + t->ramp * i;
+    t->posGain = _mm256_cvtsd_f64(posGain);
+    t->negGain = _mm256_cvtsd_f64(negGain);
+    return i;
+}
+#endif
+
+/** Plays the <n> next samples of the current repeat into <out> */
+static inline void wes_wavetable_run(t_wes_wavetable *t, double *out, long n)
+{
+    const t_wes_resampler *rs = t->rs;
+    const float *in = t->in;
+    double from = t->from, phase, inc, ramp = t->ramp, posGain, negGain, posRamp = t->posRamp, negRamp = t->negRamp, v;
+    long i = 0, a;
+
+#if defined(WES_CPU_AVX2)
+    if (!rs->bank && n >= 8 && wes_cpu_avx2())
+        i = wes_wavetable_run_avx2(t, out, n);
+#endif
+    phase = t->phase;
+    inc = t->inc;
+    posGain = t->posGain;
+    negGain = t->negGain;
+    for (; i < n; i++) {
+        double idxD = from + phase;
+        if (rs->bank) {
+            v = wes_resample_sinc_read(rs, in, t->level, idxD);
+        } else {
+            a = (long)idxD;
+            double bCF = idxD - a;
+            v = (1.0 - bCF) * in[a] + bCF * in[a + 1];
+        }
+        out[i] = v * (v >= 0 ? posGain : negGain);
+        phase += inc;
+        inc += ramp;
+        posGain += posRamp;
+        negGain += negRamp;
+    }
+    t->phase = phase;
+    t->inc = inc;
+    t->posGain = posGain;
+    t->negGain = negGain;
+}
+
+/** Writes to <out> up to the <n> next samples of the repeats, <n> being at most WES_RESAMPLE_BLOCK,
+    and returns how many (0 once they are all played) */
+static inline long wes_wavetable_play(t_wes_wavetable *t, double *out, long n)
+{
+    long done = 0, len;
+
+    while (done < n) {
+        if (t->left == 0) {
+            if (t->r >= t->count)
+                break;
+            wes_wavetable_next(t);
+            continue;
+        }
+        len = MIN(n - done, t->left);
+        wes_wavetable_run(t, out + done, len);
+        t->left -= len;
+        done += len;
+    }
+    return done;
+}
+
+#endif // _WES_WAVETABLE_H_
@@ -44,6 +44,14 @@
 #include "foundation/llll_commons_ext.h"
 #include "math/bach_math_utilities.h"
 #include "ears.object.h"
+#include "wes.cache.h"
+#include "wes.arena.h"
+#include "wes.planar.h"
+#include "wes.output.h"
+#include "wes.spool.h"
+#include "wes.budget.h"
+#include "wes.resample.h"
+#include "wes.wavetable.h"
 
 
 
@@ -54,6 +62,17 @@ typedef struct _buf_pitchrepeat {
     long sampMin_in;
     int  repeat_in;
     long cross_in;
+    t_symbol *indexdir_in;
+    char pyramid_in;
+    char linkchannels_in;
+    long keychannel_in;
+    char quality_in;
+    double scratch_in;
+    double spool_in;
+    t_symbol *spoolfile_in;
+    double membudget_in;
+    t_wes_arena arena;
+    t_wes_budget budget;
     t_llll  *envin;
     
 } t_buf_pitchrepeat;
@@ -65,18 +84,21 @@ typedef struct _buf_pitchrepeat {
 t_buf_pitchrepeat*         buf_pitchrepeat_new(t_symbol *s, short argc, t_atom *argv);
 void            buf_pitchrepeat_free(t_buf_pitchrepeat *x);
 void            buf_pitchrepeat_bang(t_buf_pitchrepeat *x);
+void            buf_pitchrepeat_dryrun(t_buf_pitchrepeat *x);
+void            buf_pitchrepeat_run(t_buf_pitchrepeat *x, long dryrun);
 void            buf_pitchrepeat_anything(t_buf_pitchrepeat *x, t_symbol *msg, long ac, t_atom *av);
 
 void buf_pitchrepeat_assist(t_buf_pitchrepeat *x, void *b, long m, long a, char *s);
 void buf_pitchrepeat_inletinfo(t_buf_pitchrepeat *x, void *b, long a, char *t);
 
-void wavesetrepeat_bang(t_buf_pitchrepeat *x, t_buffer_obj *buffer, t_buffer_obj *out, t_buffer_obj *mod, double modVal, int modType);
+void wavesetrepeat_bang(t_buf_pitchrepeat *x, t_buffer_obj *buffer, t_buffer_obj *out, t_buffer_obj *mod, double modVal, int modType, long dryrun);
 
 // Globals and Statics
 static t_class    *s_tag_class = NULL;
 static t_symbol    *ps_event = NULL;
 
 EARSBUFOBJ_ADD_IO_METHODS(pitchrepeat)
+WES_ARENA_ADD_SCRATCH_SETTER(pitchrepeat, t_buf_pitchrepeat)
 
 /**********************************************************************/
 // Class Definition and Life Cycle
@@ -106,9 +128,36 @@ void C74_EXPORT ext_main(void* moduleRef)
     // buffer name (depending on the <m>naming</m> attribute).
     EARSBUFOBJ_DECLARE_COMMON_METHODS_HANDLETHREAD(pitchrepeat)
     
+    // @method cacheinfo @digest Post waveset index cache statistics
+    // @description Posts the number of waveset indices shared by all wes objects, their memory use,
+    // and the cache hits, misses and evictions so far.
+    // @method cachesize @digest Set waveset index cache size
+    // @description Sets the memory cap, in megabytes, of the waveset index cache shared by all wes objects;
+    // least recently used indices are dropped beyond it.
+    // @marg 0 @name megabytes @optional 0 @type float
+    // @method cacheclear @digest Clear waveset index cache
+    // @description Drops every waveset index not currently in use and resets the cache statistics.
+    WES_DECLARE_CACHE_METHODS(c)
+    
+    // @method dryrun @digest Post the projected cost of processing
+    // @description Posts, for each input buffer, the output frames, the memory and the time processing it would take,
+    // without synthesizing nor outputting anything.
+    class_addmethod(c, (method)buf_pitchrepeat_dryrun, "dryrun", 0);
+    
     CLASS_ATTR_LONG(c, "minsamp", 0, t_buf_pitchrepeat, sampMin_in);
     CLASS_ATTR_LONG(c, "repeatmult", 0, t_buf_pitchrepeat, repeat_in);
     CLASS_ATTR_LONG(c, "cross", 0, t_buf_pitchrepeat, cross_in);
+    CLASS_ATTR_SYM(c, "indexdir", 0, t_buf_pitchrepeat, indexdir_in);
+    CLASS_ATTR_CHAR(c, "pyramid", 0, t_buf_pitchrepeat, pyramid_in);
+    CLASS_ATTR_STYLE_LABEL(c,"pyramid",0,"onoff","Prepare Minsamp Levels");
+    CLASS_ATTR_CHAR(c, "linkchannels", 0, t_buf_pitchrepeat, linkchannels_in);
+    CLASS_ATTR_STYLE_LABEL(c,"linkchannels",0,"enumindex","Link Channels");
+    CLASS_ATTR_ENUMINDEX(c,"linkchannels", 0, "Off Mid \"Key Channel\"");
+    CLASS_ATTR_LONG(c, "keychannel", 0, t_buf_pitchrepeat, keychannel_in);
+    WES_DECLARE_SPOOL_ATTRS(c, t_buf_pitchrepeat)
+    WES_DECLARE_QUALITY_ATTR(c, t_buf_pitchrepeat)
+    WES_DECLARE_BUDGET_ATTR(c, t_buf_pitchrepeat)
+    WES_DECLARE_SCRATCH_ATTR(c, pitchrepeat, t_buf_pitchrepeat)
 
     earsbufobj_class_add_outname_attr(c);
     earsbufobj_class_add_blocking_attr(c);
@@ -153,6 +202,17 @@ t_buf_pitchrepeat *buf_pitchrepeat_new(t_symbol *s, short argc, t_atom *argv)
         x->sampMin_in = 15;
         x->repeat_in = 0;
         x->cross_in = 1;
+        x->indexdir_in = gensym("");
+        x->pyramid_in = 0;
+        x->linkchannels_in = WES_LINK_OFF;
+        x->keychannel_in = 1;
+        x->quality_in = WES_QUALITY_LINEAR;
+        x->scratch_in = WES_ARENA_DEFAULT_SCRATCH;
+        x->spool_in = 0;
+        x->spoolfile_in = gensym("");
+        x->membudget_in = 0;
+        wes_arena_init(&x->arena);
+        wes_budget_init(&x->budget);
   
         earsbufobj_init((t_earsbufobj *)x,  0);
         
@@ -180,6 +240,7 @@ t_buf_pitchrepeat *buf_pitchrepeat_new(t_symbol *s, short argc, t_atom *argv)
 
 void buf_pitchrepeat_free(t_buf_pitchrepeat *x)
 {
+    wes_arena_free(&x->arena);
     earsbufobj_free((t_earsbufobj *)x);
 }
 
@@ -187,6 +248,18 @@ void buf_pitchrepeat_free(t_buf_pitchrepeat *x)
 
 
 void buf_pitchrepeat_bang(t_buf_pitchrepeat *x)
+{
+    buf_pitchrepeat_run(x, 0);
+}
+
+
+void buf_pitchrepeat_dryrun(t_buf_pitchrepeat *x)
+{
+    buf_pitchrepeat_run(x, 1);
+}
+
+
+void buf_pitchrepeat_run(t_buf_pitchrepeat *x, long dryrun)
 {
     long num_buffers = earsbufobj_get_instore_size((t_earsbufobj *)x, 0);
     earsbufobj_refresh_outlet_names((t_earsbufobj *)x);
@@ -224,14 +297,15 @@ void buf_pitchrepeat_bang(t_buf_pitchrepeat *x)
         
         llll_free(env);
         
-        wavesetrepeat_bang(x, in, out, mod, modVal, modType);
+        wavesetrepeat_bang(x, in, out, mod, modVal, modType, dryrun);
         
         if (earsbufobj_iter_progress((t_earsbufobj *)x, count, num_buffers)) break;
     }
     
     earsbufobj_mutex_unlock((t_earsbufobj *)x);
 
-    earsbufobj_outlet_buffer((t_earsbufobj *)x, 0);
+    if (!dryrun)
+        earsbufobj_outlet_buffer((t_earsbufobj *)x, 0);
 }
 
 
@@ -260,7 +334,45 @@ void buf_pitchrepeat_anything(t_buf_pitchrepeat *x, t_symbol *msg, long ac, t_at
     llll_free(parsed);
 }
 
-void wavesetrepeat_bang(t_buf_pitchrepeat *x, t_buffer_obj *buffer, t_buffer_obj *out, t_buffer_obj *mod, double modVal, int modType) {
+// number of repeats of waveset g
+static inline int wavesetrepeat_count(const float *envOnset, long g, int repeatMult, double modVal, int modType)
+{
+    if (modType == 1) {
+        return round(CLAMP(envOnset[g], 0 , 1) * repeatMult);
+    } else {
+        return CLAMP(modVal, 0 , 5000);
+    }
+}
+
+// period of the repeat r of a waveset, gliding from currPeriod towards nextPeriod
+static inline long wavesetrepeat_period(long currPeriod, long nextPeriod, int r, int repeat)
+{
+    double med = pow((float)r/repeat, 2) * ((double)nextPeriod - (double)currPeriod);
+    return round(currPeriod + med);
+}
+
+// number of samples synthesized from a channel, and the most repeats of a waveset
+static long wavesetrepeat_plan(const t_wes_features *wf, const float *envOnset, int repeatMult, double modVal, int modType, long *maxRepeat)
+{
+    long g, h = 0;
+    int r, repeat;
+    
+    *maxRepeat = 0;
+    for (g = 1 ; g + 1 <= wf->count ; g++) {
+        repeat = wavesetrepeat_count(envOnset, g, repeatMult, modVal, modType);
+        if (repeat == 0) {
+            h += wf->period[g];
+        } else {
+            for (r = 1 ; r <= repeat ; r++) {
+                h += MAX(0, wavesetrepeat_period(wf->period[g], wf->period[g + 1], r, repeat));
+            }
+            *maxRepeat = MAX(*maxRepeat, repeat);
+        }
+    }
+    return h;
+}
+
+void wavesetrepeat_bang(t_buf_pitchrepeat *x, t_buffer_obj *buffer, t_buffer_obj *out, t_buffer_obj *mod, double modVal, int modType, long dryrun) {
     
     t_float        *tab;
     t_float        *envelope;
@@ -272,6 +384,7 @@ void wavesetrepeat_bang(t_buf_pitchrepeat *x, t_buffer_obj *buffer, t_buffer_obj
 
     long        frames, sampleRate, envelopeFrames ;
     
+    wes_budget_start(&x->budget);
     tab = ears_buffer_locksamples(buffer);
     frames = buffer_getframecount(buffer);
     sampleRate = buffer_getsamplerate(buffer);
@@ -281,84 +394,40 @@ void wavesetrepeat_bang(t_buf_pitchrepeat *x, t_buffer_obj *buffer, t_buffer_obj
     
     int nchan;
     nchan = buffer_getchannelcount(buffer);
-    double *inbuffer =  (double*) sysmem_newptr(frames * sizeof(double));
+    t_wes_planar planar;
+    wes_planar_init(&planar, &x->arena, tab, frames, nchan);
     
-    int maxcross = round(frames / (minsampl * ncross));
-    int *zerocrossindex = (int*) sysmem_newptr(maxcross * sizeof(int));
-    double *wavePosPeak = (double*) sysmem_newptr(maxcross * sizeof(double));
-    double *waveNegPeak = (double*) sysmem_newptr(maxcross * sizeof(double));
-    int maxmemory = (int)(frames * (MAX(repeatMult, modVal) + 1));
-    double *dataout =  (double*) sysmem_newptr(maxmemory * sizeof(double));
     
     ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
     
-    int z, v , ver, frameout = 0;
+    int z;
+    long frameout = 0;
+    t_wes_spool spool;
+    long spooled = 0, skipped = 0;
+    t_wes_cost cost;
+    t_wes_index *linked = wes_cache_acquire_linked(buffer, &planar, x->linkchannels_in, x->keychannel_in, minsampl, ncross, x->indexdir_in, x->pyramid_in);
     for (z = 1 ; z < (nchan + 1) ; z++) {
-        int inc = 0;
-        
-        for (v = 0 ; v < (frames * nchan) ; v++) {
-            ver = (v % nchan) + 1;
-            if (ver == z) {
-                inc++;
-                inbuffer[inc] = tab[v];
-            }
-        }
+        const float *inbuffer = wes_planar_channel(&planar, z);
+        t_wes_resampler rs;
+        wes_resampler_init(&rs, x->quality_in, inbuffer, frames);
         
-        int g = 1, minsamplcount = 0, h = 0, b = 0, j, k, ncrossindex = 0, a, n = 0,  currPeriod, newPeriod, nextPeriod, crosscount = 0, repeat ;
-        double bCF, aCF, res, idxD, scaleCF, maxPosPeak = 0, maxNegPeak = 0, posVal = 0, negVal = 0;
+        long g = 1, h = 0, len, currPeriod, newPeriod, nextPeriod, crosscount = 0, repeat, maxRepeat;
+        double res[WES_RESAMPLE_BLOCK];
         
         
 
-        for (j = 0 ; j < frames ; j++) {
-            minsamplcount++;
-
-            
-            if (inbuffer [j] > 0) {
-                posVal = inbuffer [j];
-            } else {
-                negVal = inbuffer [j];
-            }
-            
-            if (maxPosPeak < posVal) {
-                maxPosPeak = posVal;
-            }
-            
-            
-            if (maxNegPeak > negVal) {
-                maxNegPeak = negVal;
-            }
-
-            if (inbuffer [j] >= 0 && inbuffer [j - 1] <= 0 && minsamplcount > minsampl) {
-                minsamplcount = 0;
-                ncrossindex++;
-                
-                if (ncrossindex == ncross) {
-                    ncrossindex = 0;
-                    crosscount++;
-                    if (crosscount >= maxcross) {
-                        maxcross = maxcross + round(maxcross/4);
-                        zerocrossindex = (int*) sysmem_resizeptrclear(zerocrossindex, maxcross * sizeof(int));
-                        wavePosPeak = (double*) sysmem_resizeptrclear(wavePosPeak, maxcross * sizeof(double));
-                        waveNegPeak = (double*) sysmem_resizeptrclear(waveNegPeak, maxcross * sizeof(double));
-                    }
-                    
-                    zerocrossindex[crosscount] = j;
-                    wavePosPeak[crosscount] = maxPosPeak;
-                    waveNegPeak[crosscount] = maxNegPeak;
-                    
-                    maxPosPeak = 0;
-                    maxNegPeak = 0;
-                }
-                
-            }
-        }
-        
-        wavePosPeak[0] = 0;
-        waveNegPeak[0] = 0;
-        zerocrossindex[0] = 0;
+        // waveset segmentation
+        t_wes_index *index = wes_cache_acquire_channel(buffer, &planar, z, linked, minsampl, ncross, x->indexdir_in, x->pyramid_in);
+        t_wes_features *wf = &index->features;
+        long *waveStart = wf->start;
+        long *wavePeriod = wf->period;
+        double *wavePosPeak = wf->posPeak;
+        double *waveNegPeak = wf->negPeak;
+        crosscount = wf->count;
         
         ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-        float *envOnset = (float *)bach_newptr(crosscount * sizeof(float));
+        size_t mark = wes_arena_mark(&x->arena);
+        float *envOnset = wes_arena_envelope(&x->arena, crosscount);
         if (modType == 1) {
             
              ears_resample_linear(envelope, envelopeFrames, &envOnset, crosscount, ((float)crosscount/(float)envelopeFrames), 1);
@@ -368,47 +437,48 @@ void wavesetrepeat_bang(t_buf_pitchrepeat *x, t_buffer_obj *buffer, t_buffer_obj
                 envOnset[gg] = modVal;
             }
         }
+        
+        long planned = wavesetrepeat_plan(wf, envOnset, repeatMult, modVal, modType, &maxRepeat);
+        if (z == 1) {
+            frameout = planned - 1;
+            // outputs beyond the spool threshold (or the memory budget) are rendered to disk, leaving the buffer empty
+            spooled = wes_spool_wanted(x->spool_in, frameout, nchan);
+            wes_budget_project(&x->budget, &cost, frames, nchan, crosscount, frameout, nchan, maxRepeat * sizeof(t_wes_repeat));
+            if (!wes_budget_admit((t_object *) x, &cost, x->membudget_in, dryrun, &spooled)) {
+                if (!dryrun)
+                    ears_buffer_set_size_and_numchannels((t_object *) x, out, 0, nchan);
+                spooled = 0;
+                skipped = 1;
+                wes_cache_release(index);
+                break;
+            }
+            spooled = spooled && !wes_spool_open((t_object *) x, &spool, x->spoolfile_in, frameout, nchan, sampleRate);
+            ears_buffer_set_size_and_numchannels((t_object *) x, out, spooled ? 0 : frameout, nchan);
+            ears_buffer_set_sr((t_object *) x, out, sampleRate);
+        }
+        t_wes_output output;
+        wes_output_begin(&output, spooled ? spool.samples : ears_buffer_locksamples(out), frameout, nchan, z);
+        t_wes_repeat *repeats = (t_wes_repeat *)wes_arena_alloc(&x->arena, MAX(1, maxRepeat) * sizeof(t_wes_repeat));
+        t_wes_wavetable wavetable;
         ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
         
         while (g <= crosscount && (g + 1) <= crosscount) {
             
-            if (modType == 1) {
-                repeat = round(CLAMP(envOnset[g], 0 , 1) * repeatMult);
-            } else {
-                repeat = CLAMP(modVal, 0 , 5000);
-            }
+            repeat = wavesetrepeat_count(envOnset, g, repeatMult, modVal, modType);
             
-            int r = 0;
-            currPeriod = (zerocrossindex[g] - zerocrossindex[g  - 1]);
+            long r = 0;
+            const float *wave = inbuffer + waveStart[g];
+            currPeriod = wavePeriod[g];
+            nextPeriod = (g == crosscount) ? currPeriod : wavePeriod[g + 1];
             if (repeat == 0) {
-                for (int e = 0 ; e < currPeriod ; e++) {
-                    if (h >= maxmemory) {
-                        maxmemory = maxmemory + round(maxmemory/4);
-                        dataout =  (double*)sysmem_resizeptrclear(dataout, maxmemory * sizeof(double));
-                    }
-                    dataout[h] = inbuffer[e + zerocrossindex[g  - 1]];
-                    h++;
-                }
+                wes_output_copy(&output, h, wave, currPeriod);
+                h += currPeriod;
             } else {
             
             while (r < repeat) {
                 r++;
                 
-                currPeriod = (zerocrossindex[g] - zerocrossindex[g  - 1]);
-                
-                if (g == crosscount) {
-                    nextPeriod = currPeriod;
-                } else {
-                    nextPeriod = (zerocrossindex[g + 1] - zerocrossindex[g]);
-                }
-                
-                
-            
-                
-                double med = pow((float)r/repeat, 2) * ((double)nextPeriod - (double)currPeriod);
-                
-                
-                newPeriod = round(currPeriod + med);
+                newPeriod = wavesetrepeat_period(currPeriod, nextPeriod, r, repeat);
                 
                 
                 double newPosGainFactor = (wavePosPeak[g] + (r * (wavePosPeak[g+1] - wavePosPeak[g])/ repeat))/ wavePosPeak[g] ;
@@ -425,37 +495,17 @@ void wavesetrepeat_bang(t_buf_pitchrepeat *x, t_buffer_obj *buffer, t_buffer_obj
                     newNegGainFactor = 0;
                 }
                 
-                
-                while (n < newPeriod) {
-        
-                    
-                    scaleCF = ((double)currPeriod -1) / ((double)newPeriod -1);
-                    idxD = (double)scaleCF * n;
-                    a = (int)idxD;
-                    b = a + 1;
-                    bCF = idxD - a;
-                    aCF = 1.0 - bCF;
-                    res = (double)(aCF * inbuffer[a + zerocrossindex[g - 1]] + bCF * inbuffer[b + zerocrossindex[g - 1]]);
-                    
-                    
-                    
-                    if (h >= maxmemory) {
-                        
-                        maxmemory = maxmemory + round(maxmemory/4);
-                        dataout =  (double*)sysmem_resizeptrclear(dataout, maxmemory * sizeof(double));
-                    }
-                    
-                    if (res >= 0) {
-                        dataout[h] = res * newPosGainFactor;
-                    } else {
-                        dataout[h] = res * newNegGainFactor;
-                    }
-                    
-           
-                    n++;
-                    h++;
-                }
-                n = 0;
+                repeats[r - 1].period = newPeriod;
+                repeats[r - 1].scale = wes_resample_scale(currPeriod, newPeriod);
+                repeats[r - 1].posGain = newPosGainFactor;
+                repeats[r - 1].negGain = newNegGainFactor;
+            }
+            
+            // all the repeats in one go, the waveset being the wavetable
+            wes_wavetable_start(&wavetable, &rs, wave, 0, repeats, repeat);
+            while ((len = wes_wavetable_play(&wavetable, res, WES_RESAMPLE_BLOCK)) > 0) {
+                wes_output_block(&output, h, res, len);
+                h += len;
             }
             }
             g++;
@@ -466,36 +516,20 @@ void wavesetrepeat_bang(t_buf_pitchrepeat *x, t_buffer_obj *buffer, t_buffer_obj
 
         
         
-        if (z == 1) {
-            frameout = h - 1;;
-        }
-        
-        ears_buffer_set_size_and_numchannels((t_object *) x, out, frameout, nchan);
-        ears_buffer_set_sr((t_object *) x, out, sampleRate);
-        
-        float *outtab = ears_buffer_locksamples(out);
-        
-        
-        inc = 0;
-        for (k = 0 ; k < (frameout * nchan) ; k++) {
-            ver = (k % nchan) + 1;
-            if (ver == z) {
-                inc++;
-                double f = dataout[inc];
-                outtab[k] = f;
-            }
-            
-        }
-        ears_buffer_unlocksamples(out);
-        bach_freeptr(envOnset);
+        wes_output_finish(&output, h);
+        if (!spooled)
+            ears_buffer_unlocksamples(out);
+        wes_cache_release(index);
+        wes_arena_rewind(&x->arena, mark);
     }
     
     
     buffer_unlocksamples(buffer);
-    sysmem_freeptr(zerocrossindex);
-    sysmem_freeptr(wavePosPeak);
-    sysmem_freeptr(waveNegPeak);
-    sysmem_freeptr(dataout);
-    sysmem_freeptr(inbuffer);
+    wes_cache_release(linked);
+    if (spooled)
+        wes_spool_close((t_object *) x, &spool);
+    if (!skipped)
+        wes_budget_stop(&x->budget, (double)frameout * nchan);
+    wes_arena_end(&x->arena, wes_arena_megabytes(x->scratch_in));
     return;
 }
@@ -43,6 +43,15 @@ Marco Marasciuolo
 #include "foundation/llll_commons_ext.h"
 #include "math/bach_math_utilities.h"
 #include "ears.object.h"
+#include "wes.cache.h"
+#include "wes.arena.h"
+#include "wes.planar.h"
+#include "wes.output.h"
+#include "wes.spool.h"
+#include "wes.budget.h"
+#include "wes.resample.h"
+#include "wes.wavetable.h"
+#include "wes.curves.h"
 
 
 
@@ -61,6 +70,18 @@ typedef struct _buf_repeatgliss {
     int envAmpOnOff_in;
     float pitchMin_in;
     float pitchMax_in;
+    t_symbol *indexdir_in;
+    char pyramid_in;
+    char linkchannels_in;
+    long keychannel_in;
+    char quality_in;
+    double scratch_in;
+    double spool_in;
+    t_symbol *spoolfile_in;
+    double membudget_in;
+    t_wes_arena arena;
+    t_wes_budget budget;
+    t_wes_curves curves;
     t_llll  *envin;
 
     
@@ -73,18 +94,21 @@ typedef struct _buf_repeatgliss {
 t_buf_repeatgliss*         buf_repeatgliss_new(t_symbol *s, short argc, t_atom *argv);
 void            buf_repeatgliss_free(t_buf_repeatgliss *x);
 void            buf_repeatgliss_bang(t_buf_repeatgliss *x);
+void            buf_repeatgliss_dryrun(t_buf_repeatgliss *x);
+void            buf_repeatgliss_run(t_buf_repeatgliss *x, long dryrun);
 void            buf_repeatgliss_anything(t_buf_repeatgliss *x, t_symbol *msg, long ac, t_atom *av);
 
 void buf_repeatgliss_assist(t_buf_repeatgliss *x, void *b, long m, long a, char *s);
 void buf_repeatgliss_inletinfo(t_buf_repeatgliss *x, void *b, long a, char *t);
 
-void repeatgliss_bang(t_buf_repeatgliss *x, t_buffer_obj *buffer, t_buffer_obj *out, t_buffer_obj *mod, double modVal, int modType);
+void repeatgliss_bang(t_buf_repeatgliss *x, t_buffer_obj *buffer, t_buffer_obj *out, t_buffer_obj *mod, double modVal, int modType, long dryrun);
 
 // Globals and Statics
 static t_class    *s_tag_class = NULL;
 static t_symbol    *ps_event = NULL;
 
 EARSBUFOBJ_ADD_IO_METHODS(repeatgliss)
+WES_ARENA_ADD_SCRATCH_SETTER(repeatgliss, t_buf_repeatgliss)
 
 /**********************************************************************/
 // Class Definition and Life Cycle
@@ -114,8 +138,35 @@ void C74_EXPORT ext_main(void* moduleRef)
     // buffer name (depending on the <m>naming</m> attribute).
     EARSBUFOBJ_DECLARE_COMMON_METHODS_HANDLETHREAD(repeatgliss)
     
+    // @method cacheinfo @digest Post waveset index cache statistics
+    // @description Posts the number of waveset indices shared by all wes objects, their memory use,
+    // and the cache hits, misses and evictions so far.
+    // @method cachesize @digest Set waveset index cache size
+    // @description Sets the memory cap, in megabytes, of the waveset index cache shared by all wes objects;
+    // least recently used indices are dropped beyond it.
+    // @marg 0 @name megabytes @optional 0 @type float
+    // @method cacheclear @digest Clear waveset index cache
+    // @description Drops every waveset index not currently in use and resets the cache statistics.
+    WES_DECLARE_CACHE_METHODS(c)
+    
+    // @method dryrun @digest Post the projected cost of processing
+    // @description Posts, for each input buffer, the output frames, the memory and the time processing it would take,
+    // without synthesizing nor outputting anything.
+    class_addmethod(c, (method)buf_repeatgliss_dryrun, "dryrun", 0);
+    
     CLASS_ATTR_LONG(c, "minsamp", 0, t_buf_repeatgliss, sampMin_in);
     CLASS_ATTR_LONG(c, "cross", 0, t_buf_repeatgliss, cross_in);
+    CLASS_ATTR_SYM(c, "indexdir", 0, t_buf_repeatgliss, indexdir_in);
+    CLASS_ATTR_CHAR(c, "pyramid", 0, t_buf_repeatgliss, pyramid_in);
+    CLASS_ATTR_STYLE_LABEL(c,"pyramid",0,"onoff","Prepare Minsamp Levels");
+    CLASS_ATTR_CHAR(c, "linkchannels", 0, t_buf_repeatgliss, linkchannels_in);
+    CLASS_ATTR_STYLE_LABEL(c,"linkchannels",0,"enumindex","Link Channels");
+    CLASS_ATTR_ENUMINDEX(c,"linkchannels", 0, "Off Mid \"Key Channel\"");
+    CLASS_ATTR_LONG(c, "keychannel", 0, t_buf_repeatgliss, keychannel_in);
+    WES_DECLARE_SPOOL_ATTRS(c, t_buf_repeatgliss)
+    WES_DECLARE_QUALITY_ATTR(c, t_buf_repeatgliss)
+    WES_DECLARE_BUDGET_ATTR(c, t_buf_repeatgliss)
+    WES_DECLARE_SCRATCH_ATTR(c, repeatgliss, t_buf_repeatgliss)
     CLASS_ATTR_LONG(c, "repeatmult", 0, t_buf_repeatgliss, repeatMult_in);
     CLASS_ATTR_FLOAT(c, "envpitchslope", 0, t_buf_repeatgliss, slopePitch_in);
     CLASS_ATTR_FLOAT(c, "envampslope", 0, t_buf_repeatgliss, slopeAmp_in);
@@ -180,6 +231,18 @@ t_buf_repeatgliss *buf_repeatgliss_new(t_symbol *s, short argc, t_atom *argv)
         x->envin = llll_from_text_buf("1", false);
         x->sampMin_in = 150;
         x->cross_in = 1;
+        x->indexdir_in = gensym("");
+        x->pyramid_in = 0;
+        x->linkchannels_in = WES_LINK_OFF;
+        x->keychannel_in = 1;
+        x->quality_in = WES_QUALITY_LINEAR;
+        x->scratch_in = WES_ARENA_DEFAULT_SCRATCH;
+        x->spool_in = 0;
+        x->spoolfile_in = gensym("");
+        x->membudget_in = 0;
+        wes_arena_init(&x->arena);
+        wes_budget_init(&x->budget);
+        wes_curves_init(&x->curves);
         x->repeatMult_in = 5;
         x->slopePitch_in = 2;
         x->slopeAmp_in = 2;
@@ -221,6 +284,8 @@ t_buf_repeatgliss *buf_repeatgliss_new(t_symbol *s, short argc, t_atom *argv)
 
 void buf_repeatgliss_free(t_buf_repeatgliss *x)
 {
+    wes_curves_free(&x->curves);
+    wes_arena_free(&x->arena);
     llll_free(x->envin);
     earsbufobj_free((t_earsbufobj *)x);
     
@@ -230,6 +295,18 @@ void buf_repeatgliss_free(t_buf_repeatgliss *x)
 
 
 void buf_repeatgliss_bang(t_buf_repeatgliss *x)
+{
+    buf_repeatgliss_run(x, 0);
+}
+
+
+void buf_repeatgliss_dryrun(t_buf_repeatgliss *x)
+{
+    buf_repeatgliss_run(x, 1);
+}
+
+
+void buf_repeatgliss_run(t_buf_repeatgliss *x, long dryrun)
 {
     long num_buffers = earsbufobj_get_instore_size((t_earsbufobj *)x, 0);
     earsbufobj_refresh_outlet_names((t_earsbufobj *)x);
@@ -267,14 +344,15 @@ void buf_repeatgliss_bang(t_buf_repeatgliss *x)
         
         llll_free(env);
         
-        repeatgliss_bang(x, in, out, mod, modVal, modType);
+        repeatgliss_bang(x, in, out, mod, modVal, modType, dryrun);
         
         if (earsbufobj_iter_progress((t_earsbufobj *)x, count, num_buffers)) break;
     }
     
     earsbufobj_mutex_unlock((t_earsbufobj *)x);
 
-    earsbufobj_outlet_buffer((t_earsbufobj *)x, 0);
+    if (!dryrun)
+        earsbufobj_outlet_buffer((t_earsbufobj *)x, 0);
 }
 
 
@@ -304,7 +382,59 @@ void buf_repeatgliss_anything(t_buf_repeatgliss *x, t_symbol *msg, long ac, t_at
 }
 
 
-void repeatgliss_bang(t_buf_repeatgliss *x, t_buffer_obj *buffer, t_buffer_obj *out, t_buffer_obj *mod, double modVal, int modType) {
+// number of repeats of waveset g
+static inline int repeatgliss_count(const float *envOnset, long g, int repeatMult, int modType)
+{
+    if (modType == 1) {
+        return (CLAMP(envOnset[g], 0 , 1) * repeatMult) + 1;
+    } else {
+        return CLAMP(envOnset[g], 1, 5000);
+    }
+}
+
+// pitch envelope curve of a waveset repeated <repeat> times, NULL if the period doesn't follow one
+static const float *repeatgliss_pitchcurve(t_buf_repeatgliss *x, int repeat, float slopePitch, int pitchEGtype, int envPitch)
+{
+    return (repeat == 1 || envPitch != 0) ? NULL : wes_curves_get(&x->curves, repeat, slopePitch, pitchEGtype != 0);
+}
+
+// period of the repeat u of a waveset, following the pitch envelope curve
+static inline long repeatgliss_period(long currPeriod, const float *pitchCurve, int u, int pitchEGtype, int pitchMin, int pitchMax)
+{
+    if (!pitchCurve) {
+        return currPeriod;
+    }
+    
+    float pMin = ((float)currPeriod - 1) * pitchMin;
+    
+    if (pitchEGtype == 0) {
+        return CLAMP(pMin + ((currPeriod - pMin) * pitchCurve[u - 1] * pitchMax), 2, currPeriod * pitchMax);
+    } else {
+        return CLAMP(pMin + ((currPeriod - pMin) * (1 - pitchCurve[u - 1]) * pitchMax), 2, currPeriod * pitchMax);
+    }
+}
+
+// number of samples synthesized from a channel, and the most repeats of a waveset
+static long repeatgliss_plan(t_buf_repeatgliss *x, const t_wes_features *wf, const float *envOnset, int repeatMult, int modType,
+                             float slopePitch, int pitchEGtype, int envPitch, int pitchMin, int pitchMax, long *maxRepeat)
+{
+    long g, h = 0;
+    int u, repeat;
+    
+    *maxRepeat = 0;
+    for (g = 1 ; g <= wf->count ; g++) {
+        repeat = repeatgliss_count(envOnset, g, repeatMult, modType);
+        wes_curves_next(&x->curves);
+        const float *pitchCurve = repeatgliss_pitchcurve(x, repeat, slopePitch, pitchEGtype, envPitch);
+        for (u = 1 ; u <= repeat ; u++) {
+            h += MAX(0, repeatgliss_period(wf->period[g], pitchCurve, u, pitchEGtype, pitchMin, pitchMax));
+        }
+        *maxRepeat = MAX(*maxRepeat, repeat);
+    }
+    return h;
+}
+
+void repeatgliss_bang(t_buf_repeatgliss *x, t_buffer_obj *buffer, t_buffer_obj *out, t_buffer_obj *mod, double modVal, int modType, long dryrun) {
     
     t_float        *tab;
     t_float        *envelope;
@@ -329,6 +459,7 @@ void repeatgliss_bang(t_buf_repeatgliss *x, t_buffer_obj *buffer, t_buffer_obj *
     
     long        frames, sampleRate, envelopeFrames ;
     
+    wes_budget_start(&x->budget);
     tab = ears_buffer_locksamples(buffer);
     frames = buffer_getframecount(buffer);
     sampleRate = buffer_getsamplerate(buffer);
@@ -338,65 +469,34 @@ void repeatgliss_bang(t_buf_repeatgliss *x, t_buffer_obj *buffer, t_buffer_obj *
     
     int nchan;
     nchan = buffer_getchannelcount(buffer);
-    double *inbuffer =  (double*) sysmem_newptr(frames * sizeof(double));
+    t_wes_planar planar;
+    wes_planar_init(&planar, &x->arena, tab, frames, nchan);
     
-    int maxcross = round(frames / (minsampl * ncross));
-    int *zerocrossindex = (int*) sysmem_newptr(maxcross * sizeof(int));
-    int maxmemory = (int)(frames);
-    double *dataout =  (double*) sysmem_newptr(maxmemory * sizeof(double));
   
-    int frameout = 0;
+    long frameout = 0;
+    t_wes_spool spool;
+    long spooled = 0, skipped = 0;
+    t_wes_cost cost;
     ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-    int z, v , ver;
+    int z;
+    t_wes_index *linked = wes_cache_acquire_linked(buffer, &planar, x->linkchannels_in, x->keychannel_in, minsampl - 1, ncross, x->indexdir_in, x->pyramid_in);
     for (z = 1 ; z < (nchan + 1) ; z++) {
-        int inc = 0;
+        const float *inbuffer = wes_planar_channel(&planar, z);
+        t_wes_resampler rs;
+        wes_resampler_init(&rs, x->quality_in, inbuffer, frames);
         
-        for (v = 0 ; v < (frames * nchan) ; v++) {
-            ver = (v % nchan) + 1;
-            if (ver == z) {
-                inc++;
-                inbuffer[inc] = tab[v];
-            }
-        }
-        
-        int  g = 1, minsamplcount = 0, h = 0, j, k, ncrossindex = 0, n = 0,  currPeriod, newPeriod, u = 0, crosscount = 0, repeat;
-        float risePitchEG,  fallPitchEG, riseAmpEG,  fallAmpEG, hanning;
-        double bCF, aCF, resA, idxD, scaleCF;
-        int a = 0, b = 0;
+        long g = 1, h = 0, len, currPeriod, newPeriod, u = 0, crosscount = 0, repeat, maxRepeat;
+        double ampGain, resA[WES_RESAMPLE_BLOCK];
         
         // waveset segmentation
-        for (j = 0 ; j < frames ; j++) {
-            minsamplcount++;
-            
-            if (inbuffer [j] >= 0 && inbuffer [j - 1] <= 0 && minsamplcount >= minsampl) {
-                minsamplcount = 0;
-                ncrossindex++;
-                
-                if (ncrossindex == ncross) {
-                    ncrossindex = 0;
-                    crosscount++;
-                    if (crosscount >= maxcross) {
-                        maxcross = maxcross + round(maxcross/4);
-                        zerocrossindex = (int*) sysmem_resizeptrclear(zerocrossindex, maxcross * sizeof(int));
-                        
-                    }
-                    
-                    
-                    zerocrossindex[crosscount] = j;
-          
-                }
-            }
-        }
-        
-        
-        
-        //
-        
-        zerocrossindex[0] = 0;
+        t_wes_index *index = wes_cache_acquire_channel(buffer, &planar, z, linked, minsampl - 1, ncross, x->indexdir_in, x->pyramid_in);
+        t_wes_features *wf = &index->features;
+        crosscount = wf->count;
 
         
         /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////// ricampiono il buffer di inviluppo e lo normalizzo al buffer dei waveset
-        float *envOnset = (float *)bach_newptr(crosscount * sizeof(float));
+        size_t mark = wes_arena_mark(&x->arena);
+        float *envOnset = wes_arena_envelope(&x->arena, crosscount);
         if (modType == 1) {
             ears_resample_linear(envelope, envelopeFrames, &envOnset, crosscount, ((float)crosscount/(float)envelopeFrames), 1);
         } else {
@@ -405,89 +505,67 @@ void repeatgliss_bang(t_buf_repeatgliss *x, t_buffer_obj *buffer, t_buffer_obj *
             
             }
         }
+        
+        long planned = repeatgliss_plan(x, wf, envOnset, repeatMult, modType, slopePitch, pitchEGtype, envPitch, pitchMin, pitchMax, &maxRepeat);
+        if (z == 1) {
+            frameout = planned - 1;
+            // outputs beyond the spool threshold (or the memory budget) are rendered to disk, leaving the buffer empty
+            spooled = wes_spool_wanted(x->spool_in, frameout, nchan);
+            wes_budget_project(&x->budget, &cost, frames, nchan, crosscount, frameout, nchan, maxRepeat * sizeof(t_wes_repeat));
+            if (!wes_budget_admit((t_object *) x, &cost, x->membudget_in, dryrun, &spooled)) {
+                if (!dryrun)
+                    ears_buffer_set_size_and_numchannels((t_object *) x, out, 0, nchan);
+                spooled = 0;
+                skipped = 1;
+                wes_cache_release(index);
+                break;
+            }
+            spooled = spooled && !wes_spool_open((t_object *) x, &spool, x->spoolfile_in, frameout, nchan, sampleRate);
+            ears_buffer_set_size_and_numchannels((t_object *) x, out, spooled ? 0 : frameout, nchan);
+            ears_buffer_set_sr((t_object *) x, out, sampleRate);
+        }
+        t_wes_output output;
+        wes_output_begin(&output, spooled ? spool.samples : ears_buffer_locksamples(out), frameout, nchan, z);
+        t_wes_repeat *repeats = (t_wes_repeat *)wes_arena_alloc(&x->arena, MAX(1, maxRepeat) * sizeof(t_wes_repeat));
+        t_wes_wavetable wavetable;
         ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
         
         
         while (g <= crosscount) {
             
-            currPeriod = (zerocrossindex[g] - zerocrossindex[g  - 1]);
+            // resample between the interpolated crossings, so that every repeat starts and ends on 0
+            double from = wf->crossing[g - 1];
+            currPeriod = wf->period[g];
             
-            if (modType == 1) {
-                repeat = (CLAMP(envOnset[g], 0 , 1) * repeatMult) + 1;
-            } else {
-                repeat = CLAMP(envOnset[g], 1, 5000);
-            }
+            // both curves are held for the waveset, neither lookup evicting the other one
+            repeat = repeatgliss_count(envOnset, g, repeatMult, modType);
+            wes_curves_next(&x->curves);
+            const float *pitchCurve = repeatgliss_pitchcurve(x, repeat, slopePitch, pitchEGtype, envPitch);
+            const float *ampCurve = envAmp == 0 ? wes_curves_get(&x->curves, repeat, slopeAmp, ampEGtype == 0) : NULL;
             
             while (u < repeat) {
                 u++;
                 
-                if (repeat == 1) {
-                    newPeriod = currPeriod;
+                newPeriod = repeatgliss_period(currPeriod, pitchCurve, u, pitchEGtype, pitchMin, pitchMax);
+                if (!ampCurve) {
+                    ampGain = 1.;
+                } else if (ampEGtype == 0) {
+                    ampGain = 1. - ampCurve[u - 1];
                 } else {
-                    risePitchEG = pow((float)u/repeat, slopePitch);
-                    fallPitchEG = 1. - pow(1. - (float)u/repeat, slopePitch);
-                    riseAmpEG = pow((float)u/repeat, slopeAmp);
-                    fallAmpEG = 1. - pow(1. - (float)u/repeat, slopeAmp);
-                    
-                    float pMin = ((float)currPeriod - 1) * pitchMin;
-                    
-                    
-                    if (envPitch == 0) {
-                        if (pitchEGtype == 0) {
-                            newPeriod = CLAMP(pMin + ((currPeriod - pMin) * risePitchEG * pitchMax), 2, currPeriod * pitchMax);
-                        } else {
-                            newPeriod = CLAMP(pMin + ((currPeriod - pMin) * (1 - fallPitchEG) * pitchMax), 2, currPeriod * pitchMax);
-                        }
-                        
-                    } else {
-                        newPeriod = currPeriod;
-                    }
+                    ampGain = ampCurve[u - 1];
                 }
                 
-                
-                float diff = fabs(inbuffer[zerocrossindex[g - 1]]) + fabs(inbuffer[zerocrossindex[g] - 1]);
-        
-                
-                while (n < newPeriod) {
-
-                 
-                    scaleCF = ((double)currPeriod - 1) / ((double)newPeriod - 1);
-                    idxD = (double)scaleCF * n;
-                    a = (int)idxD;
-                    b = a + 1;
-                    bCF = idxD - a;
-                    aCF = 1.0 - bCF;
-                    resA = (double)(aCF * inbuffer[a + zerocrossindex[g - 1]] + bCF * inbuffer[b + zerocrossindex[g - 1]]);
-  
-                    
-                    
-                    if (h >= maxmemory) {
-                        maxmemory = maxmemory + round(maxmemory/4);
-                        dataout =  (double*)sysmem_resizeptrclear(dataout, maxmemory * sizeof(double));
-                    }
-                    
-                    
-                                   
-                    float sampleCorrection = ((float)n/(newPeriod - 1)) * diff - inbuffer[zerocrossindex[g - 1]];
-                     
-                               
-                    if (envAmp == 0) {
-                        if (ampEGtype == 0) {
-                            dataout[h] = (resA + sampleCorrection) * (1. - fallAmpEG);
-                        } else {
-                            dataout[h] = (resA + sampleCorrection) * (riseAmpEG);
-                        }
-                        
-                    } else {
-                        dataout[h] = resA + sampleCorrection;
-                    }
-             
-                    
-                    h++;
-                    n++;
-                }
-
-                n = 0;
+                repeats[u - 1].period = newPeriod;
+                repeats[u - 1].scale = wf->exactPeriod[g] / newPeriod;
+                repeats[u - 1].posGain = ampGain;
+                repeats[u - 1].negGain = ampGain;
+            }
+            
+            // all the repeats in one go, the waveset being the wavetable
+            wes_wavetable_start(&wavetable, &rs, inbuffer, from, repeats, repeat);
+            while ((len = wes_wavetable_play(&wavetable, resA, WES_RESAMPLE_BLOCK)) > 0) {
+                wes_output_block(&output, h, resA, len);
+                h += len;
             }
 
             u = 0;
@@ -495,35 +573,20 @@ void repeatgliss_bang(t_buf_repeatgliss *x, t_buffer_obj *buffer, t_buffer_obj *
         }
         
         
-        if (z == 1) {
-            frameout = h - 1;;
-        }
-        
-        
-        ears_buffer_set_size_and_numchannels((t_object *) x, out, frameout, nchan);
-        ears_buffer_set_sr((t_object *) x, out, sampleRate);
-        
-        float *outtab = ears_buffer_locksamples(out);
-        
-        
-        inc = 0;
-        for (k = 0 ; k < (frameout * nchan) ; k++) {
-            ver = (k % nchan) + 1;
-            if (ver == z) {
-                inc++;
-                double f = dataout[inc];
-                outtab[k] = f;
-            }
-            
-        }
-        ears_buffer_unlocksamples(out);
-        bach_freeptr(envOnset);
+        wes_output_finish(&output, h);
+        if (!spooled)
+            ears_buffer_unlocksamples(out);
+        wes_cache_release(index);
+        wes_arena_rewind(&x->arena, mark);
     }
     
     ears_buffer_unlocksamples(buffer);
-    sysmem_freeptr(dataout);
-    sysmem_freeptr(zerocrossindex);
-    sysmem_freeptr(inbuffer);
+    wes_cache_release(linked);
+    if (spooled)
+        wes_spool_close((t_object *) x, &spool);
+    if (!skipped)
+        wes_budget_stop(&x->budget, (double)frameout * nchan);
+    wes_arena_end(&x->arena, wes_arena_megabytes(x->scratch_in));
 
     
     return;
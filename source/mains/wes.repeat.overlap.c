@@ -45,6 +45,11 @@ Marco Marasciuolo
 #include "foundation/llll_commons_ext.h"
 #include "math/bach_math_utilities.h"
 #include "ears.object.h"
+#include "wes.cache.h"
+#include "wes.arena.h"
+#include "wes.planar.h"
+#include "wes.budget.h"
+#include "wes.resample.h"
 
 
 
@@ -57,6 +62,12 @@ typedef struct _buf_repeatoverlap {
     long cross_in;
     long nOverlap_in;
     int maxOutChannel_in;
+    t_symbol *indexdir_in;
+    char pyramid_in;
+    double scratch_in;
+    double membudget_in;
+    t_wes_arena arena;
+    t_wes_budget budget;
     t_llll  *envin;
     
 } t_buf_repeatoverlap;
@@ -68,18 +79,21 @@ typedef struct _buf_repeatoverlap {
 t_buf_repeatoverlap*         buf_repeatoverlap_new(t_symbol *s, short argc, t_atom *argv);
 void            buf_repeatoverlap_free(t_buf_repeatoverlap *x);
 void            buf_repeatoverlap_bang(t_buf_repeatoverlap *x);
+void            buf_repeatoverlap_dryrun(t_buf_repeatoverlap *x);
+void            buf_repeatoverlap_run(t_buf_repeatoverlap *x, long dryrun);
 void            buf_repeatoverlap_anything(t_buf_repeatoverlap *x, t_symbol *msg, long ac, t_atom *av);
 
 void buf_repeatoverlap_assist(t_buf_repeatoverlap *x, void *b, long m, long a, char *s);
 void buf_repeatoverlap_inletinfo(t_buf_repeatoverlap *x, void *b, long a, char *t);
 
-void wavesetrepeat_bang(t_buf_repeatoverlap *x, t_buffer_obj *buffer, t_buffer_obj *out, t_buffer_obj *mod, double modVal, int modType);
+void wavesetrepeat_bang(t_buf_repeatoverlap *x, t_buffer_obj *buffer, t_buffer_obj *out, t_buffer_obj *mod, double modVal, int modType, long dryrun);
 
 // Globals and Statics
 static t_class    *s_tag_class = NULL;
 static t_symbol    *ps_event = NULL;
 
 EARSBUFOBJ_ADD_IO_METHODS(repeatoverlap)
+WES_ARENA_ADD_SCRATCH_SETTER(repeatoverlap, t_buf_repeatoverlap)
 
 /**********************************************************************/
 // Class Definition and Life Cycle
@@ -109,11 +123,32 @@ void C74_EXPORT ext_main(void* moduleRef)
     // buffer name (depending on the <m>naming</m> attribute).
     EARSBUFOBJ_DECLARE_COMMON_METHODS_HANDLETHREAD(repeatoverlap)
     
+    // @method cacheinfo @digest Post waveset index cache statistics
+    // @description Posts the number of waveset indices shared by all wes objects, their memory use,
+    // and the cache hits, misses and evictions so far.
+    // @method cachesize @digest Set waveset index cache size
+    // @description Sets the memory cap, in megabytes, of the waveset index cache shared by all wes objects;
+    // least recently used indices are dropped beyond it.
+    // @marg 0 @name megabytes @optional 0 @type float
+    // @method cacheclear @digest Clear waveset index cache
+    // @description Drops every waveset index not currently in use and resets the cache statistics.
+    WES_DECLARE_CACHE_METHODS(c)
+    
+    // @method dryrun @digest Post the projected cost of processing
+    // @description Posts, for each input buffer, the output frames, the memory and the time processing it would take,
+    // without synthesizing nor outputting anything.
+    class_addmethod(c, (method)buf_repeatoverlap_dryrun, "dryrun", 0);
+    
     CLASS_ATTR_LONG(c, "minsamp", 0, t_buf_repeatoverlap, sampMin_in);
     CLASS_ATTR_LONG(c, "repeatmult", 0, t_buf_repeatoverlap, repeatMult_in);
     CLASS_ATTR_LONG(c, "cross", 0, t_buf_repeatoverlap, cross_in);
+    CLASS_ATTR_SYM(c, "indexdir", 0, t_buf_repeatoverlap, indexdir_in);
+    CLASS_ATTR_CHAR(c, "pyramid", 0, t_buf_repeatoverlap, pyramid_in);
+    CLASS_ATTR_STYLE_LABEL(c,"pyramid",0,"onoff","Prepare Minsamp Levels");
     CLASS_ATTR_LONG(c, "overlap", 0, t_buf_repeatoverlap, nOverlap_in);
     CLASS_ATTR_LONG(c, "maxoutchannel", 0, t_buf_repeatoverlap, maxOutChannel_in);
+    WES_DECLARE_BUDGET_ATTR(c, t_buf_repeatoverlap)
+    WES_DECLARE_SCRATCH_ATTR(c, repeatoverlap, t_buf_repeatoverlap)
 
     earsbufobj_class_add_outname_attr(c);
     earsbufobj_class_add_blocking_attr(c);
@@ -158,8 +193,14 @@ t_buf_repeatoverlap *buf_repeatoverlap_new(t_symbol *s, short argc, t_atom *argv
         x->sampMin_in = 100;
         x->repeatMult_in = 10;
         x->cross_in = 1;
+        x->indexdir_in = gensym("");
+        x->pyramid_in = 0;
         x->nOverlap_in = 2;
         x->maxOutChannel_in = 2;
+        x->scratch_in = WES_ARENA_DEFAULT_SCRATCH;
+        x->membudget_in = 0;
+        wes_arena_init(&x->arena);
+        wes_budget_init(&x->budget);
   
         earsbufobj_init((t_earsbufobj *)x,  0);
         
@@ -191,6 +232,7 @@ t_buf_repeatoverlap *buf_repeatoverlap_new(t_symbol *s, short argc, t_atom *argv
 void buf_repeatoverlap_free(t_buf_repeatoverlap *x)
 {
     llll_free(x->envin);
+    wes_arena_free(&x->arena);
     earsbufobj_free((t_earsbufobj *)x);
 }
 
@@ -198,6 +240,18 @@ void buf_repeatoverlap_free(t_buf_repeatoverlap *x)
 
 
 void buf_repeatoverlap_bang(t_buf_repeatoverlap *x)
+{
+    buf_repeatoverlap_run(x, 0);
+}
+
+
+void buf_repeatoverlap_dryrun(t_buf_repeatoverlap *x)
+{
+    buf_repeatoverlap_run(x, 1);
+}
+
+
+void buf_repeatoverlap_run(t_buf_repeatoverlap *x, long dryrun)
 {
     long num_buffers = earsbufobj_get_instore_size((t_earsbufobj *)x, 0);
     earsbufobj_refresh_outlet_names((t_earsbufobj *)x);
@@ -235,14 +289,15 @@ void buf_repeatoverlap_bang(t_buf_repeatoverlap *x)
         
         llll_free(env);
         
-        wavesetrepeat_bang(x, in, out, mod, modVal, modType);
+        wavesetrepeat_bang(x, in, out, mod, modVal, modType, dryrun);
         
         if (earsbufobj_iter_progress((t_earsbufobj *)x, count, num_buffers)) break;
     }
     
     earsbufobj_mutex_unlock((t_earsbufobj *)x);
 
-    earsbufobj_outlet_buffer((t_earsbufobj *)x, 0);
+    if (!dryrun)
+        earsbufobj_outlet_buffer((t_earsbufobj *)x, 0);
 }
 
 
@@ -272,7 +327,237 @@ void buf_repeatoverlap_anything(t_buf_repeatoverlap *x, t_symbol *msg, long ac,
 }
 
 
-void wavesetrepeat_bang(t_buf_repeatoverlap *x, t_buffer_obj *buffer, t_buffer_obj *out, t_buffer_obj *mod, double modVal, int modType) {
+// length of the grain cycling waveset g
+static inline long wavesetrepeat_period(const t_wes_features *wf, const float *envOnset, long g, int repeatMult, int nOverlap, int modType)
+{
+    if (modType == 1) {
+        return wf->period[g] * CLAMP((envOnset[g] * repeatMult) + nOverlap, nOverlap, 5000);
+    } else {
+        return wf->period[g] * envOnset[g];
+    }
+}
+
+// number of frames the grains are overlapped into, and the longest grain
+static long wavesetrepeat_plan(const t_wes_features *wf, const float *envOnset, int repeatMult, int nOverlap, int modType, long *maxPeriod)
+{
+    long g, newIndex = 0, oldIndex = 0, overlapOnsetFactor = 0, newPeriod;
+    
+    *maxPeriod = 0;
+    for (g = 1 ; g <= wf->count ; g++) {
+        newPeriod = wavesetrepeat_period(wf, envOnset, g, repeatMult, nOverlap, modType);
+        if (newPeriod > 0) {
+            newIndex = (oldIndex + newPeriod) - overlapOnsetFactor;
+            *maxPeriod = MAX(*maxPeriod, newPeriod);
+        }
+        overlapOnsetFactor = newPeriod - (newPeriod / nOverlap);
+        oldIndex = newIndex;
+    }
+    return newIndex;
+}
+
+// samples r ... r + n - 1 of a waveset of period samples, read from <from> <scale> apart and cycled
+static void wavesetrepeat_cycle(const float *in, double from, double scale, long period, long r, long n, double *out)
+{
+    while (n > 0) {
+        long phase = r % period, len = MIN(n, period - phase);
+        wes_resample_linear(in, from, scale, phase, 1, len, out);
+        r += len;
+        out += len;
+        n -= len;
+    }
+}
+
+
+/**********************************************************************/
+// Overlap-add accumulator
+
+// each grain starts at or after the start of the previous one, so the output is summed into a window of tiles
+// that slides along with the grains: tiles are added as grains reach them, and written to the output buffer
+// (then reused) as soon as a grain starts past them, so that only the samples a grain can still touch are held
+
+#define OVERLAP_TILE_BITS   12
+#define OVERLAP_TILE        (1L << OVERLAP_TILE_BITS)     ///< Samples of a tile
+
+typedef struct _overlap_tiles {
+    t_wes_arena *arena;
+    double      **ring;     ///< Live tiles, tile n being ring[n & (cap - 1)]
+    long        cap;        ///< Power of 2
+    long        first;      ///< First live tile
+    long        end;        ///< One past the last live tile
+    double      *spare;     ///< Written tiles, chained through their first sample
+    float       *out;       ///< Interleaved output samples
+    long        size;       ///< Number of output samples; whatever is summed past them is dropped
+} t_overlap_tiles;
+
+
+static void overlap_tiles_init(t_overlap_tiles *t, t_wes_arena *arena, float *out, long size)
+{
+    t->arena = arena;
+    t->cap = 4;
+    t->ring = (double **)wes_arena_alloc(arena, t->cap * sizeof(double *));
+    t->first = t->end = 0;
+    t->spare = NULL;
+    t->out = out;
+    t->size = size;
+}
+
+// adds silent tiles up to tile n, returning it
+static double *overlap_tiles_add(t_overlap_tiles *t, long n)
+{
+    while (t->end <= n) {
+        double *tile;
+        if (t->end - t->first == t->cap) {
+            // the arena can't grow the ring in place: the old one is left to the end of the bang
+            double **ring = (double **)wes_arena_alloc(t->arena, 2 * t->cap * sizeof(double *));
+            long i;
+            for (i = t->first; i < t->end; i++)
+                ring[i & (2 * t->cap - 1)] = t->ring[i & (t->cap - 1)];
+            t->ring = ring;
+            t->cap *= 2;
+        }
+        if (t->spare) {
+            tile = t->spare;
+            t->spare = *(double **)tile;
+        } else {
+            tile = (double *)wes_arena_alloc(t->arena, OVERLAP_TILE * sizeof(double));
+        }
+        memset(tile, 0, OVERLAP_TILE * sizeof(double));
+        t->ring[t->end & (t->cap - 1)] = tile;
+        t->end++;
+    }
+    return t->ring[n & (t->cap - 1)];
+}
+
+// accumulator of output sample p, which must not be written yet
+static inline double *overlap_tiles_sample(t_overlap_tiles *t, long p)
+{
+    long n = p >> OVERLAP_TILE_BITS;
+    return (n < t->end ? t->ring[n & (t->cap - 1)] : overlap_tiles_add(t, n)) + (p & (OVERLAP_TILE - 1));
+}
+
+// sums the n samples of src, weighed by win, into the accumulators of samples p, p + stride, ... (none written yet),
+// scaling each sum by gain
+static void overlap_tiles_madd(t_overlap_tiles *t, long p, long stride, const double *src, const double *win, long n, double gain)
+{
+    while (n > 0) {
+        double *acc = overlap_tiles_sample(t, p);
+        long len = MIN(n, (OVERLAP_TILE - (p & (OVERLAP_TILE - 1)) + stride - 1) / stride), k;
+        if (stride == 1) {
+            for (k = 0; k < len; k++)
+                acc[k] = (acc[k] + src[k] * win[k]) * gain;
+        } else {
+            for (k = 0; k < len; k++)
+                acc[k * stride] = (acc[k * stride] + src[k] * win[k]) * gain;
+        }
+        p += len * stride;
+        src += len;
+        win += len;
+        n -= len;
+    }
+}
+
+// writes out the tiles lying entirely before sample p
+static void overlap_tiles_flush(t_overlap_tiles *t, long p)
+{
+    while (t->first < t->end && (t->first + 1) * OVERLAP_TILE <= p) {
+        double *tile = t->ring[t->first & (t->cap - 1)];
+        long start = t->first * OVERLAP_TILE;
+        if (start < t->size)
+            wes_planar_interleave(t->out + start, MIN(OVERLAP_TILE, t->size - start), 1, 1, tile);
+        *(double **)tile = t->spare;
+        t->spare = tile;
+        t->first++;
+    }
+}
+
+// writes out every tile, and silences the output samples no grain reached
+static void overlap_tiles_finish(t_overlap_tiles *t)
+{
+    long written;
+    
+    overlap_tiles_flush(t, t->end * OVERLAP_TILE);
+    written = t->first * OVERLAP_TILE;
+    if (written < t->size)
+        memset(t->out + written, 0, (t->size - written) * sizeof(float));
+}
+
+
+/**********************************************************************/
+// Grain windows
+
+// grains are Hann-windowed, and their lengths (a period times a small integer) come back over and over: the windows
+// of the lengths met first are kept for the whole bang, up to OVERLAP_WINDOW_SLOTS of them and OVERLAP_WINDOW_BYTES
+// overall, while the others are interpolated from a finely sampled Hann cycle
+
+#define OVERLAP_WINDOW_SLOTS    64          ///< Windows kept, a power of 2
+#define OVERLAP_WINDOW_BYTES    (1L << 20)  ///< Memory taken by the windows kept
+#define OVERLAP_WINDOW_POINTS   4096        ///< Points of the interpolated cycle, a power of 2
+
+typedef struct _overlap_windows {
+    t_wes_arena *arena;
+    long        length[OVERLAP_WINDOW_SLOTS];   ///< Length of the window kept in each slot, 0 if none
+    double      *window[OVERLAP_WINDOW_SLOTS];
+    long        bytes;                          ///< Memory taken by the windows kept
+    double      *cycle;                         ///< OVERLAP_WINDOW_POINTS + 1 points of a Hann cycle
+    double      *scratch;                       ///< Window of a length not kept
+} t_overlap_windows;
+
+
+// memory taken by the windows of grains up to maxPeriod samples
+static inline double overlap_windows_size(long maxPeriod)
+{
+    return OVERLAP_WINDOW_BYTES + (OVERLAP_WINDOW_POINTS + 1 + maxPeriod) * sizeof(double);
+}
+
+static void overlap_windows_init(t_overlap_windows *w, t_wes_arena *arena, long maxPeriod)
+{
+    long i;
+    
+    w->arena = arena;
+    for (i = 0; i < OVERLAP_WINDOW_SLOTS; i++)
+        w->length[i] = 0;
+    w->bytes = 0;
+    w->cycle = (double *)wes_arena_alloc(arena, (OVERLAP_WINDOW_POINTS + 1) * sizeof(double));
+    for (i = 0; i <= OVERLAP_WINDOW_POINTS; i++)
+        w->cycle[i] = cos((PI*2) * ((double)i / OVERLAP_WINDOW_POINTS)) * (-0.5) + 0.5;
+    w->scratch = (double *)wes_arena_alloc(arena, MAX(1, maxPeriod) * sizeof(double));
+}
+
+// window of a grain of n samples, weighing its sample r (1-based) by element r - 1
+static const double *overlap_windows_get(t_overlap_windows *w, long n)
+{
+    long slot = n & (OVERLAP_WINDOW_SLOTS - 1), probe, r;
+    double *window;
+    
+    for (probe = 0; probe < OVERLAP_WINDOW_SLOTS; probe++, slot = (slot + 1) & (OVERLAP_WINDOW_SLOTS - 1)) {
+        if (w->length[slot] == n)
+            return w->window[slot];
+        if (w->length[slot] == 0)
+            break;
+    }
+    
+    if (probe < OVERLAP_WINDOW_SLOTS && w->bytes + n * (long)sizeof(double) <= OVERLAP_WINDOW_BYTES) {
+        window = (double *)wes_arena_alloc(w->arena, n * sizeof(double));
+        for (r = 1; r <= n; r++)
+            window[r - 1] = cos((PI*2) * ((double)r/(n-1))) * (-0.5) + 0.5;
+        w->length[slot] = n;
+        w->window[slot] = window;
+        w->bytes += n * sizeof(double);
+        return window;
+    }
+    
+    // the last sample of a window lies a little past the end of the cycle, and wraps around
+    for (r = 1; r <= n; r++) {
+        double pos = ((double)r/(n-1)) * OVERLAP_WINDOW_POINTS;
+        long a = (long)pos;
+        const double *c = w->cycle + (a & (OVERLAP_WINDOW_POINTS - 1));
+        w->scratch[r - 1] = c[0] + (pos - a) * (c[1] - c[0]);
+    }
+    return w->scratch;
+}
+
+
+void wavesetrepeat_bang(t_buf_repeatoverlap *x, t_buffer_obj *buffer, t_buffer_obj *out, t_buffer_obj *mod, double modVal, int modType, long dryrun) {
 
     t_float        *tab;
     t_float        *envelope;
@@ -285,13 +570,15 @@ void wavesetrepeat_bang(t_buf_repeatoverlap *x, t_buffer_obj *buffer, t_buffer_o
     
 
     
-    int  g = 1, minsamplcount = 0, h = 0, j, k, r = 0, ncrossindex = 0,  currPeriod, currIndexA, newPeriod, overlapOnset = 0 , overlapOnsetFactor = 0, oldPeriod = 0, newIndex = 0, oldIndex = 0;
+    long g = 1, r = 0, len, currPeriod, newPeriod, overlapOnset = 0, overlapOnsetFactor = 0, oldPeriod = 0, newIndex = 0, oldIndex = 0;
     
-    double windowA, hanning;
+    double res[WES_RESAMPLE_BLOCK];
    
-    int crosscount = 0;
+    long crosscount = 0;
     long        frames, sampleRate, envelopeFrames ;
+    t_wes_cost  cost;
 
+    wes_budget_start(&x->budget);
     tab = ears_buffer_locksamples(buffer);
     frames = buffer_getframecount(buffer);
     sampleRate = buffer_getsamplerate(buffer);
@@ -302,70 +589,24 @@ void wavesetrepeat_bang(t_buf_repeatoverlap *x, t_buffer_obj *buffer, t_buffer_o
     
     int nchan;
     nchan = buffer_getchannelcount(buffer);
-    double *inbuffer =  (double*) sysmem_newptr(frames * sizeof(double));
+    float *inbuffer = (float *)wes_arena_alloc(&x->arena, (frames + 1 + WES_PLANAR_GUARD) * sizeof(float));
+    memset(inbuffer + frames + 1, 0, WES_PLANAR_GUARD * sizeof(float));
+    wes_planar_mix(tab, frames, nchan, inbuffer);
     
-    int maxcross = round(frames / (minsampl * ncross));
-    int *zerocrossindex = (int*) sysmem_newptr(maxcross * sizeof(int));
-    int maxmemory = (int)(frames * (modVal+1));
-    double *dataout =  (double*) sysmem_newptr(maxmemory * sizeof(double));
 
     ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
     
-    int z, v , ver;
-    for (z = 1 ; z < (nchan + 1) ; z++) {
-        int inc = 0;
-        
-        for (v = 0 ; v < (frames * nchan) ; v++) {
-            ver = (v % nchan) + 1;
-            if (ver == z) {
-                inc++;
-                if (z == 1) {
-                    inbuffer[inc] = tab[v];
-                } else {
-                    inbuffer[inc] = (inbuffer[inc] + tab[v]) * 0.5;
-                }
-            }
-        }
-    }
-    
-    
-    
 // waveset segmentation
-    for (j = 0 ; j < frames ; j++) {
-       minsamplcount++;
-
-       if (inbuffer [j] >= 0 && inbuffer [j - 1] <= 0 && minsamplcount > minsampl) {
-           minsamplcount = 0;
-           ncrossindex++;
-           
-           if (ncrossindex == ncross) {
-               ncrossindex = 0;
-               crosscount++;
-               if (crosscount >= maxcross) {
-                   maxcross = maxcross + round(maxcross/4);
-                   zerocrossindex = (int*) sysmem_resizeptrclear(zerocrossindex, maxcross * sizeof(int));
-
-               }
-               
-               zerocrossindex[crosscount] = j;
-
-           }
-
-        }
-    }
-
-
-    zerocrossindex[0] = 0;
+    t_wes_index *index = wes_cache_acquire(buffer, WES_CHANNEL_MIX, inbuffer, frames, minsampl, ncross, x->indexdir_in, x->pyramid_in);
+    t_wes_features *wf = &index->features;
+    crosscount = wf->count;
     
-    int allocVal = modVal;
     //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-    float *envOnset = (float *)bach_newptr(crosscount * sizeof(float));
+    float *envOnset = wes_arena_envelope(&x->arena, crosscount);
     if (modType == 1) {
         
         ears_resample_linear(envelope, envelopeFrames, &envOnset, crosscount, ((float)crosscount/(float)envelopeFrames), 1);
-        
-        allocVal = repeatMult;
     } else {
         
         for (int gg = 0 ; gg < crosscount ; gg++) {
@@ -376,17 +617,25 @@ void wavesetrepeat_bang(t_buf_repeatoverlap *x, t_buffer_obj *buffer, t_buffer_o
     ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
     
-    int a = 0;
-    while (a <= (frames * allocVal) * maxOutChannel) {
-        if (a >= maxmemory) {
-            
-            maxmemory = maxmemory + round(maxmemory/4);
-            dataout =  (double*)sysmem_resizeptrclear(dataout, maxmemory * sizeof(double));
-        }
-        dataout[a] = 0;
-        a++;
-        
+    // the grains are summed into a window of tiles sliding along the output (see above), which starts silent
+    long maxPeriod;
+    long frameout = wavesetrepeat_plan(wf, envOnset, repeatMult, nOverlap, modType, &maxPeriod);
+    wes_budget_project(&x->budget, &cost, frames, 1, crosscount, frameout, maxOutChannel, ((maxPeriod + 1) * maxOutChannel + 2 * OVERLAP_TILE) * sizeof(double) + overlap_windows_size(maxPeriod));
+    if (!wes_budget_admit((t_object *) x, &cost, x->membudget_in, dryrun, NULL)) {
+        if (!dryrun)
+            ears_buffer_set_size_and_numchannels((t_object *) x, out, 0, maxOutChannel);
+        buffer_unlocksamples(buffer);
+        wes_cache_release(index);
+        wes_arena_end(&x->arena, wes_arena_megabytes(x->scratch_in));
+        return;
     }
+    ears_buffer_set_size_and_numchannels((t_object *) x, out, frameout, maxOutChannel);
+    ears_buffer_set_sr((t_object *) x, out, sampleRate);
+    
+    t_overlap_tiles tiles;
+    overlap_tiles_init(&tiles, &x->arena, ears_buffer_locksamples(out), frameout * maxOutChannel);
+    t_overlap_windows windows;
+    overlap_windows_init(&windows, &x->arena, maxPeriod);
   
     
     
@@ -396,13 +645,13 @@ void wavesetrepeat_bang(t_buf_repeatoverlap *x, t_buffer_obj *buffer, t_buffer_o
         
         
         
-        currPeriod = (zerocrossindex[g] - zerocrossindex[g  - 1]);
+        currPeriod = wf->period[g];
         
-        if (modType == 1) {
-            newPeriod = currPeriod * CLAMP((envOnset[g] * repeatMult) + nOverlap, nOverlap, 5000);
-        } else {
-            newPeriod = currPeriod * envOnset[g];
-        }
+        // cycle between the interpolated crossings, so that every cycle starts and ends on 0
+        double from = wf->crossing[g - 1];
+        double scale = wf->exactPeriod[g] / currPeriod;
+        
+        newPeriod = wavesetrepeat_period(wf, envOnset, g, repeatMult, nOverlap, modType);
         
         
         if (maxOutChannel == 1) {
@@ -413,38 +662,18 @@ void wavesetrepeat_bang(t_buf_repeatoverlap *x, t_buffer_obj *buffer, t_buffer_o
             chOffset++;
         }
         
-        r = 0;
-        
-        while (r < newPeriod) {
-            r++;
-            
-            float diffA = fabs(inbuffer[zerocrossindex[g - 1]]) + fabs(inbuffer[zerocrossindex[g] - 1]);
-                            
-          
-                            
-            float sampleCorrectionA = ((float)(r % currPeriod)/(currPeriod)) * diffA - inbuffer[zerocrossindex[g - 1]];
-                            
-           
+        // no grain from this one on reaches before its first frame
+        if (newPeriod > 0) {
+            const double *hanning = overlap_windows_get(&windows, newPeriod);
             
-            currIndexA = zerocrossindex[g  - 1] + (r % currPeriod);
-            
-
-            if ((oldIndex + r) >= maxmemory) {
-                
-                maxmemory = maxmemory + round(maxmemory/4);
-                dataout =  (double*)sysmem_resizeptrclear(dataout, maxmemory * sizeof(double));
+            overlap_tiles_flush(&tiles, ((oldIndex + 1) - overlapOnsetFactor) * maxOutChannel);
+            for (r = 1 ; r <= newPeriod ; r += len) {
+                len = MIN(WES_RESAMPLE_BLOCK, newPeriod - r + 1);
+                wavesetrepeat_cycle(inbuffer, from, scale, currPeriod, r, len, res);
+                overlap_tiles_madd(&tiles, (((oldIndex + r) - overlapOnsetFactor) * maxOutChannel) + chOffset, maxOutChannel,
+                                   res, hanning + r - 1, len, 0.9);
             }
-            
-            windowA = sin(((double)r/newPeriod) * PI);
-            
-            hanning = cos((PI*2) * ((double)r/(newPeriod-1))) * (-0.5) + 0.5;
-            
-            newIndex = (oldIndex + r) - overlapOnsetFactor;
-            
-            dataout[(newIndex * maxOutChannel) + chOffset] = ( dataout[(newIndex * maxOutChannel) + chOffset] + ((inbuffer[currIndexA] + sampleCorrectionA)  * hanning) ) * 0.9;
-            
-            
-            
+            newIndex = (oldIndex + newPeriod) - overlapOnsetFactor;
         }
         oldPeriod = newPeriod;
         overlapOnset = newPeriod / nOverlap;
@@ -453,23 +682,12 @@ void wavesetrepeat_bang(t_buf_repeatoverlap *x, t_buffer_obj *buffer, t_buffer_o
         g++;
     }
 
-    h = newIndex;
-
-    ears_buffer_set_size_and_numchannels((t_object *) x, out, h, maxOutChannel);
-    ears_buffer_set_sr((t_object *) x, out, sampleRate);
-    
-    float *outtab = ears_buffer_locksamples(out);
-
-    
-    for (k = 0 ; k < (h * maxOutChannel) ; k++) {
-        double f = dataout[k];
-        outtab[k] = f;
-    }
+    overlap_tiles_finish(&tiles);
 
-    bach_freeptr(envOnset);
     buffer_unlocksamples(buffer);
     ears_buffer_unlocksamples(out);
-    sysmem_freeptr(zerocrossindex);
-    sysmem_freeptr(dataout);
+    wes_cache_release(index);
+    wes_budget_stop(&x->budget, (double)frameout * maxOutChannel);
+    wes_arena_end(&x->arena, wes_arena_megabytes(x->scratch_in));
     return;
 }
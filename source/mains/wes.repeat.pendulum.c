@@ -43,6 +43,12 @@ Marco Marasciuolo
 #include "foundation/llll_commons_ext.h"
 #include "math/bach_math_utilities.h"
 #include "ears.object.h"
+#include "wes.cache.h"
+#include "wes.arena.h"
+#include "wes.planar.h"
+#include "wes.output.h"
+#include "wes.budget.h"
+#include "wes.resample.h"
 
 
 
@@ -54,6 +60,15 @@ typedef struct _buf_wavependulum {
     long cross_in;
     long nBackwards_in;
     long nWaveBack_in;
+    t_symbol *indexdir_in;
+    char pyramid_in;
+    char linkchannels_in;
+    long keychannel_in;
+    char quality_in;
+    double scratch_in;
+    double membudget_in;
+    t_wes_arena arena;
+    t_wes_budget budget;
     
 } t_buf_wavependulum;
 
@@ -64,18 +79,21 @@ typedef struct _buf_wavependulum {
 t_buf_wavependulum*         buf_wavependulum_new(t_symbol *s, short argc, t_atom *argv);
 void            buf_wavependulum_free(t_buf_wavependulum *x);
 void            buf_wavependulum_bang(t_buf_wavependulum *x);
+void            buf_wavependulum_dryrun(t_buf_wavependulum *x);
+void            buf_wavependulum_run(t_buf_wavependulum *x, long dryrun);
 void            buf_wavependulum_anything(t_buf_wavependulum *x, t_symbol *msg, long ac, t_atom *av);
 
 void buf_wavependulum_assist(t_buf_wavependulum *x, void *b, long m, long a, char *s);
 void buf_wavependulum_inletinfo(t_buf_wavependulum *x, void *b, long a, char *t);
 
-void wavependulum_bang(t_buf_wavependulum *x, t_buffer_obj *buffer, t_buffer_obj *out);
+void wavependulum_bang(t_buf_wavependulum *x, t_buffer_obj *buffer, t_buffer_obj *out, long dryrun);
 
 // Globals and Statics
 static t_class    *s_tag_class = NULL;
 static t_symbol    *ps_event = NULL;
 
 EARSBUFOBJ_ADD_IO_METHODS(wavependulum)
+WES_ARENA_ADD_SCRATCH_SETTER(wavependulum, t_buf_wavependulum)
 
 /**********************************************************************/
 // Class Definition and Life Cycle
@@ -105,8 +123,34 @@ void C74_EXPORT ext_main(void* moduleRef)
     // buffer names (depending on the <m>naming</m> attribute).
     EARSBUFOBJ_DECLARE_COMMON_METHODS_HANDLETHREAD(wavependulum)
     
+    // @method cacheinfo @digest Post waveset index cache statistics
+    // @description Posts the number of waveset indices shared by all wes objects, their memory use,
+    // and the cache hits, misses and evictions so far.
+    // @method cachesize @digest Set waveset index cache size
+    // @description Sets the memory cap, in megabytes, of the waveset index cache shared by all wes objects;
+    // least recently used indices are dropped beyond it.
+    // @marg 0 @name megabytes @optional 0 @type float
+    // @method cacheclear @digest Clear waveset index cache
+    // @description Drops every waveset index not currently in use and resets the cache statistics.
+    WES_DECLARE_CACHE_METHODS(c)
+    
+    // @method dryrun @digest Post the projected cost of processing
+    // @description Posts, for each input buffer, the output frames, the memory and the time processing it would take,
+    // without synthesizing nor outputting anything.
+    class_addmethod(c, (method)buf_wavependulum_dryrun, "dryrun", 0);
+    
     CLASS_ATTR_LONG(c, "minsamp", 0, t_buf_wavependulum, sampMin_in);
     CLASS_ATTR_LONG(c, "cross", 0, t_buf_wavependulum, cross_in);
+    CLASS_ATTR_SYM(c, "indexdir", 0, t_buf_wavependulum, indexdir_in);
+    CLASS_ATTR_CHAR(c, "pyramid", 0, t_buf_wavependulum, pyramid_in);
+    CLASS_ATTR_STYLE_LABEL(c,"pyramid",0,"onoff","Prepare Minsamp Levels");
+    CLASS_ATTR_CHAR(c, "linkchannels", 0, t_buf_wavependulum, linkchannels_in);
+    CLASS_ATTR_STYLE_LABEL(c,"linkchannels",0,"enumindex","Link Channels");
+    CLASS_ATTR_ENUMINDEX(c,"linkchannels", 0, "Off Mid \"Key Channel\"");
+    CLASS_ATTR_LONG(c, "keychannel", 0, t_buf_wavependulum, keychannel_in);
+    WES_DECLARE_QUALITY_ATTR(c, t_buf_wavependulum)
+    WES_DECLARE_BUDGET_ATTR(c, t_buf_wavependulum)
+    WES_DECLARE_SCRATCH_ATTR(c, wavependulum, t_buf_wavependulum)
     CLASS_ATTR_LONG(c, "backwards", 0, t_buf_wavependulum, nBackwards_in);
     CLASS_ATTR_LONG(c, "waveback", 0, t_buf_wavependulum, nWaveBack_in);
 
@@ -151,6 +195,15 @@ t_buf_wavependulum *buf_wavependulum_new(t_symbol *s, short argc, t_atom *argv)
         
         x->sampMin_in = 15;
         x->cross_in = 1;
+        x->indexdir_in = gensym("");
+        x->pyramid_in = 0;
+        x->linkchannels_in = WES_LINK_OFF;
+        x->keychannel_in = 1;
+        x->quality_in = WES_QUALITY_LINEAR;
+        x->scratch_in = WES_ARENA_DEFAULT_SCRATCH;
+        x->membudget_in = 0;
+        wes_arena_init(&x->arena);
+        wes_budget_init(&x->budget);
         x->nBackwards_in = 3;
         x->nWaveBack_in = 3;
   
@@ -180,6 +233,7 @@ t_buf_wavependulum *buf_wavependulum_new(t_symbol *s, short argc, t_atom *argv)
 
 void buf_wavependulum_free(t_buf_wavependulum *x)
 {
+    wes_arena_free(&x->arena);
     earsbufobj_free((t_earsbufobj *)x);
 }
 
@@ -187,6 +241,18 @@ void buf_wavependulum_free(t_buf_wavependulum *x)
 
 
 void buf_wavependulum_bang(t_buf_wavependulum *x)
+{
+    buf_wavependulum_run(x, 0);
+}
+
+
+void buf_wavependulum_dryrun(t_buf_wavependulum *x)
+{
+    buf_wavependulum_run(x, 1);
+}
+
+
+void buf_wavependulum_run(t_buf_wavependulum *x, long dryrun)
 {
     long num_buffers = earsbufobj_get_instore_size((t_earsbufobj *)x, 0);
     earsbufobj_refresh_outlet_names((t_earsbufobj *)x);
@@ -200,14 +266,15 @@ void buf_wavependulum_bang(t_buf_wavependulum *x)
         t_buffer_obj *out = earsbufobj_get_outlet_buffer_obj((t_earsbufobj *)x, 0, count);
 
 
-        wavependulum_bang(x, in, out);
+        wavependulum_bang(x, in, out, dryrun);
         
         if (earsbufobj_iter_progress((t_earsbufobj *)x, count, num_buffers)) break;
     }
     
     earsbufobj_mutex_unlock((t_earsbufobj *)x);
 
-    earsbufobj_outlet_buffer((t_earsbufobj *)x, 0);
+    if (!dryrun)
+        earsbufobj_outlet_buffer((t_earsbufobj *)x, 0);
 }
 
 
@@ -232,7 +299,28 @@ void buf_wavependulum_anything(t_buf_wavependulum *x, t_symbol *msg, long ac, t_
 }
 
 
-void wavependulum_bang(t_buf_wavependulum *x, t_buffer_obj *buffer, t_buffer_obj *out) {
+// period of the swing indice of a group of wavesets of currPeriod samples
+static inline long wavependulum_period(long currPeriod, int indice, int nBackwards, long frames)
+{
+    return CLAMP(round(currPeriod * (1 - ((float)indice / nBackwards))), 2, frames);
+}
+
+// number of samples synthesized from a channel
+static long wavependulum_plan(const t_wes_features *wf, int nBackwards, int nWaveBack, long frames)
+{
+    long g, h = 0;
+    int indice;
+    
+    for (g = nWaveBack ; g <= wf->count ; g++) {
+        long currPeriod = wf->zerocrossindex[g] - wf->zerocrossindex[g - nWaveBack];
+        for (indice = 0 ; indice < nBackwards ; indice++) {
+            h += wavependulum_period(currPeriod, indice, nBackwards, frames);
+        }
+    }
+    return h;
+}
+
+void wavependulum_bang(t_buf_wavependulum *x, t_buffer_obj *buffer, t_buffer_obj *out, long dryrun) {
 
     t_float        *tab;
 
@@ -244,71 +332,63 @@ void wavependulum_bang(t_buf_wavependulum *x, t_buffer_obj *buffer, t_buffer_obj
 
     long        frames, sampleRate;
 
+    wes_budget_start(&x->budget);
+
     tab = ears_buffer_locksamples(buffer);
     frames = buffer_getframecount(buffer);
     sampleRate = buffer_getsamplerate(buffer);
     
     int nchan;
     nchan = buffer_getchannelcount(buffer);
-    double *inbuffer =  (double*) sysmem_newptr(frames * sizeof(double));
+    t_wes_planar planar;
+    wes_planar_init(&planar, &x->arena, tab, frames, nchan);
     
-    int maxcross = round(frames / (minsampl * ncross));
-    int *zerocrossindex = (int*) sysmem_newptr(maxcross * sizeof(int));
    
-    int maxmemory = (int)(frames);
-    double *dataout =  (double*) sysmem_newptr(maxmemory * sizeof(double));
     
-    int z, v , ver, frameout = 0;
+    int z;
+    long frameout = 0, skipped = 0;
+    t_wes_cost cost;
+    t_wes_index *linked = wes_cache_acquire_linked(buffer, &planar, x->linkchannels_in, x->keychannel_in, minsampl, ncross, x->indexdir_in, x->pyramid_in);
     for (z = 1 ; z < (nchan + 1) ; z++) {
-        int inc = 0;
+        const float *inbuffer = wes_planar_channel(&planar, z);
+        t_wes_resampler rs;
+        wes_resampler_init(&rs, x->quality_in, inbuffer, frames);
         
-        for (v = 0 ; v < (frames * nchan) ; v++) {
-            ver = (v % nchan) + 1;
-            if (ver == z) {
-                inc++;
-                inbuffer[inc] = tab[v];
-            }
-        }
-        
-        int  g = 1, minsamplcount = 0, h = 0, b = 0, j, k, ncrossindex = 0, a, n = 0, indice = 0,  currPeriod, newPeriod;
-        double bCF, aCF, res, idxD, scaleCF;
-        int crosscount = 0;
+        long g = 1, h = 0, k, n = 0, indice = 0, currPeriod, newPeriod;
+        double scaleCF, res[WES_RESAMPLE_BLOCK];
+        long crosscount = 0;
         ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
         
         // waveset segmentation
-        for (j = 0 ; j < frames ; j++) {
-            minsamplcount++;
-            
-            if (inbuffer [j] >= 0 && inbuffer [j - 1] <= 0 && minsamplcount > minsampl) {
-                minsamplcount = 0;
-                ncrossindex++;
-                
-                if (ncrossindex == ncross) {
-                    ncrossindex = 0;
-                    crosscount++;
-                    if (crosscount >= maxcross) {
-                        maxcross = maxcross + round(maxcross/4);
-                        zerocrossindex = (int*) sysmem_resizeptrclear(zerocrossindex, maxcross * sizeof(int));
-                        
-                    }
-                    
-                    
-                    zerocrossindex[crosscount] = j;
-                    
-                    
-                }
-            }
-        }
-        
-        zerocrossindex[0] = 0;
+        t_wes_index *index = wes_cache_acquire_channel(buffer, &planar, z, linked, minsampl, ncross, x->indexdir_in, x->pyramid_in);
+        t_wes_features *wf = &index->features;
+        long *zerocrossindex = wf->zerocrossindex;
+        crosscount = wf->count;
         
         if (nBackwards % 2 < 1) {
             nBackwards =  nBackwards + 1;
         }
         
+        long planned = wavependulum_plan(wf, nBackwards, nWaveBack, frames);
+        if (z == 1) {
+            frameout = planned - 1;
+            wes_budget_project(&x->budget, &cost, frames, nchan, crosscount, frameout, nchan, 0);
+            if (!wes_budget_admit((t_object *) x, &cost, x->membudget_in, dryrun, NULL)) {
+                if (!dryrun)
+                    ears_buffer_set_size_and_numchannels((t_object *) x, out, 0, nchan);
+                skipped = 1;
+                wes_cache_release(index);
+                break;
+            }
+            ears_buffer_set_size_and_numchannels((t_object *) x, out, frameout, nchan);
+            ears_buffer_set_sr((t_object *) x, out, sampleRate);
+        }
+        t_wes_output output;
+        wes_output_begin(&output, ears_buffer_locksamples(out), frameout, nchan, z);
+        
         
         g = nWaveBack;
-        int f, rev;
+        int rev;
         
         while (g <= crosscount) {
             
@@ -316,43 +396,31 @@ void wavependulum_bang(t_buf_wavependulum *x, t_buffer_obj *buffer, t_buffer_obj
             while (indice < nBackwards) {
          
                 
+                const float *wave = inbuffer + zerocrossindex[g - nWaveBack];
                 currPeriod = (zerocrossindex[g] - zerocrossindex[g  - nWaveBack]);
                 
                 
-                newPeriod = CLAMP(round(currPeriod * (1 - ((float)indice / nBackwards))), 2, frames);
-                
+                newPeriod = wavependulum_period(currPeriod, indice, nBackwards, frames);
+                scaleCF = wes_resample_scale(currPeriod, newPeriod);
+                rev = (indice % 2 > 0) ? 1 : -1;
                 
                 
                 while (n < newPeriod) {
+                    long len = MIN(WES_RESAMPLE_BLOCK, newPeriod - n);
                     
-                    
-                    if (indice % 2 > 0) {
-                        f = n;
-                        rev = 1;
+                    // odd passes go forwards, even ones backwards from the end
+                    if (rev > 0) {
+                        wes_resample(&rs, wave, 0, scaleCF, n, 1, len, res);
                     } else {
-                        f = newPeriod - n;
-                        rev = -1;
+                        wes_resample(&rs, wave, 0, scaleCF, newPeriod - n, -1, len, res);
                     }
                     
-                    
-                    scaleCF = ((double)currPeriod - 1) / ((double)newPeriod - 1);;
-                    idxD = (double)scaleCF * f;
-                    a = (int)idxD;
-                    b = a + 1;
-                    bCF = idxD - a;
-                    aCF = 1.0 - bCF;
-                    res = (double)(aCF * inbuffer[a + zerocrossindex[g - nWaveBack]] + bCF * inbuffer[b + zerocrossindex[g - nWaveBack]]);
-                    
-                    if (h >= maxmemory) {
-                        maxmemory = maxmemory + round(maxmemory/4);
-                        dataout =  (double*)sysmem_resizeptrclear(dataout, maxmemory * sizeof(double));
-                        
+                    long skip, count = wes_output_clip(&output, h, len, &skip);
+                    for (k = skip ; k < skip + count ; k++) {
+                        wes_output_write(&output, h + k, (res[k] * rev) * 0.9);
                     }
-                    
-                    dataout[h] = (res * rev) * 0.9;
-                    n++;
-                    h++;
-                    
+                    h += len;
+                    n += len;
                 }
                 n = 0;
                 indice++;
@@ -361,33 +429,16 @@ void wavependulum_bang(t_buf_wavependulum *x, t_buffer_obj *buffer, t_buffer_obj
             g++;
         }
         
-        if (z == 1) {
-            frameout = h - 1;;
-        }
-        
-        ears_buffer_set_size_and_numchannels((t_object *) x, out, frameout, nchan);
-        ears_buffer_set_sr((t_object *) x, out, sampleRate);
-        
-        float *outtab = ears_buffer_locksamples(out);
-        
-        
-        inc = 0;
-        for (k = 0 ; k < (frameout * nchan) ; k++) {
-            ver = (k % nchan) + 1;
-            if (ver == z) {
-                inc++;
-                double f = dataout[inc];
-                outtab[k] = f;
-            }
-            
-        }
+        wes_output_finish(&output, h);
         ears_buffer_unlocksamples(out);
+        wes_cache_release(index);
     }
     
     
     ears_buffer_unlocksamples(buffer);
-    sysmem_freeptr(zerocrossindex);
-    sysmem_freeptr(dataout);
-    sysmem_freeptr(inbuffer);
+    wes_cache_release(linked);
+    if (!skipped)
+        wes_budget_stop(&x->budget, (double)frameout * nchan);
+    wes_arena_end(&x->arena, wes_arena_megabytes(x->scratch_in));
     return;
 }
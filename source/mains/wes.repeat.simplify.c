@@ -44,6 +44,12 @@
 #include "foundation/llll_commons_ext.h"
 #include "math/bach_math_utilities.h"
 #include "ears.object.h"
+#include "wes.cache.h"
+#include "wes.arena.h"
+#include "wes.planar.h"
+#include "wes.output.h"
+#include "wes.budget.h"
+#include "wes.fade.h"
 
 
 
@@ -52,6 +58,14 @@ typedef struct _buf_wavesimplify {
     long sampMin_in;
     long cross_in;
     int nextWave_in;
+    t_symbol *indexdir_in;
+    char pyramid_in;
+    char linkchannels_in;
+    long keychannel_in;
+    double scratch_in;
+    double membudget_in;
+    t_wes_arena arena;
+    t_wes_budget budget;
     t_llll  *envin;
     
 } t_buf_wavesimplify;
@@ -63,12 +77,14 @@ typedef struct _buf_wavesimplify {
 t_buf_wavesimplify*         buf_wavesimplify_new(t_symbol *s, short argc, t_atom *argv);
 void            buf_wavesimplify_free(t_buf_wavesimplify *x);
 void            buf_wavesimplify_bang(t_buf_wavesimplify *x);
+void            buf_wavesimplify_dryrun(t_buf_wavesimplify *x);
+void            buf_wavesimplify_run(t_buf_wavesimplify *x, long dryrun);
 void            buf_wavesimplify_anything(t_buf_wavesimplify *x, t_symbol *msg, long ac, t_atom *av);
 
 void buf_wavesimplify_assist(t_buf_wavesimplify *x, void *b, long m, long a, char *s);
 void buf_wavesimplify_inletinfo(t_buf_wavesimplify *x, void *b, long a, char *t);
 
-void wavesimplify_bang(t_buf_wavesimplify *x, t_buffer_obj *buffer, t_buffer_obj *out, t_buffer_obj *mod, double modVal, int modType);
+void wavesimplify_bang(t_buf_wavesimplify *x, t_buffer_obj *buffer, t_buffer_obj *out, t_buffer_obj *mod, double modVal, int modType, long dryrun);
 long ears_resample_linear(float *in, long num_in_frames, float **out, long num_out_frames, double factor, long num_channels);
 
 
@@ -77,6 +93,7 @@ static t_class    *s_tag_class = NULL;
 static t_symbol    *ps_event = NULL;
 
 EARSBUFOBJ_ADD_IO_METHODS(wavesimplify)
+WES_ARENA_ADD_SCRATCH_SETTER(wavesimplify, t_buf_wavesimplify)
 
 /**********************************************************************/
 // Class Definition and Life Cycle
@@ -106,8 +123,34 @@ void C74_EXPORT ext_main(void* moduleRef)
     // buffer name (depending on the <m>naming</m> attribute).
     EARSBUFOBJ_DECLARE_COMMON_METHODS_HANDLETHREAD(wavesimplify)
     
+    // @method cacheinfo @digest Post waveset index cache statistics
+    // @description Posts the number of waveset indices shared by all wes objects, their memory use,
+    // and the cache hits, misses and evictions so far.
+    // @method cachesize @digest Set waveset index cache size
+    // @description Sets the memory cap, in megabytes, of the waveset index cache shared by all wes objects;
+    // least recently used indices are dropped beyond it.
+    // @marg 0 @name megabytes @optional 0 @type float
+    // @method cacheclear @digest Clear waveset index cache
+    // @description Drops every waveset index not currently in use and resets the cache statistics.
+    WES_DECLARE_CACHE_METHODS(c)
+    wes_fade_init();
+    
+    // @method dryrun @digest Post the projected cost of processing
+    // @description Posts, for each input buffer, the output frames, the memory and the time processing it would take,
+    // without synthesizing nor outputting anything.
+    class_addmethod(c, (method)buf_wavesimplify_dryrun, "dryrun", 0);
+    
     CLASS_ATTR_LONG(c, "minsamp", 0, t_buf_wavesimplify, sampMin_in);
     CLASS_ATTR_LONG(c, "cross", 0, t_buf_wavesimplify, cross_in);
+    CLASS_ATTR_SYM(c, "indexdir", 0, t_buf_wavesimplify, indexdir_in);
+    CLASS_ATTR_CHAR(c, "pyramid", 0, t_buf_wavesimplify, pyramid_in);
+    CLASS_ATTR_STYLE_LABEL(c,"pyramid",0,"onoff","Prepare Minsamp Levels");
+    CLASS_ATTR_CHAR(c, "linkchannels", 0, t_buf_wavesimplify, linkchannels_in);
+    CLASS_ATTR_STYLE_LABEL(c,"linkchannels",0,"enumindex","Link Channels");
+    CLASS_ATTR_ENUMINDEX(c,"linkchannels", 0, "Off Mid \"Key Channel\"");
+    CLASS_ATTR_LONG(c, "keychannel", 0, t_buf_wavesimplify, keychannel_in);
+    WES_DECLARE_BUDGET_ATTR(c, t_buf_wavesimplify)
+    WES_DECLARE_SCRATCH_ATTR(c, wavesimplify, t_buf_wavesimplify)
     CLASS_ATTR_LONG(c, "nextwavemult", 0, t_buf_wavesimplify, nextWave_in);
    
 
@@ -153,6 +196,14 @@ t_buf_wavesimplify *buf_wavesimplify_new(t_symbol *s, short argc, t_atom *argv)
         x->envin = llll_from_text_buf("1", false);
         x->sampMin_in = 15;
         x->cross_in = 1;
+        x->indexdir_in = gensym("");
+        x->pyramid_in = 0;
+        x->linkchannels_in = WES_LINK_OFF;
+        x->keychannel_in = 1;
+        x->scratch_in = WES_ARENA_DEFAULT_SCRATCH;
+        x->membudget_in = 0;
+        wes_arena_init(&x->arena);
+        wes_budget_init(&x->budget);
         x->nextWave_in = 1;
    
         earsbufobj_init((t_earsbufobj *)x,  0);
@@ -182,6 +233,7 @@ t_buf_wavesimplify *buf_wavesimplify_new(t_symbol *s, short argc, t_atom *argv)
 
 void buf_wavesimplify_free(t_buf_wavesimplify *x)
 {
+    wes_arena_free(&x->arena);
     llll_free(x->envin);
     earsbufobj_free((t_earsbufobj *)x);
     
@@ -191,6 +243,18 @@ void buf_wavesimplify_free(t_buf_wavesimplify *x)
 
 
 void buf_wavesimplify_bang(t_buf_wavesimplify *x)
+{
+    buf_wavesimplify_run(x, 0);
+}
+
+
+void buf_wavesimplify_dryrun(t_buf_wavesimplify *x)
+{
+    buf_wavesimplify_run(x, 1);
+}
+
+
+void buf_wavesimplify_run(t_buf_wavesimplify *x, long dryrun)
 {
     long num_buffers = earsbufobj_get_instore_size((t_earsbufobj *)x, 0);
     earsbufobj_refresh_outlet_names((t_earsbufobj *)x);
@@ -223,14 +287,15 @@ void buf_wavesimplify_bang(t_buf_wavesimplify *x)
         
         llll_free(env);
         
-        wavesimplify_bang(x, in, out, mod, modVal, modType);
+        wavesimplify_bang(x, in, out, mod, modVal, modType, dryrun);
         
         if (earsbufobj_iter_progress((t_earsbufobj *)x, count, num_buffers)) break;
     }
     
     earsbufobj_mutex_unlock((t_earsbufobj *)x);
 
-    earsbufobj_outlet_buffer((t_earsbufobj *)x, 0);
+    if (!dryrun)
+        earsbufobj_outlet_buffer((t_earsbufobj *)x, 0);
 }
 
 
@@ -260,7 +325,48 @@ void buf_wavesimplify_anything(t_buf_wavesimplify *x, t_symbol *msg, long ac, t_
 }
 
 
-void wavesimplify_bang(t_buf_wavesimplify *x, t_buffer_obj *buffer, t_buffer_obj *out, t_buffer_obj *mod, double modVal, int modType) {
+// number of wavesets skipped after waveset g
+static inline int wavesimplify_next(const float *envOnset, long g, int nextWaveMult, double modVal, int modType)
+{
+    if (modType == 1) {
+        return round(CLAMP(envOnset[g], 0 , 1) * nextWaveMult);
+    } else {
+        return CLAMP(modVal, 0 , 5000);
+    }
+}
+
+// length of the crossfade from waveset g to waveset g + nextWave
+static inline long wavesimplify_period(const t_wes_features *wf, long g, int nextWave)
+{
+    long currPeriod = wf->period[g];
+    long nextPeriod = wf->period[g + nextWave];
+    long distance = wf->zerocrossindex[g + nextWave] - wf->zerocrossindex[g];
+    
+    if (distance < currPeriod || distance < nextPeriod) {
+        return MAX(currPeriod, nextPeriod);
+    } else {
+        return ((long)((float)distance/nextPeriod)) * nextPeriod;
+    }
+}
+
+// number of samples synthesized from a channel
+static long wavesimplify_plan(const t_wes_features *wf, const float *envOnset, int nextWaveMult, int nextWaveCount, double modVal, int modType)
+{
+    long g = 1, h = 0;
+    int nextWave;
+    
+    if (nextWaveCount >= wf->count) {
+        return 0;
+    }
+    while (g <= wf->count && (g + nextWaveCount) <= wf->count) {
+        nextWave = wavesimplify_next(envOnset, g, nextWaveMult, modVal, modType);
+        h += MAX(0, wavesimplify_period(wf, g, nextWave));
+        g += MAX(1, nextWave);
+    }
+    return h;
+}
+
+void wavesimplify_bang(t_buf_wavesimplify *x, t_buffer_obj *buffer, t_buffer_obj *out, t_buffer_obj *mod, double modVal, int modType, long dryrun) {
     
     t_float        *tab;
     t_float        *envelope;
@@ -272,6 +378,8 @@ void wavesimplify_bang(t_buf_wavesimplify *x, t_buffer_obj *buffer, t_buffer_obj
     
     long        frames, sampleRate, envelopeFrames ;
     
+    wes_budget_start(&x->budget);
+    
     tab = ears_buffer_locksamples(buffer);
     frames = buffer_getframecount(buffer);
     sampleRate = buffer_getsamplerate(buffer);
@@ -284,56 +392,31 @@ void wavesimplify_bang(t_buf_wavesimplify *x, t_buffer_obj *buffer, t_buffer_obj
     
     int nchan;
     nchan = buffer_getchannelcount(buffer);
-    double *inbuffer =  (double*) sysmem_newptr(frames * sizeof(double));
+    t_wes_planar planar;
+    wes_planar_init(&planar, &x->arena, tab, frames, nchan);
     
     
-    int maxcross = round(frames / (minsampl * ncross));
-    int *zerocrossindex = (int*) sysmem_newptr(maxcross * sizeof(int));
-    int maxmemory = (int)(frames * 4);
-    double *dataout =  (double*) sysmem_newptr(maxmemory * sizeof(double));
     
     ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-    int z, v , ver, frameout = 0;
+    int z;
+    long frameout = 0, skipped = 0;
+    t_wes_cost cost;
+    t_wes_index *linked = wes_cache_acquire_linked(buffer, &planar, x->linkchannels_in, x->keychannel_in, minsampl, ncross, x->indexdir_in, x->pyramid_in);
     for (z = 1 ; z < (nchan + 1) ; z++) {
-        int inc = 0;
-
-        for (v = 0 ; v < (frames * nchan) ; v++) {
-            ver = (v % nchan) + 1;
-            if (ver == z) {
-                inc++;
-                inbuffer[inc] = tab[v];
-            }
-        }
+        const float *inbuffer = wes_planar_channel(&planar, z);
       
-        int  g = 1, minsamplcount = 0, h = 0, j, k, ncrossindex = 0, crosscount = 0, n = 0, newPeriod, currPeriod, nextPeriod, currIndexA, currIndexB, muteFadeIn, nextWaveCount, nextWave;
+        long g = 1, h = 0, crosscount = 0, n = 0, newPeriod, currPeriod, nextPeriod, currIndexA, currIndexB, muteFadeIn, nextWaveCount, nextWave;
+        double fadeRate;
        
         
-        // qwaveset segmentation
-        for (j = 0 ; j < frames ; j++) {
-            minsamplcount++;
-            
-            if (inbuffer [j] >= 0 && inbuffer [j - 1] <= 0 && minsamplcount > minsampl) {
-                minsamplcount = 0;
-                ncrossindex++;
-                
-                if (ncrossindex == ncross) {
-                    ncrossindex = 0;
-                    crosscount++;
-                    if (crosscount >= maxcross) {
-                        maxcross = maxcross + round(maxcross/4);
-                        zerocrossindex = (int*) sysmem_resizeptrclear(zerocrossindex, maxcross * sizeof(int));
-                    }
-                    
-                    zerocrossindex[crosscount] = j;
-                }
-                
-            }
-        }
-        
-        zerocrossindex[0] = 0;
+        // waveset segmentation
+        t_wes_index *index = wes_cache_acquire_channel(buffer, &planar, z, linked, minsampl, ncross, x->indexdir_in, x->pyramid_in);
+        t_wes_features *wf = &index->features;
+        crosscount = wf->count;
         
         ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-        float *envOnset = (float *)bach_newptr(crosscount * sizeof(float));
+        size_t mark = wes_arena_mark(&x->arena);
+        float *envOnset = wes_arena_envelope(&x->arena, crosscount);
         if (modType == 1) {
             nextWaveCount = nextWaveMult;
              ears_resample_linear(envelope, envelopeFrames, &envOnset, crosscount, ((float)crosscount/(float)envelopeFrames), 1);
@@ -343,26 +426,37 @@ void wavesimplify_bang(t_buf_wavesimplify *x, t_buffer_obj *buffer, t_buffer_obj
                 envOnset[gg] = modVal;
             }
         }
+        
+        long planned = wavesimplify_plan(wf, envOnset, nextWaveMult, nextWaveCount, modVal, modType);
+        if (z == 1) {
+            frameout = planned - 1;
+            wes_budget_project(&x->budget, &cost, frames, nchan, crosscount, frameout, nchan, 0);
+            if (!wes_budget_admit((t_object *) x, &cost, x->membudget_in, dryrun, NULL)) {
+                if (!dryrun)
+                    ears_buffer_set_size_and_numchannels((t_object *) x, out, 0, nchan);
+                skipped = 1;
+                wes_cache_release(index);
+                break;
+            }
+            ears_buffer_set_size_and_numchannels((t_object *) x, out, frameout, nchan);
+            ears_buffer_set_sr((t_object *) x, out, sampleRate);
+        }
+        t_wes_output output;
+        wes_output_begin(&output, ears_buffer_locksamples(out), frameout, nchan, z);
         ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
         
         if (nextWaveCount >= crosscount) {
-            post("too many nextWave, total number of waveset is: %d", crosscount);
+            post("too many nextWave, total number of waveset is: %ld", crosscount);
             
         } else {
             
             while (g <= crosscount && (g + nextWaveCount) <= crosscount) {
                 
-                if (modType == 1) {
-                    nextWave = round(CLAMP(envOnset[g], 0 , 1) * nextWaveMult);
-                } else {
-                    nextWave = CLAMP(modVal, 0 , 5000);
-                }
+                nextWave = wavesimplify_next(envOnset, g, nextWaveMult, modVal, modType);
                 
-                currPeriod = (zerocrossindex[g] - zerocrossindex[g  - 1]);
+                currPeriod = wf->period[g];
                 
-                nextPeriod = (zerocrossindex[g + nextWave] - zerocrossindex[(g + nextWave) - 1]);
-                
-                int distance = zerocrossindex[g + nextWave] - zerocrossindex[g];
+                nextPeriod = wf->period[g + nextWave];
                 
                 if ((g + (nextWave * 2)) >= crosscount) {
                     muteFadeIn = 0;
@@ -370,33 +464,22 @@ void wavesimplify_bang(t_buf_wavesimplify *x, t_buffer_obj *buffer, t_buffer_obj
                     muteFadeIn = 1;
                 }
                 
-                if (distance < currPeriod || distance < nextPeriod) {
-                    newPeriod = MAX(currPeriod, nextPeriod);
-                } else {
-                    newPeriod = ((int)((float)distance/nextPeriod)) * nextPeriod;
-                }
-                
+                newPeriod = wavesimplify_period(wf, g, nextWave);
+                fadeRate = wes_fade_rate(newPeriod);
                 
-                while (n < newPeriod) {
-                    
-                    float fadeIn = sin(((float)n/(float)newPeriod) * (PI * 0.5));
-                    float fadeOut = cos(((float)n/(float)newPeriod) * (PI * 0.5));
-                    
-                    currIndexA = zerocrossindex[g  - 1] + (n % currPeriod);
-                    currIndexB = zerocrossindex[(g + nextWave) - 1] + (n % nextPeriod);
+                long skip, count = wes_output_clip(&output, h, newPeriod, &skip);
+                for (n = skip ; n < skip + count ; n++) {
                     
+                    float fadeIn, fadeOut;
+                    wes_fade_gains(n * fadeRate, &fadeIn, &fadeOut);
                     
-                    if (h >= maxmemory) {
-                        maxmemory = maxmemory + round(maxmemory/4);
-                        dataout =  (double*)sysmem_resizeptrclear(dataout, maxmemory * sizeof(double));
-                    }
+                    currIndexA = wf->start[g] + (n % currPeriod);
+                    currIndexB = wf->start[g + nextWave] + (n % nextPeriod);
                     
-                    dataout[h] = (inbuffer[currIndexA] * fadeOut) +  (inbuffer[currIndexB] * fadeIn * muteFadeIn);
                     
-                    
-                    h++;
-                    n++;
+                    wes_output_write(&output, h + n, ((double)inbuffer[currIndexA] * fadeOut) +  ((double)inbuffer[currIndexB] * fadeIn * muteFadeIn));
                 }
+                h += MAX(0, newPeriod);
                 
                 n = 0;
                 
@@ -410,36 +493,18 @@ void wavesimplify_bang(t_buf_wavesimplify *x, t_buffer_obj *buffer, t_buffer_obj
         }
         ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
         
-        if (z == 1) {
-             frameout = h - 1;
-        }
-        ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-        
-        ears_buffer_set_size_and_numchannels((t_object *) x, out, frameout, nchan);
-        ears_buffer_set_sr((t_object *) x, out, sampleRate);
-        
-        float *outtab = ears_buffer_locksamples(out);
-        
-        ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-        inc = 0;
-        for (k = 0 ; k < (frameout * nchan) ; k++) {
-            ver = (k % nchan) + 1;
-            if (ver == z) {
-                inc++;
-                double f = dataout[inc];
-                outtab[k] = f;
-            }
-            
-        }
+        wes_output_finish(&output, h);
         ears_buffer_unlocksamples(out);
-        bach_freeptr(envOnset);
+        wes_cache_release(index);
+        wes_arena_rewind(&x->arena, mark);
     }
     
     buffer_unlocksamples(buffer);
     buffer_unlocksamples(mod);
-    sysmem_freeptr(zerocrossindex);
-    sysmem_freeptr(dataout);
-    sysmem_freeptr(inbuffer);
+    wes_cache_release(linked);
+    if (!skipped)
+        wes_budget_stop(&x->budget, (double)frameout * nchan);
+    wes_arena_end(&x->arena, wes_arena_megabytes(x->scratch_in));
     
     return;
 }
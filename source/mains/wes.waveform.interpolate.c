@@ -44,6 +44,12 @@ Marco Marasciuolo
 #include "foundation/llll_commons_ext.h"
 #include "math/bach_math_utilities.h"
 #include "ears.object.h"
+#include "wes.cache.h"
+#include "wes.arena.h"
+#include "wes.planar.h"
+#include "wes.output.h"
+#include "wes.budget.h"
+#include "wes.resample.h"
 
 
 
@@ -52,6 +58,15 @@ typedef struct _buf_wavesinterpolate {
     long sampMin_in;
     long cross_in;
     int nInterp_in;
+    t_symbol *indexdir_in;
+    char pyramid_in;
+    char linkchannels_in;
+    long keychannel_in;
+    char quality_in;
+    double scratch_in;
+    double membudget_in;
+    t_wes_arena arena;
+    t_wes_budget budget;
     t_llll  *envin;
     
 } t_buf_wavesinterpolate;
@@ -63,12 +78,14 @@ typedef struct _buf_wavesinterpolate {
 t_buf_wavesinterpolate*         buf_wavesinterpolate_new(t_symbol *s, short argc, t_atom *argv);
 void            buf_wavesinterpolate_free(t_buf_wavesinterpolate *x);
 void            buf_wavesinterpolate_bang(t_buf_wavesinterpolate *x);
+void            buf_wavesinterpolate_dryrun(t_buf_wavesinterpolate *x);
+void            buf_wavesinterpolate_run(t_buf_wavesinterpolate *x, long dryrun);
 void            buf_wavesinterpolate_anything(t_buf_wavesinterpolate *x, t_symbol *msg, long ac, t_atom *av);
 
 void buf_wavesinterpolate_assist(t_buf_wavesinterpolate *x, void *b, long m, long a, char *s);
 void buf_wavesinterpolate_inletinfo(t_buf_wavesinterpolate *x, void *b, long a, char *t);
 
-void wavesinterpolate_bang(t_buf_wavesinterpolate *x, t_buffer_obj *buffer, t_buffer_obj *out, t_buffer_obj *mod, double modVal, int modType);
+void wavesinterpolate_bang(t_buf_wavesinterpolate *x, t_buffer_obj *buffer, t_buffer_obj *out, t_buffer_obj *mod, double modVal, int modType, long dryrun);
 long ears_resample_linear(float *in, long num_in_frames, float **out, long num_out_frames, double factor, long num_channels);
 
 
@@ -77,6 +94,7 @@ static t_class    *s_tag_class = NULL;
 static t_symbol    *ps_event = NULL;
 
 EARSBUFOBJ_ADD_IO_METHODS(wavesinterpolate)
+WES_ARENA_ADD_SCRATCH_SETTER(wavesinterpolate, t_buf_wavesinterpolate)
 
 /**********************************************************************/
 // Class Definition and Life Cycle
@@ -106,8 +124,34 @@ void C74_EXPORT ext_main(void* moduleRef)
     // buffer name (depending on the <m>naming</m> attribute).
     EARSBUFOBJ_DECLARE_COMMON_METHODS_HANDLETHREAD(wavesinterpolate)
     
+    // @method cacheinfo @digest Post waveset index cache statistics
+    // @description Posts the number of waveset indices shared by all wes objects, their memory use,
+    // and the cache hits, misses and evictions so far.
+    // @method cachesize @digest Set waveset index cache size
+    // @description Sets the memory cap, in megabytes, of the waveset index cache shared by all wes objects;
+    // least recently used indices are dropped beyond it.
+    // @marg 0 @name megabytes @optional 0 @type float
+    // @method cacheclear @digest Clear waveset index cache
+    // @description Drops every waveset index not currently in use and resets the cache statistics.
+    WES_DECLARE_CACHE_METHODS(c)
+    
+    // @method dryrun @digest Post the projected cost of processing
+    // @description Posts, for each input buffer, the output frames, the memory and the time processing it would take,
+    // without synthesizing nor outputting anything.
+    class_addmethod(c, (method)buf_wavesinterpolate_dryrun, "dryrun", 0);
+    
     CLASS_ATTR_LONG(c, "minsamp", 0, t_buf_wavesinterpolate, sampMin_in);
     CLASS_ATTR_LONG(c, "cross", 0, t_buf_wavesinterpolate, cross_in);
+    CLASS_ATTR_SYM(c, "indexdir", 0, t_buf_wavesinterpolate, indexdir_in);
+    CLASS_ATTR_CHAR(c, "pyramid", 0, t_buf_wavesinterpolate, pyramid_in);
+    CLASS_ATTR_STYLE_LABEL(c,"pyramid",0,"onoff","Prepare Minsamp Levels");
+    CLASS_ATTR_CHAR(c, "linkchannels", 0, t_buf_wavesinterpolate, linkchannels_in);
+    CLASS_ATTR_STYLE_LABEL(c,"linkchannels",0,"enumindex","Link Channels");
+    CLASS_ATTR_ENUMINDEX(c,"linkchannels", 0, "Off Mid \"Key Channel\"");
+    CLASS_ATTR_LONG(c, "keychannel", 0, t_buf_wavesinterpolate, keychannel_in);
+    WES_DECLARE_QUALITY_ATTR(c, t_buf_wavesinterpolate)
+    WES_DECLARE_BUDGET_ATTR(c, t_buf_wavesinterpolate)
+    WES_DECLARE_SCRATCH_ATTR(c, wavesinterpolate, t_buf_wavesinterpolate)
     CLASS_ATTR_LONG(c, "interpmax", 0, t_buf_wavesinterpolate, nInterp_in);
    
 
@@ -153,6 +197,15 @@ t_buf_wavesinterpolate *buf_wavesinterpolate_new(t_symbol *s, short argc, t_atom
         x->envin = llll_from_text_buf("1", false);
         x->sampMin_in = 15;
         x->cross_in = 1;
+        x->indexdir_in = gensym("");
+        x->pyramid_in = 0;
+        x->linkchannels_in = WES_LINK_OFF;
+        x->keychannel_in = 1;
+        x->quality_in = WES_QUALITY_LINEAR;
+        x->scratch_in = WES_ARENA_DEFAULT_SCRATCH;
+        x->membudget_in = 0;
+        wes_arena_init(&x->arena);
+        wes_budget_init(&x->budget);
         x->nInterp_in = 1;
    
         earsbufobj_init((t_earsbufobj *)x,  0);
@@ -182,6 +235,7 @@ t_buf_wavesinterpolate *buf_wavesinterpolate_new(t_symbol *s, short argc, t_atom
 
 void buf_wavesinterpolate_free(t_buf_wavesinterpolate *x)
 {
+    wes_arena_free(&x->arena);
     llll_free(x->envin);
     earsbufobj_free((t_earsbufobj *)x);
     
@@ -191,6 +245,18 @@ void buf_wavesinterpolate_free(t_buf_wavesinterpolate *x)
 
 
 void buf_wavesinterpolate_bang(t_buf_wavesinterpolate *x)
+{
+    buf_wavesinterpolate_run(x, 0);
+}
+
+
+void buf_wavesinterpolate_dryrun(t_buf_wavesinterpolate *x)
+{
+    buf_wavesinterpolate_run(x, 1);
+}
+
+
+void buf_wavesinterpolate_run(t_buf_wavesinterpolate *x, long dryrun)
 {
     long num_buffers = earsbufobj_get_instore_size((t_earsbufobj *)x, 0);
     earsbufobj_refresh_outlet_names((t_earsbufobj *)x);
@@ -223,14 +289,15 @@ void buf_wavesinterpolate_bang(t_buf_wavesinterpolate *x)
         
         llll_free(env);
         
-        wavesinterpolate_bang(x, in, out, mod, modVal, modType);
+        wavesinterpolate_bang(x, in, out, mod, modVal, modType, dryrun);
         
         if (earsbufobj_iter_progress((t_earsbufobj *)x, count, num_buffers)) break;
     }
     
     earsbufobj_mutex_unlock((t_earsbufobj *)x);
 
-    earsbufobj_outlet_buffer((t_earsbufobj *)x, 0);
+    if (!dryrun)
+        earsbufobj_outlet_buffer((t_earsbufobj *)x, 0);
 }
 
 
@@ -260,7 +327,52 @@ void buf_wavesinterpolate_anything(t_buf_wavesinterpolate *x, t_symbol *msg, lon
 }
 
 
-void wavesinterpolate_bang(t_buf_wavesinterpolate *x, t_buffer_obj *buffer, t_buffer_obj *out, t_buffer_obj *mod, double modVal, int modType) {
+// number of wavesets blended together from waveset g
+static inline int wavesinterpolate_count(const float *envOnset, long g, long crosscount, int interpMax, int modType)
+{
+    int nInterp;
+    
+    if (modType == 1) {
+        nInterp = (CLAMP(envOnset[g], 0 ,1) * interpMax) + 1;
+    } else {
+        nInterp = CLAMP(envOnset[g], 0, 8000) + 1;
+    }
+    
+    if ((g + nInterp) > crosscount) {
+        nInterp = crosscount - g;
+    }
+    return nInterp;
+}
+
+// mean period of the wavesets g ... g + nInterp - 1
+static inline long wavesinterpolate_period(const t_wes_features *wf, long g, int nInterp)
+{
+    long k, newPeriod = 0;
+    
+    if (nInterp <= 0) {
+        return 0;
+    }
+    for (k = 0 ; k < nInterp ; k++) {
+        newPeriod = newPeriod + wf->period[g + k];
+    }
+    return round((float)newPeriod / nInterp);
+}
+
+// number of samples synthesized from a channel
+static long wavesinterpolate_plan(const t_wes_features *wf, const float *envOnset, int interpMax, int modType)
+{
+    long g, h = 0;
+    
+    for (g = 1 ; g <= wf->count ; g++) {
+        int nInterp = wavesinterpolate_count(envOnset, g, wf->count, interpMax, modType);
+        if (nInterp > 0) {
+            h += wavesinterpolate_period(wf, g, nInterp);
+        }
+    }
+    return h;
+}
+
+void wavesinterpolate_bang(t_buf_wavesinterpolate *x, t_buffer_obj *buffer, t_buffer_obj *out, t_buffer_obj *mod, double modVal, int modType, long dryrun) {
     
     t_float        *tab;
     t_float        *envelope;
@@ -275,6 +387,7 @@ void wavesinterpolate_bang(t_buf_wavesinterpolate *x, t_buffer_obj *buffer, t_bu
     
     long        frames, sampleRate, envelopeFrames ;
     
+    wes_budget_start(&x->budget);
     tab = ears_buffer_locksamples(buffer);
     frames = buffer_getframecount(buffer);
     sampleRate = buffer_getsamplerate(buffer);
@@ -287,72 +400,35 @@ void wavesinterpolate_bang(t_buf_wavesinterpolate *x, t_buffer_obj *buffer, t_bu
     
     int nchan;
     nchan = buffer_getchannelcount(buffer);
-    double *inbuffer =  (double*) sysmem_newptr(frames * sizeof(double));
+    t_wes_planar planar;
+    wes_planar_init(&planar, &x->arena, tab, frames, nchan);
     
     
-    int maxcross = round(frames / (minsampl * ncross));
-    int *zerocrossindex = (int*) sysmem_newptr(maxcross * sizeof(int));
-    int *zerocrossindexChOne = (int*) sysmem_newptr(maxcross * sizeof(int));
    
-    int maxmemory = (int)(frames * 4);
-    double *dataout =  (double*) sysmem_newptr(maxmemory * sizeof(double));
-    
     double peak = 0, maxPeak = 0, gainCompensation = 1;
     
     ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-    int z, v , ver, frameout = 0;
+    int z;
+    long frameout = 0, skipped = 0;
+    t_wes_cost cost;
+    t_wes_index *linked = wes_cache_acquire_linked(buffer, &planar, x->linkchannels_in, x->keychannel_in, minsampl, ncross, x->indexdir_in, x->pyramid_in);
     for (z = 1 ; z < (nchan + 1) ; z++) {
-        int inc = 0;
-
-        for (v = 0 ; v < (frames * nchan) ; v++) {
-            ver = (v % nchan) + 1;
-            if (ver == z) {
-                inc++;
-                inbuffer[inc] = tab[v];
-            }
-        }
+        const float *inbuffer = wes_planar_channel(&planar, z);
+        t_wes_resampler rs;
+        wes_resampler_init(&rs, x->quality_in, inbuffer, frames);
       
-        int  g = 1, minsamplcount = 0, h = 0, j, k, i = 0, a, b, ncrossindex = 0, crosscount = 0, n = 0, newPeriod, currPeriod, nextPeriod, maxNwave = 0;
-        double bCF, aCF, res, idxD, scaleCF;
+        long g = 1, h = 0, k, i = 0, crosscount = 0, n = 0, newPeriod, currPeriod;
+        double scaleCF, res[WES_RESAMPLE_BLOCK];
         
         // waveset segmentation
-        for (j = 0 ; j < frames ; j++) {
-            minsamplcount++;
-            
-            if (inbuffer [j] >= 0 && inbuffer [j - 1] <= 0 && minsamplcount > minsampl) {
-                minsamplcount = 0;
-                ncrossindex++;
-                
-                if (ncrossindex == ncross) {
-                    ncrossindex = 0;
-                    crosscount++;
-                    if (crosscount >= maxcross) {
-                        maxcross = maxcross + round(maxcross/4);
-                        zerocrossindex = (int*) sysmem_resizeptrclear(zerocrossindex, maxcross * sizeof(int));
-                        if (z == 1) {
-                            zerocrossindexChOne = (int*) sysmem_resizeptrclear(zerocrossindexChOne, maxcross * sizeof(int));
-                        }
-                        
-                    }
-                    
-                    zerocrossindex[crosscount] = j;
-                    
-                    if (z == 1) {
-                        zerocrossindexChOne[crosscount] = j;
-                        maxNwave = crosscount;
-                    }
-                    
-                }
-                
-            }
-        }
-        
-        zerocrossindex[0] = 0;
-        zerocrossindexChOne[0] = 0;
+        t_wes_index *index = wes_cache_acquire_channel(buffer, &planar, z, linked, minsampl, ncross, x->indexdir_in, x->pyramid_in);
+        t_wes_features *wf = &index->features;
+        crosscount = wf->count;
         
 
         ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-        float *envOnset = (float *)bach_newptr(crosscount * sizeof(float));
+        size_t mark = wes_arena_mark(&x->arena);
+        float *envOnset = wes_arena_envelope(&x->arena, crosscount);
         if (modType == 1) {
              ears_resample_linear(envelope, envelopeFrames, &envOnset, crosscount, ((float)crosscount/(float)envelopeFrames), 1);
         } else {
@@ -363,30 +439,24 @@ void wavesinterpolate_bang(t_buf_wavesinterpolate *x, t_buffer_obj *buffer, t_bu
         ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
         int nInterp;
         interpMax = x->nInterp_in;
-            
-        while (g <= crosscount ) {
-            
-            if (modType == 1) {
-                nInterp = (CLAMP(envOnset[g], 0 ,1) * interpMax) + 1;
-            } else {
-                nInterp = CLAMP(envOnset[g], 0, 8000) + 1;
-            }
-            
-            
-            if ((g + nInterp) > crosscount) {
-                nInterp = crosscount - g;
+        
+        long planned = wavesinterpolate_plan(wf, envOnset, interpMax, modType);
+        if (z == 1) {
+            wes_budget_project(&x->budget, &cost, frames, nchan, crosscount, planned - 1, nchan, MAX(1, planned) * sizeof(double));
+            if (!wes_budget_admit((t_object *) x, &cost, x->membudget_in, dryrun, NULL)) {
+                if (!dryrun)
+                    ears_buffer_set_size_and_numchannels((t_object *) x, out, 0, nchan);
+                skipped = 1;
+                wes_cache_release(index);
+                break;
             }
+        }
+        double *dataout = (double *)wes_arena_alloc(&x->arena, MAX(planned, frameout + 1) * sizeof(double));
             
-            newPeriod = 0;
-            
-            for (k = 0 ; k < nInterp ; k++) {
-                
-                nextPeriod = (zerocrossindex[g + k] - zerocrossindex[(g + k)  - 1]);
-                newPeriod = newPeriod + nextPeriod;
-                
-            }
+        while (g <= crosscount ) {
             
-            newPeriod = round((float)newPeriod / nInterp);
+            nInterp = wavesinterpolate_count(envOnset, g, crosscount, interpMax, modType);
+            newPeriod = wavesinterpolate_period(wf, g, nInterp);
             
    
             
@@ -395,53 +465,31 @@ void wavesinterpolate_bang(t_buf_wavesinterpolate *x, t_buffer_obj *buffer, t_bu
             while (i < nInterp) {
                 
                 
-                currPeriod = (zerocrossindex[g + i] - zerocrossindex[(g + i) - 1]);
+                const float *wave = inbuffer + wf->start[g + i];
+                currPeriod = wf->period[g + i];
+                scaleCF = wes_resample_scale(currPeriod, newPeriod);
                 
                 while (n < newPeriod) {
+                    long len = MIN(WES_RESAMPLE_BLOCK, newPeriod - n);
+                    wes_resample(&rs, wave, 0, scaleCF, n, 1, len, res);
                     
-                    scaleCF = ((double)currPeriod - 1) / ((double)newPeriod - 1);
-                    idxD = (double)scaleCF * n;
-                    a = (int)idxD;
-                    b = a + 1;
-                    bCF = idxD - a;
-                    aCF = 1.0 - bCF;
-                    res = (double)(aCF * inbuffer[a + zerocrossindex[(g + i) - 1]] + bCF * inbuffer[b + zerocrossindex[(g + i) - 1]]);
-                    
-                    
-                    
-                    
-                    if (h >= maxmemory) {
-                        maxmemory = maxmemory + round(maxmemory/4);
-                        dataout =  (double*)sysmem_resizeptrclear(dataout, maxmemory * sizeof(double));
-                    }
-                    
-                    
-                    
-                    
-                    
-                    if (i == 0) {
-                        dataout[h] =  res * (1./nInterp);
+                    for (k = 0 ; k < len ; k++) {
+                        if (i == 0) {
+                            dataout[h] =  res[k] * (1./nInterp);
+                        } else {
+                            dataout[h] = dataout[h] + (res[k] * (1./nInterp));
+                        }
                         peak = fabs(dataout[h]);
-                        //dataout[h] =  res ;
-                    } else {
                         
-                        //post("res: %lf", res);
-                        dataout[h] = dataout[h] + (res * (1./nInterp));
-                        peak = fabs(dataout[h]);
-                        //dataout[h] = dataout[h] + res ;
+                        if (peak > maxPeak) {
+                            maxPeak = peak;
+                        }
                         
+                        gainCompensation = 1./maxPeak;
+                        
+                        h++;
                     }
-                    
-                    
-                    
-                    if (peak > maxPeak) {
-                        maxPeak = peak;
-                    }
-                    
-                    gainCompensation = 1./maxPeak;
-                    
-                    h++;
-                    n++;
+                    n += len;
                 }
                 
                 if (i < (nInterp -1)) {
@@ -460,6 +508,7 @@ void wavesinterpolate_bang(t_buf_wavesinterpolate *x, t_buffer_obj *buffer, t_bu
         if (z == 1) {
              frameout = h - 1;;
         }
+        wes_output_pad(dataout, h, frameout + 1);
         ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
         
         ears_buffer_set_size_and_numchannels((t_object *) x, out, frameout, nchan);
@@ -468,25 +517,21 @@ void wavesinterpolate_bang(t_buf_wavesinterpolate *x, t_buffer_obj *buffer, t_bu
         float *outtab = ears_buffer_locksamples(out);
         
         ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-        inc = 0;
-        for (k = 0 ; k < (frameout * nchan) ; k++) {
-            ver = (k % nchan) + 1;
-            if (ver == z) {
-                inc++;
-                double f = (dataout[inc] * gainCompensation) * 0.5;
-                outtab[k] = f;
-            }
-            
+        for (k = 1 ; k <= frameout ; k++) {
+            dataout[k] = (dataout[k] * gainCompensation) * 0.5;
         }
+        wes_planar_interleave(outtab, frameout, nchan, z, dataout + 1);
         ears_buffer_unlocksamples(out);
-        bach_freeptr(envOnset);
+        wes_cache_release(index);
+        wes_arena_rewind(&x->arena, mark);
     }
     
     buffer_unlocksamples(buffer);
     buffer_unlocksamples(mod);
-    sysmem_freeptr(zerocrossindex);
-    sysmem_freeptr(dataout);
-    sysmem_freeptr(inbuffer);
+    wes_cache_release(linked);
+    if (!skipped)
+        wes_budget_stop(&x->budget, (double)frameout * nchan);
+    wes_arena_end(&x->arena, wes_arena_megabytes(x->scratch_in));
     
     return;
 }
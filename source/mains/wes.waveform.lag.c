@@ -43,6 +43,11 @@
 #include "foundation/llll_commons_ext.h"
 #include "math/bach_math_utilities.h"
 #include "ears.object.h"
+#include "wes.cache.h"
+#include "wes.arena.h"
+#include "wes.planar.h"
+#include "wes.output.h"
+#include "wes.budget.h"
 
 
 
@@ -51,6 +56,14 @@ typedef struct _buf_wavelag {
     long sampMin_in;
     long cross_in;
     float lag_in;
+    t_symbol *indexdir_in;
+    char pyramid_in;
+    char linkchannels_in;
+    long keychannel_in;
+    double scratch_in;
+    double membudget_in;
+    t_wes_arena arena;
+    t_wes_budget budget;
     t_llll  *envin;
     
 } t_buf_wavelag;
@@ -62,12 +75,14 @@ typedef struct _buf_wavelag {
 t_buf_wavelag*         buf_wavelag_new(t_symbol *s, short argc, t_atom *argv);
 void            buf_wavelag_free(t_buf_wavelag *x);
 void            buf_wavelag_bang(t_buf_wavelag *x);
+void            buf_wavelag_dryrun(t_buf_wavelag *x);
+void            buf_wavelag_run(t_buf_wavelag *x, long dryrun);
 void            buf_wavelag_anything(t_buf_wavelag *x, t_symbol *msg, long ac, t_atom *av);
 
 void buf_wavelag_assist(t_buf_wavelag *x, void *b, long m, long a, char *s);
 void buf_wavelag_inletinfo(t_buf_wavelag *x, void *b, long a, char *t);
 
-void wavelag_bang(t_buf_wavelag *x, t_buffer_obj *buffer, t_buffer_obj *out, t_buffer_obj *mod, double modVal, int modType);
+void wavelag_bang(t_buf_wavelag *x, t_buffer_obj *buffer, t_buffer_obj *out, t_buffer_obj *mod, double modVal, int modType, long dryrun);
 long ears_resample_linear(float *in, long num_in_frames, float **out, long num_out_frames, double factor, long num_channels);
 
 
@@ -76,6 +91,7 @@ static t_class    *s_tag_class = NULL;
 static t_symbol    *ps_event = NULL;
 
 EARSBUFOBJ_ADD_IO_METHODS(wavelag)
+WES_ARENA_ADD_SCRATCH_SETTER(wavelag, t_buf_wavelag)
 
 /**********************************************************************/
 // Class Definition and Life Cycle
@@ -105,8 +121,33 @@ void C74_EXPORT ext_main(void* moduleRef)
     // buffer name (depending on the <m>naming</m> attribute).
     EARSBUFOBJ_DECLARE_COMMON_METHODS_HANDLETHREAD(wavelag)
     
+    // @method cacheinfo @digest Post waveset index cache statistics
+    // @description Posts the number of waveset indices shared by all wes objects, their memory use,
+    // and the cache hits, misses and evictions so far.
+    // @method cachesize @digest Set waveset index cache size
+    // @description Sets the memory cap, in megabytes, of the waveset index cache shared by all wes objects;
+    // least recently used indices are dropped beyond it.
+    // @marg 0 @name megabytes @optional 0 @type float
+    // @method cacheclear @digest Clear waveset index cache
+    // @description Drops every waveset index not currently in use and resets the cache statistics.
+    WES_DECLARE_CACHE_METHODS(c)
+    
+    // @method dryrun @digest Post the projected cost of processing
+    // @description Posts, for each input buffer, the output frames, the memory and the time processing it would take,
+    // without synthesizing nor outputting anything.
+    class_addmethod(c, (method)buf_wavelag_dryrun, "dryrun", 0);
+    
     CLASS_ATTR_LONG(c, "minsamp", 0, t_buf_wavelag, sampMin_in);
     CLASS_ATTR_LONG(c, "cross", 0, t_buf_wavelag, cross_in);
+    CLASS_ATTR_SYM(c, "indexdir", 0, t_buf_wavelag, indexdir_in);
+    CLASS_ATTR_CHAR(c, "pyramid", 0, t_buf_wavelag, pyramid_in);
+    CLASS_ATTR_STYLE_LABEL(c,"pyramid",0,"onoff","Prepare Minsamp Levels");
+    CLASS_ATTR_CHAR(c, "linkchannels", 0, t_buf_wavelag, linkchannels_in);
+    CLASS_ATTR_STYLE_LABEL(c,"linkchannels",0,"enumindex","Link Channels");
+    CLASS_ATTR_ENUMINDEX(c,"linkchannels", 0, "Off Mid \"Key Channel\"");
+    CLASS_ATTR_LONG(c, "keychannel", 0, t_buf_wavelag, keychannel_in);
+    WES_DECLARE_BUDGET_ATTR(c, t_buf_wavelag)
+    WES_DECLARE_SCRATCH_ATTR(c, wavelag, t_buf_wavelag)
     CLASS_ATTR_FLOAT(c, "lagmult", 0, t_buf_wavelag, lag_in);
    
 
@@ -152,6 +193,14 @@ t_buf_wavelag *buf_wavelag_new(t_symbol *s, short argc, t_atom *argv)
         x->envin = llll_from_text_buf("1", false);
         x->sampMin_in = 15;
         x->cross_in = 1;
+        x->indexdir_in = gensym("");
+        x->pyramid_in = 0;
+        x->linkchannels_in = WES_LINK_OFF;
+        x->keychannel_in = 1;
+        x->scratch_in = WES_ARENA_DEFAULT_SCRATCH;
+        x->membudget_in = 0;
+        wes_arena_init(&x->arena);
+        wes_budget_init(&x->budget);
         x->lag_in = 1;
    
         earsbufobj_init((t_earsbufobj *)x,  0);
@@ -181,6 +230,7 @@ t_buf_wavelag *buf_wavelag_new(t_symbol *s, short argc, t_atom *argv)
 
 void buf_wavelag_free(t_buf_wavelag *x)
 {
+    wes_arena_free(&x->arena);
     llll_free(x->envin);
     earsbufobj_free((t_earsbufobj *)x);
     
@@ -190,6 +240,18 @@ void buf_wavelag_free(t_buf_wavelag *x)
 
 
 void buf_wavelag_bang(t_buf_wavelag *x)
+{
+    buf_wavelag_run(x, 0);
+}
+
+
+void buf_wavelag_dryrun(t_buf_wavelag *x)
+{
+    buf_wavelag_run(x, 1);
+}
+
+
+void buf_wavelag_run(t_buf_wavelag *x, long dryrun)
 {
     long num_buffers = earsbufobj_get_instore_size((t_earsbufobj *)x, 0);
     earsbufobj_refresh_outlet_names((t_earsbufobj *)x);
@@ -222,14 +284,15 @@ void buf_wavelag_bang(t_buf_wavelag *x)
         
         llll_free(env);
         
-        wavelag_bang(x, in, out, mod, modVal, modType);
+        wavelag_bang(x, in, out, mod, modVal, modType, dryrun);
         
         if (earsbufobj_iter_progress((t_earsbufobj *)x, count, num_buffers)) break;
     }
     
     earsbufobj_mutex_unlock((t_earsbufobj *)x);
 
-    earsbufobj_outlet_buffer((t_earsbufobj *)x, 0);
+    if (!dryrun)
+        earsbufobj_outlet_buffer((t_earsbufobj *)x, 0);
 }
 
 
@@ -259,7 +322,46 @@ void buf_wavelag_anything(t_buf_wavelag *x, t_symbol *msg, long ac, t_atom *av)
 }
 
 
-void wavelag_bang(t_buf_wavelag *x, t_buffer_obj *buffer, t_buffer_obj *out, t_buffer_obj *mod, double modVal, int modType) {
+// length of the silence following waveset g
+static inline float wavelag_silence(const t_wes_features *wf, const float *envOnset, long g, float lagmultiply, int modType)
+{
+    float silence;
+    
+    if (modType == 1) {
+        silence = lagmultiply;
+    } else {
+        silence = 1;
+    }
+    return wf->period[g] * (CLAMP(envOnset[g], 0, 500) * silence);
+}
+
+// a run of input samples copied as they are, followed by a run of silence
+typedef struct _wavelag_run {
+    long    copy;
+    long    silence;
+} t_wavelag_run;
+
+// splits a channel into runs (at most wf->count + 1 of them, the last one with no silence), returning their number;
+// the number of samples synthesized, all of the input plus the silences, is set in <h>
+static long wavelag_plan(const t_wes_features *wf, const float *envOnset, long frames, float lagmultiply, int modType, t_wavelag_run *runs, long *h)
+{
+    long g, m = 0, numruns = 0;
+    
+    *h = frames;
+    for (g = 1 ; g <= wf->count && wf->zerocrossindex[g] - 1 < frames ; g++) {
+        float silenceLength = wavelag_silence(wf, envOnset, g, lagmultiply, modType);
+        runs[numruns].copy = wf->zerocrossindex[g] - m;
+        runs[numruns].silence = silenceLength >= 0 ? (long)floor(silenceLength) + 1 : 0;
+        *h += runs[numruns].silence;
+        m = wf->zerocrossindex[g];
+        numruns++;
+    }
+    runs[numruns].copy = frames - m;
+    runs[numruns].silence = 0;
+    return numruns + 1;
+}
+
+void wavelag_bang(t_buf_wavelag *x, t_buffer_obj *buffer, t_buffer_obj *out, t_buffer_obj *mod, double modVal, int modType, long dryrun) {
     
     t_float        *tab;
     t_float        *envelope;
@@ -272,6 +374,8 @@ void wavelag_bang(t_buf_wavelag *x, t_buffer_obj *buffer, t_buffer_obj *out, t_b
     
     long        frames, sampleRate, envelopeFrames ;
     
+    wes_budget_start(&x->budget);
+    
     tab = ears_buffer_locksamples(buffer);
     frames = buffer_getframecount(buffer);
     sampleRate = buffer_getsamplerate(buffer);
@@ -284,56 +388,29 @@ void wavelag_bang(t_buf_wavelag *x, t_buffer_obj *buffer, t_buffer_obj *out, t_b
     
     int nchan;
     nchan = buffer_getchannelcount(buffer);
-    double *inbuffer =  (double*) sysmem_newptr(frames * sizeof(double));
+    t_wes_planar planar;
+    wes_planar_init(&planar, &x->arena, tab, frames, nchan);
     
     
-    int maxcross = round(frames / (minsampl * ncross));
-    int *zerocrossindex = (int*) sysmem_newptr(maxcross * sizeof(int));
-    int maxmemory = (int)(frames * 4);
-    double *dataout =  (double*) sysmem_newptr(maxmemory * sizeof(double));
     
     ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-    int z, v , ver, frameout = 0;
+    int z;
+    long frameout = 0, skipped = 0;
+    t_wes_cost cost;
+    t_wes_index *linked = wes_cache_acquire_linked(buffer, &planar, x->linkchannels_in, x->keychannel_in, minsampl, ncross, x->indexdir_in, x->pyramid_in);
     for (z = 1 ; z < (nchan + 1) ; z++) {
-        int inc = 0;
-
-        for (v = 0 ; v < (frames * nchan) ; v++) {
-            ver = (v % nchan) + 1;
-            if (ver == z) {
-                inc++;
-                inbuffer[inc] = tab[v];
-            }
-        }
+        const float *inbuffer = wes_planar_channel(&planar, z);
       
-        int m = 0, g = 1, minsamplcount = 0, h = 0, b = 0, j, k, ncrossindex = 0, crosscount = 0;
-        float silence;
+        long m = 0, h = 0, r, crosscount = 0;
         
         // waveset segmentation
-        for (j = 0 ; j < frames ; j++) {
-            minsamplcount++;
-            
-            if (inbuffer [j] >= 0 && inbuffer [j - 1] <= 0 && minsamplcount > minsampl) {
-                minsamplcount = 0;
-                ncrossindex++;
-                
-                if (ncrossindex == ncross) {
-                    ncrossindex = 0;
-                    crosscount++;
-                    if (crosscount >= maxcross) {
-                        maxcross = maxcross + round(maxcross/4);
-                        zerocrossindex = (int*) sysmem_resizeptrclear(zerocrossindex, maxcross * sizeof(int));
-                    }
-                    
-                    zerocrossindex[crosscount] = j;
-                }
-                
-            }
-        }
-        
-        zerocrossindex[0] = 0;
+        t_wes_index *index = wes_cache_acquire_channel(buffer, &planar, z, linked, minsampl, ncross, x->indexdir_in, x->pyramid_in);
+        t_wes_features *wf = &index->features;
+        crosscount = wf->count;
         
         ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-        float *envOnset = (float *)bach_newptr(crosscount * sizeof(float));
+        size_t mark = wes_arena_mark(&x->arena);
+        float *envOnset = wes_arena_envelope(&x->arena, crosscount);
         if (modType == 1) {
              ears_resample_linear(envelope, envelopeFrames, &envOnset, crosscount, ((float)crosscount/(float)envelopeFrames), 1);
         } else {
@@ -341,78 +418,51 @@ void wavelag_bang(t_buf_wavelag *x, t_buffer_obj *buffer, t_buffer_obj *out, t_b
                 envOnset[gg] = modVal;
             }
         }
-        ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-
-        
         
-        while (m < frames) {
-         
-            
-            if (h > maxmemory) {
-                
-                maxmemory = maxmemory + round(maxmemory/4);
-                dataout =  (double*) sysmem_resizeptrclear(dataout, maxmemory * sizeof(double));
-            }
-            
-            dataout[h] = inbuffer[m];
-            
-            
-            if (m == zerocrossindex[g]-1) {
-                
-                if (modType == 1) {
-                    silence = lagmultiply;
-                } else {
-                    silence = 1;
-                }
-                while (b <= ((zerocrossindex[g] - zerocrossindex[g  - 1])) * (CLAMP(envOnset[g], 0, 500) * silence) ) {
-                    b++;
-                    h++;
-                    
-                    if (h >= maxmemory) {
-                        maxmemory = maxmemory + round(maxmemory/4);
-                        dataout = (double*) sysmem_resizeptrclear(dataout, maxmemory * sizeof(double));
-                    }
-                    dataout[h] = 0;
-
-                }
-                b = 0;
-                g++;
+        // the channel is planned as runs of samples and silences, each written at once
+        t_wavelag_run *runs = (t_wavelag_run *)wes_arena_alloc(&x->arena, (crosscount + 1) * sizeof(t_wavelag_run));
+        long planned;
+        long numruns = wavelag_plan(wf, envOnset, frames, lagmultiply, modType, runs, &planned);
+        if (z == 1) {
+            frameout = planned - 1;
+            wes_budget_project(&x->budget, &cost, frames, nchan, crosscount, frameout, nchan, (crosscount + 1) * sizeof(t_wavelag_run));
+            if (!wes_budget_admit((t_object *) x, &cost, x->membudget_in, dryrun, NULL)) {
+                if (!dryrun)
+                    ears_buffer_set_size_and_numchannels((t_object *) x, out, 0, nchan);
+                skipped = 1;
+                wes_cache_release(index);
+                break;
             }
-            m++;
-            h++;
+            ears_buffer_set_size_and_numchannels((t_object *) x, out, frameout, nchan);
+            ears_buffer_set_sr((t_object *) x, out, sampleRate);
         }
+        t_wes_output output;
+        wes_output_begin(&output, ears_buffer_locksamples(out), frameout, nchan, z);
         ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
         
-        if (z == 1) {
-             frameout = h - 1;;
+        
+        for (r = 0 ; r < numruns ; r++) {
+            wes_output_copy(&output, h, inbuffer + m, runs[r].copy);
+            m += runs[r].copy;
+            h += runs[r].copy;
+            wes_output_silence(&output, h, runs[r].silence);
+            h += runs[r].silence;
         }
         ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
         
-        ears_buffer_set_size_and_numchannels((t_object *) x, out, frameout, nchan);
-        ears_buffer_set_sr((t_object *) x, out, sampleRate);
-        
-        float *outtab = ears_buffer_locksamples(out);
-        
-        ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-        inc = 0;
-        for (k = 0 ; k < (frameout * nchan) ; k++) {
-            ver = (k % nchan) + 1;
-            if (ver == z) {
-                inc++;
-                double f = dataout[inc];
-                outtab[k] = f;
-            }
-            
-        }
+        wes_output_finish(&output, h);
         ears_buffer_unlocksamples(out);
-        bach_freeptr(envOnset);
+        wes_cache_release(index);
+        wes_arena_rewind(&x->arena, mark);
     }
     
     buffer_unlocksamples(buffer);
     buffer_unlocksamples(mod);
-    sysmem_freeptr(zerocrossindex);
-    sysmem_freeptr(dataout);
-    sysmem_freeptr(inbuffer);
+    wes_cache_release(linked);
+    if (!skipped)
+        wes_budget_stop(&x->budget, (double)frameout * nchan);
+    wes_arena_end(&x->arena, wes_arena_megabytes(x->scratch_in));
     
     return;
 }
@@ -45,6 +45,13 @@ Marco Marasciuolo
 #include "foundation/llll_commons_ext.h"
 #include "math/bach_math_utilities.h"
 #include "ears.object.h"
+#include "wes.cache.h"
+#include "wes.arena.h"
+#include "wes.planar.h"
+#include "wes.output.h"
+#include "wes.budget.h"
+#include "wes.resample.h"
+#include "wes.fade.h"
 
 
 
@@ -56,6 +63,15 @@ typedef struct _buf_wavereduction {
     long repeat_in;
     long cross_in;
     int interp;
+    t_symbol *indexdir_in;
+    char pyramid_in;
+    char linkchannels_in;
+    long keychannel_in;
+    char quality_in;
+    double scratch_in;
+    double membudget_in;
+    t_wes_arena arena;
+    t_wes_budget budget;
     t_llll  *envin;
 
     
@@ -68,18 +84,21 @@ typedef struct _buf_wavereduction {
 t_buf_wavereduction*         buf_wavereduction_new(t_symbol *s, short argc, t_atom *argv);
 void            buf_wavereduction_free(t_buf_wavereduction *x);
 void            buf_wavereduction_bang(t_buf_wavereduction *x);
+void            buf_wavereduction_dryrun(t_buf_wavereduction *x);
+void            buf_wavereduction_run(t_buf_wavereduction *x, long dryrun);
 void            buf_wavereduction_anything(t_buf_wavereduction *x, t_symbol *msg, long ac, t_atom *av);
 
 void buf_wavereduction_assist(t_buf_wavereduction *x, void *b, long m, long a, char *s);
 void buf_wavereduction_inletinfo(t_buf_wavereduction *x, void *b, long a, char *t);
 
-void wavereduction_bang(t_buf_wavereduction *x, t_buffer_obj *buffer, t_buffer_obj *out, t_buffer_obj *mod, double modVal, int modType);
+void wavereduction_bang(t_buf_wavereduction *x, t_buffer_obj *buffer, t_buffer_obj *out, t_buffer_obj *mod, double modVal, int modType, long dryrun);
 
 // Globals and Statics
 static t_class    *s_tag_class = NULL;
 static t_symbol    *ps_event = NULL;
 
 EARSBUFOBJ_ADD_IO_METHODS(wavereduction)
+WES_ARENA_ADD_SCRATCH_SETTER(wavereduction, t_buf_wavereduction)
 
 /**********************************************************************/
 // Class Definition and Life Cycle
@@ -109,9 +128,36 @@ void C74_EXPORT ext_main(void* moduleRef)
     // buffer name (depending on the <m>naming</m> attribute).
     EARSBUFOBJ_DECLARE_COMMON_METHODS_HANDLETHREAD(wavereduction)
     
+    // @method cacheinfo @digest Post waveset index cache statistics
+    // @description Posts the number of waveset indices shared by all wes objects, their memory use,
+    // and the cache hits, misses and evictions so far.
+    // @method cachesize @digest Set waveset index cache size
+    // @description Sets the memory cap, in megabytes, of the waveset index cache shared by all wes objects;
+    // least recently used indices are dropped beyond it.
+    // @marg 0 @name megabytes @optional 0 @type float
+    // @method cacheclear @digest Clear waveset index cache
+    // @description Drops every waveset index not currently in use and resets the cache statistics.
+    WES_DECLARE_CACHE_METHODS(c)
+    wes_fade_init();
+    
+    // @method dryrun @digest Post the projected cost of processing
+    // @description Posts, for each input buffer, the output frames, the memory and the time processing it would take,
+    // without synthesizing nor outputting anything.
+    class_addmethod(c, (method)buf_wavereduction_dryrun, "dryrun", 0);
+    
     CLASS_ATTR_LONG(c, "minsamp", 0, t_buf_wavereduction, sampMin_in);
     CLASS_ATTR_LONG(c, "repeatmult", 0, t_buf_wavereduction, repeat_in);
     CLASS_ATTR_LONG(c, "cross", 0, t_buf_wavereduction, cross_in);
+    CLASS_ATTR_SYM(c, "indexdir", 0, t_buf_wavereduction, indexdir_in);
+    CLASS_ATTR_CHAR(c, "pyramid", 0, t_buf_wavereduction, pyramid_in);
+    CLASS_ATTR_STYLE_LABEL(c,"pyramid",0,"onoff","Prepare Minsamp Levels");
+    CLASS_ATTR_CHAR(c, "linkchannels", 0, t_buf_wavereduction, linkchannels_in);
+    CLASS_ATTR_STYLE_LABEL(c,"linkchannels",0,"enumindex","Link Channels");
+    CLASS_ATTR_ENUMINDEX(c,"linkchannels", 0, "Off Mid \"Key Channel\"");
+    CLASS_ATTR_LONG(c, "keychannel", 0, t_buf_wavereduction, keychannel_in);
+    WES_DECLARE_QUALITY_ATTR(c, t_buf_wavereduction)
+    WES_DECLARE_BUDGET_ATTR(c, t_buf_wavereduction)
+    WES_DECLARE_SCRATCH_ATTR(c, wavereduction, t_buf_wavereduction)
     //CLASS_ATTR_LONG(c, "interp", 0, t_buf_wavereduction, interp);
     
     CLASS_ATTR_CHAR(c, "Interpactivate", 0, t_buf_wavereduction, interp);
@@ -162,6 +208,15 @@ t_buf_wavereduction *buf_wavereduction_new(t_symbol *s, short argc, t_atom *argv
         x->sampMin_in = 100;
         x->repeat_in = 1;
         x->cross_in = 1;
+        x->indexdir_in = gensym("");
+        x->pyramid_in = 0;
+        x->linkchannels_in = WES_LINK_OFF;
+        x->keychannel_in = 1;
+        x->quality_in = WES_QUALITY_LINEAR;
+        x->scratch_in = WES_ARENA_DEFAULT_SCRATCH;
+        x->membudget_in = 0;
+        wes_arena_init(&x->arena);
+        wes_budget_init(&x->budget);
         x->interp = 1;
 
   
@@ -195,6 +250,7 @@ t_buf_wavereduction *buf_wavereduction_new(t_symbol *s, short argc, t_atom *argv
 
 void buf_wavereduction_free(t_buf_wavereduction *x)
 {
+    wes_arena_free(&x->arena);
     llll_free(x->envin);
     earsbufobj_free((t_earsbufobj *)x);
 }
@@ -203,6 +259,18 @@ void buf_wavereduction_free(t_buf_wavereduction *x)
 
 
 void buf_wavereduction_bang(t_buf_wavereduction *x)
+{
+    buf_wavereduction_run(x, 0);
+}
+
+
+void buf_wavereduction_dryrun(t_buf_wavereduction *x)
+{
+    buf_wavereduction_run(x, 1);
+}
+
+
+void buf_wavereduction_run(t_buf_wavereduction *x, long dryrun)
 {
     long num_buffers = earsbufobj_get_instore_size((t_earsbufobj *)x, 0);
     earsbufobj_refresh_outlet_names((t_earsbufobj *)x);
@@ -235,14 +303,15 @@ void buf_wavereduction_bang(t_buf_wavereduction *x)
         
         llll_free(env);
         
-        wavereduction_bang(x, in, out, mod, modVal, modType);
+        wavereduction_bang(x, in, out, mod, modVal, modType, dryrun);
         
         if (earsbufobj_iter_progress((t_earsbufobj *)x, count, num_buffers)) break;
     }
     
     earsbufobj_mutex_unlock((t_earsbufobj *)x);
 
-    earsbufobj_outlet_buffer((t_earsbufobj *)x, 0);
+    if (!dryrun)
+        earsbufobj_outlet_buffer((t_earsbufobj *)x, 0);
 }
 
 
@@ -272,7 +341,38 @@ void buf_wavereduction_anything(t_buf_wavereduction *x, t_symbol *msg, long ac,
 }
 
 
-void wavereduction_bang(t_buf_wavereduction *x, t_buffer_obj *buffer, t_buffer_obj *out, t_buffer_obj *mod, double modVal, int modType) {
+// number of wavesets replacing each other from waveset g
+static inline int wavereduction_count(const float *envOnset, long g, int repeatMult, int modType)
+{
+    if (modType == 1) {
+        return round(CLAMP(envOnset[g - 1],0 ,1 ) * repeatMult) + 0;
+    } else {
+        return envOnset[g - 1];
+    }
+}
+
+// number of samples synthesized from a channel
+static long wavereduction_plan(const t_wes_features *wf, const float *envOnset, int repeatMult, int modType)
+{
+    long g = 1, h = 0;
+    int d, repeat;
+    
+    while (g <= wf->count) {
+        repeat = wavereduction_count(envOnset, g, repeatMult, modType);
+        if (repeat == 0) {
+            h += wf->period[g];
+            g++;
+        } else {
+            for (d = 0 ; d < repeat && (d + g) <= wf->count ; d++) {
+                h += wf->period[g + d];
+            }
+            g = g + d;
+        }
+    }
+    return h;
+}
+
+void wavereduction_bang(t_buf_wavereduction *x, t_buffer_obj *buffer, t_buffer_obj *out, t_buffer_obj *mod, double modVal, int modType, long dryrun) {
     
     t_float        *tab;
     t_float        *envelope;
@@ -285,6 +385,8 @@ void wavereduction_bang(t_buf_wavereduction *x, t_buffer_obj *buffer, t_buffer_o
  
     long        frames, sampleRate, envelopeFrames ;
     
+    wes_budget_start(&x->budget);
+    
     tab = ears_buffer_locksamples(buffer);
     frames = buffer_getframecount(buffer);
     sampleRate = buffer_getsamplerate(buffer);
@@ -294,74 +396,37 @@ void wavereduction_bang(t_buf_wavereduction *x, t_buffer_obj *buffer, t_buffer_o
   
     int nchan;
     nchan = buffer_getchannelcount(buffer);
-    double *inbuffer =  (double*) sysmem_newptr(frames * sizeof(double));
+    t_wes_planar planar;
+    wes_planar_init(&planar, &x->arena, tab, frames, nchan);
     
-    int maxcross = round(frames / (minsampl * ncross));
-    int *zerocrossindex = (int*) sysmem_newptr(maxcross * sizeof(int));
-    double *peakVal = (double*) sysmem_newptr(maxcross * sizeof(double));
     
-    int maxmemory = (int)(frames);
-    double *dataout =  (double*) sysmem_newptr(maxmemory * sizeof(double));
     
     
     ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-    int z, v , ver, frameout = 0;
+    int z;
+    long frameout = 0, skipped = 0;
+    t_wes_cost cost;
+    t_wes_index *linked = wes_cache_acquire_linked(buffer, &planar, x->linkchannels_in, x->keychannel_in, minsampl - 1, ncross, x->indexdir_in, x->pyramid_in);
     for (z = 1 ; z < (nchan + 1) ; z++) {
-        int inc = 0;
+        const float *inbuffer = wes_planar_channel(&planar, z);
+        t_wes_resampler rs;
+        wes_resampler_init(&rs, x->quality_in, inbuffer, frames);
+        long g = 1, h = 0, k, n = 0, d = 0, currPeriod, newPeriod, interpNextPeriod, repeat = 1, crosscount = 0, window = 0, nextPeriod;
         
-        for (v = 0 ; v < (frames * nchan) ; v++) {
-            ver = (v % nchan) + 1;
-            if (ver == z) {
-                inc++;
-                inbuffer[inc] = tab[v];
-            }
-        }
-        int  g = 1, minsamplcount = 0, h = 0, j, k, a = 0,b, ncrossindex = 0, n = 0,d = 0, currPeriod, newPeriod,interpNextPeriod, repeat = 1, crosscount = 0, window = 0, nextPeriod;
-        
-        double maxPeak = 0, newPeakVal, nextPeakVal, currPeakVal, peakFactorA, peakFactorB;
-        double bCF, aCF, resA, resB, idxD, scaleCF;
+        double newPeakVal, nextPeakVal, currPeakVal, peakFactorA, peakFactorB;
+        double resA[WES_RESAMPLE_BLOCK], resB[WES_RESAMPLE_BLOCK];
         
         // waveset segmentation
-        for (j = 0 ; j < frames ; j++) {
-            minsamplcount++;
-            
-            if (maxPeak < fabs(inbuffer[j])) {
-                maxPeak = fabs(inbuffer[j]);
-            }
-            
-            
-            if (inbuffer [j] >= 0 && inbuffer [j - 1] <= 0 && minsamplcount >= minsampl) {
-                minsamplcount = 0;
-                ncrossindex++;
-                
-                if (ncrossindex == ncross) {
-                    ncrossindex = 0;
-                    crosscount++;
-                    if (crosscount >= maxcross) {
-                        maxcross = maxcross + round(maxcross/4);
-                        zerocrossindex = (int*) sysmem_resizeptrclear(zerocrossindex, maxcross * sizeof(int));
-                        peakVal = (double*) sysmem_resizeptrclear(peakVal, maxcross * sizeof(double));
-                        
-                    }
-                    
-                    
-                    zerocrossindex[crosscount] = j;
-                    peakVal[crosscount] = maxPeak;
-                    maxPeak = 0;
-                    
-                    
-                }
-            }
-        }
-        
-        
-        //
-        
-        zerocrossindex[0] = 0;
-        peakVal[0] = 0;
+        t_wes_index *index = wes_cache_acquire_channel(buffer, &planar, z, linked, minsampl - 1, ncross, x->indexdir_in, x->pyramid_in);
+        t_wes_features *wf = &index->features;
+        long *zerocrossindex = wf->zerocrossindex;
+        long *wavePeriod = wf->period;
+        double *peakVal = wf->absPeak;
+        crosscount = wf->count;
         
         /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////// 
-        float *envOnset = (float *)bach_newptr(crosscount * sizeof(float));
+        size_t mark = wes_arena_mark(&x->arena);
+        float *envOnset = wes_arena_envelope(&x->arena, crosscount);
         if (modType == 1) {
             ears_resample_linear(envelope, envelopeFrames, &envOnset, crosscount, ((float)crosscount/(float)envelopeFrames), 1);
         } else {
@@ -369,102 +434,93 @@ void wavereduction_bang(t_buf_wavereduction *x, t_buffer_obj *buffer, t_buffer_o
                 envOnset[gg] = CLAMP(modVal, 0, 5000);
             }
         }
+        
+        long planned = wavereduction_plan(wf, envOnset, repeatMult, modType);
+        if (z == 1) {
+            frameout = planned - 1;
+            wes_budget_project(&x->budget, &cost, frames, nchan, crosscount, frameout, nchan, 0);
+            if (!wes_budget_admit((t_object *) x, &cost, x->membudget_in, dryrun, NULL)) {
+                if (!dryrun)
+                    ears_buffer_set_size_and_numchannels((t_object *) x, out, 0, nchan);
+                skipped = 1;
+                wes_cache_release(index);
+                break;
+            }
+            ears_buffer_set_size_and_numchannels((t_object *) x, out, frameout, nchan);
+            ears_buffer_set_sr((t_object *) x, out, sampleRate);
+        }
+        t_wes_output output;
+        wes_output_begin(&output, ears_buffer_locksamples(out), frameout, nchan, z);
         ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
         
         
         while (g <= crosscount) {
             d = 0;
             
-            if (modType == 1) {
-                repeat = round(CLAMP(envOnset[g - 1],0 ,1 ) * repeatMult) + 0;
-            } else {
-                repeat = envOnset[g - 1];
-            }
+            repeat = wavereduction_count(envOnset, g, repeatMult, modType);
             
             if (repeat == 0) {
-                for (int l = 0 ; l < (zerocrossindex[g] - zerocrossindex[g  - 1]) ; l++) {
-                    if (h >= maxmemory) {
-                        maxmemory = maxmemory + round(maxmemory/4);
-                        dataout = (double*) sysmem_resizeptrclear(dataout, maxmemory * sizeof(double));
-                    }
-                    dataout[h] = inbuffer[l + zerocrossindex[g - 1]];
-                    h++;
-                }
+                wes_output_copy(&output, h, inbuffer + wf->start[g], wavePeriod[g]);
+                h += MAX(0, wavePeriod[g]);
                 g++;
             } else {
                 
                 while (d < repeat && (d + g) <= crosscount) {
                     
-                    currPeriod = (zerocrossindex[g] - zerocrossindex[g  - 1]);
-                    newPeriod = (zerocrossindex[g + d] - zerocrossindex[(g + d) - 1]);
-                    nextPeriod = (zerocrossindex[g + repeat] - zerocrossindex[(g + repeat) - 1]);
+                    currPeriod = wavePeriod[g];
+                    newPeriod = wavePeriod[g + d];
+                    long nextWave = MIN(g + repeat, crosscount);
+                    nextPeriod = wavePeriod[nextWave];
                     currPeakVal = peakVal[g];
-                    nextPeakVal = peakVal[g + repeat];
+                    nextPeakVal = peakVal[nextWave];
                     newPeakVal = peakVal[g + d];
                     
                     if ( (g + repeat) > crosscount) {
                         interpNextPeriod = currPeriod;
                     } else {
-                        interpNextPeriod = (zerocrossindex[g + repeat] - zerocrossindex[(g + repeat)  - 1]);
+                        interpNextPeriod = wavePeriod[g + repeat];
                     }
                     
-                    int segmentDur = zerocrossindex[(g + repeat) - 1] - zerocrossindex[g  - 1];
+                    long segmentDur = zerocrossindex[nextWave - 1] - zerocrossindex[g  - 1];
+                    double fadeRate = wes_fade_rate(segmentDur);
+                    int interpolating = interpwave == 1 && (g + repeat) < crosscount;
+                    const float *waveA = inbuffer + wf->start[g];
+                    const float *waveB = interpolating ? inbuffer + wf->start[g + repeat] : NULL;
+                    double scaleA = wes_resample_scale(currPeriod, newPeriod);
+                    double scaleB = wes_resample_scale(nextPeriod, newPeriod);
                     
+                    if (currPeakVal == 0) {
+                        peakFactorA = 0;
+                    } else {
+                        peakFactorA = newPeakVal/currPeakVal;
+                    }
                     
-                    for (int n = 0 ; n < newPeriod ; n++) {
-                        
-                        scaleCF = ((double)currPeriod -1 ) / ((double)newPeriod -1);
-                        idxD = (double)scaleCF * n;
-                        a = (int)idxD;
-                        b = a + 1;
-                        bCF = idxD - a;
-                        aCF = 1.0 - bCF;
-                        resA = (double)(aCF * inbuffer[a + zerocrossindex[g - 1]] + bCF * inbuffer[b + zerocrossindex[g - 1]]);
-                        
-                        if (interpwave == 1 && (g + repeat) < crosscount) {
-                            scaleCF = ((double)nextPeriod -1 ) / ((double)newPeriod -1);
-                            idxD = (double)scaleCF * n;
-                            a = (int)idxD;
-                            b = a + 1;
-                            bCF = idxD - a;
-                            aCF = 1.0 - bCF;
-                            resB = (double)(aCF * inbuffer[a + zerocrossindex[(g + repeat) - 1]] + bCF * inbuffer[b + zerocrossindex[(g + repeat) - 1]]);
-                        }
-                        
-                        if (currPeakVal == 0) {
-                            peakFactorA = 0;
-                        } else {
-                            peakFactorA = newPeakVal/currPeakVal;
-                        }
-                        
-                        if (nextPeakVal == 0) {
-                            peakFactorB = 0;
-                        } else {
-                            peakFactorB = newPeakVal/nextPeakVal;
-                        }
-                        
-                        
-                        float fadeIn = sin(((float)window/(float)segmentDur) * (PI * 0.5));
-                        float fadeOut = cos(((float)window/(float)segmentDur) * (PI * 0.5));
-                        
-                        if (h >= maxmemory) {
-                            maxmemory = maxmemory + round(maxmemory/4);
-                            dataout = (double*) sysmem_resizeptrclear(dataout, maxmemory * sizeof(double));
+                    if (nextPeakVal == 0) {
+                        peakFactorB = 0;
+                    } else {
+                        peakFactorB = newPeakVal/nextPeakVal;
+                    }
+                    
+                    
+                    for (n = 0 ; n < newPeriod ; n += WES_RESAMPLE_BLOCK) {
+                        long len = MIN(WES_RESAMPLE_BLOCK, newPeriod - n);
+                        wes_resample(&rs, waveA, 0, scaleA, n, 1, len, resA);
+                        if (interpolating) {
+                            wes_resample(&rs, waveB, 0, scaleB, n, 1, len, resB);
                         }
                         
-                        
-                        if (interpwave == 1 && (g + repeat) < crosscount) {
-                            
-                            dataout[h] = ((resA * peakFactorA) * fadeOut) + ((resB * peakFactorB) * fadeIn) ;
-                            
-                            
-                        } else {
-                            
-                            dataout[h] = resA * peakFactorA;
+                        long skip, count = wes_output_clip(&output, h, len, &skip);
+                        for (k = skip ; k < skip + count ; k++) {
+                            if (interpolating) {
+                                float fadeIn, fadeOut;
+                                wes_fade_gains((window + k) * fadeRate, &fadeIn, &fadeOut);
+                                wes_output_write(&output, h + k, ((resA[k] * peakFactorA) * fadeOut) + ((resB[k] * peakFactorB) * fadeIn));
+                            } else {
+                                wes_output_write(&output, h + k, resA[k] * peakFactorA);
+                            }
                         }
-                        
-                        h++;
-                        window++;
+                        h += len;
+                        window += len;
                     }
                     
                     d++;
@@ -475,37 +531,19 @@ void wavereduction_bang(t_buf_wavereduction *x, t_buffer_obj *buffer, t_buffer_o
             g = g + d;
         }
         
-        if (z == 1) {
-            frameout = h - 1;;
-        }
-        
-        ears_buffer_set_size_and_numchannels((t_object *) x, out, frameout, nchan);
-        ears_buffer_set_sr((t_object *) x, out, sampleRate);
-        
-        float *outtab = ears_buffer_locksamples(out);
-        
-        
-        inc = 0;
-        for (k = 0 ; k < (frameout * nchan) ; k++) {
-            ver = (k % nchan) + 1;
-            if (ver == z) {
-                inc++;
-                double f = dataout[inc];
-                outtab[k] = f;
-            }
-            
-        }
+        wes_output_finish(&output, h);
         ears_buffer_unlocksamples(out);
-        bach_freeptr(envOnset);
+        wes_cache_release(index);
+        wes_arena_rewind(&x->arena, mark);
     }
     
     
     ears_buffer_unlocksamples(buffer);
     buffer_unlocksamples(mod);
-    sysmem_freeptr(dataout);
-    sysmem_freeptr(zerocrossindex);
-    sysmem_freeptr(peakVal);
-    sysmem_freeptr(inbuffer);
+    wes_cache_release(linked);
+    if (!skipped)
+        wes_budget_stop(&x->budget, (double)frameout * nchan);
+    wes_arena_end(&x->arena, wes_arena_megabytes(x->scratch_in));
     
     
     return;
@@ -45,6 +45,12 @@ Marco Marasciuolo
 #include "foundation/llll_commons_ext.h"
 #include "math/bach_math_utilities.h"
 #include "ears.object.h"
+#include "wes.cache.h"
+#include "wes.arena.h"
+#include "wes.planar.h"
+#include "wes.output.h"
+#include "wes.budget.h"
+#include "wes.resample.h"
 
 
 
@@ -55,6 +61,15 @@ typedef struct _buf_periodshift {
     long sampMin_in;
     long shift_in;
     long cross_in;
+    t_symbol *indexdir_in;
+    char pyramid_in;
+    char linkchannels_in;
+    long keychannel_in;
+    char quality_in;
+    double scratch_in;
+    double membudget_in;
+    t_wes_arena arena;
+    t_wes_budget budget;
     t_llll  *envin;
 } t_buf_periodshift;
 
@@ -65,18 +80,21 @@ typedef struct _buf_periodshift {
 t_buf_periodshift*         buf_periodshift_new(t_symbol *s, short argc, t_atom *argv);
 void            buf_periodshift_free(t_buf_periodshift *x);
 void            buf_periodshift_bang(t_buf_periodshift *x);
+void            buf_periodshift_dryrun(t_buf_periodshift *x);
+void            buf_periodshift_run(t_buf_periodshift *x, long dryrun);
 void            buf_periodshift_anything(t_buf_periodshift *x, t_symbol *msg, long ac, t_atom *av);
 
 void buf_periodshift_assist(t_buf_periodshift *x, void *b, long m, long a, char *s);
 void buf_periodshift_inletinfo(t_buf_periodshift *x, void *b, long a, char *t);
 
-void periodshift_bang(t_buf_periodshift *x, t_buffer_obj *buffer, t_buffer_obj *out, t_buffer_obj *mod, double modVal, int modType);
+void periodshift_bang(t_buf_periodshift *x, t_buffer_obj *buffer, t_buffer_obj *out, t_buffer_obj *mod, double modVal, int modType, long dryrun);
 
 // Globals and Statics
 static t_class    *s_tag_class = NULL;
 static t_symbol    *ps_event = NULL;
 
 EARSBUFOBJ_ADD_IO_METHODS(periodshift)
+WES_ARENA_ADD_SCRATCH_SETTER(periodshift, t_buf_periodshift)
 
 /**********************************************************************/
 // Class Definition and Life Cycle
@@ -106,8 +124,34 @@ void C74_EXPORT ext_main(void* moduleRef)
     // buffer name (depending on the <m>naming</m> attribute).
     EARSBUFOBJ_DECLARE_COMMON_METHODS_HANDLETHREAD(periodshift)
     
+    // @method cacheinfo @digest Post waveset index cache statistics
+    // @description Posts the number of waveset indices shared by all wes objects, their memory use,
+    // and the cache hits, misses and evictions so far.
+    // @method cachesize @digest Set waveset index cache size
+    // @description Sets the memory cap, in megabytes, of the waveset index cache shared by all wes objects;
+    // least recently used indices are dropped beyond it.
+    // @marg 0 @name megabytes @optional 0 @type float
+    // @method cacheclear @digest Clear waveset index cache
+    // @description Drops every waveset index not currently in use and resets the cache statistics.
+    WES_DECLARE_CACHE_METHODS(c)
+    
+    // @method dryrun @digest Post the projected cost of processing
+    // @description Posts, for each input buffer, the output frames, the memory and the time processing it would take,
+    // without synthesizing nor outputting anything.
+    class_addmethod(c, (method)buf_periodshift_dryrun, "dryrun", 0);
+    
     CLASS_ATTR_LONG(c, "minsamp", 0, t_buf_periodshift, sampMin_in);
     CLASS_ATTR_LONG(c, "cross", 0, t_buf_periodshift, cross_in);
+    CLASS_ATTR_SYM(c, "indexdir", 0, t_buf_periodshift, indexdir_in);
+    CLASS_ATTR_CHAR(c, "pyramid", 0, t_buf_periodshift, pyramid_in);
+    CLASS_ATTR_STYLE_LABEL(c,"pyramid",0,"onoff","Prepare Minsamp Levels");
+    CLASS_ATTR_CHAR(c, "linkchannels", 0, t_buf_periodshift, linkchannels_in);
+    CLASS_ATTR_STYLE_LABEL(c,"linkchannels",0,"enumindex","Link Channels");
+    CLASS_ATTR_ENUMINDEX(c,"linkchannels", 0, "Off Mid \"Key Channel\"");
+    CLASS_ATTR_LONG(c, "keychannel", 0, t_buf_periodshift, keychannel_in);
+    WES_DECLARE_QUALITY_ATTR(c, t_buf_periodshift)
+    WES_DECLARE_BUDGET_ATTR(c, t_buf_periodshift)
+    WES_DECLARE_SCRATCH_ATTR(c, periodshift, t_buf_periodshift)
     CLASS_ATTR_LONG(c, "shiftmult", 0, t_buf_periodshift, shift_in);
 
     earsbufobj_class_add_outname_attr(c);
@@ -153,6 +197,15 @@ t_buf_periodshift *buf_periodshift_new(t_symbol *s, short argc, t_atom *argv)
         x->sampMin_in = 15;
         x->shift_in = 1;
         x->cross_in = 1;
+        x->indexdir_in = gensym("");
+        x->pyramid_in = 0;
+        x->linkchannels_in = WES_LINK_OFF;
+        x->keychannel_in = 1;
+        x->quality_in = WES_QUALITY_LINEAR;
+        x->scratch_in = WES_ARENA_DEFAULT_SCRATCH;
+        x->membudget_in = 0;
+        wes_arena_init(&x->arena);
+        wes_budget_init(&x->budget);
   
         earsbufobj_init((t_earsbufobj *)x,  0);
         
@@ -184,6 +237,7 @@ t_buf_periodshift *buf_periodshift_new(t_symbol *s, short argc, t_atom *argv)
 
 void buf_periodshift_free(t_buf_periodshift *x)
 {
+    wes_arena_free(&x->arena);
     earsbufobj_free((t_earsbufobj *)x);
 }
 
@@ -191,6 +245,18 @@ void buf_periodshift_free(t_buf_periodshift *x)
 
 
 void buf_periodshift_bang(t_buf_periodshift *x)
+{
+    buf_periodshift_run(x, 0);
+}
+
+
+void buf_periodshift_dryrun(t_buf_periodshift *x)
+{
+    buf_periodshift_run(x, 1);
+}
+
+
+void buf_periodshift_run(t_buf_periodshift *x, long dryrun)
 {
     long num_buffers = earsbufobj_get_instore_size((t_earsbufobj *)x, 0);
     earsbufobj_refresh_outlet_names((t_earsbufobj *)x);
@@ -223,14 +289,15 @@ void buf_periodshift_bang(t_buf_periodshift *x)
         
         llll_free(env);
         
-        periodshift_bang(x, in, out, mod, modVal, modType);
+        periodshift_bang(x, in, out, mod, modVal, modType, dryrun);
         
         if (earsbufobj_iter_progress((t_earsbufobj *)x, count, num_buffers)) break;
     }
     
     earsbufobj_mutex_unlock((t_earsbufobj *)x);
 
-    earsbufobj_outlet_buffer((t_earsbufobj *)x, 0);
+    if (!dryrun)
+        earsbufobj_outlet_buffer((t_earsbufobj *)x, 0);
 }
 
 
@@ -261,7 +328,31 @@ void buf_periodshift_anything(t_buf_periodshift *x, t_symbol *msg, long ac, t_at
 }
 
 
-void periodshift_bang(t_buf_periodshift *x, t_buffer_obj *buffer, t_buffer_obj *out, t_buffer_obj *mod, double modVal, int modType) {
+// waveset whose period replaces the one of waveset g
+static inline long periodshift_target(const float *envOnset, long g, long crosscount, int shiftMult, double modVal, int modType)
+{
+    long shiftVal;
+    
+    if (modType == 1) {
+        shiftVal = (g + (int)(CLAMP(envOnset[g], 0 , 1) * shiftMult)) % crosscount;
+    } else {
+        shiftVal = (g + (int)modVal) % crosscount;
+    }
+    return CLAMP(shiftVal, 0, crosscount);
+}
+
+// number of samples synthesized from a channel
+static long periodshift_plan(const t_wes_features *wf, const float *envOnset, int shiftMult, double modVal, int modType)
+{
+    long g, h = 0;
+    
+    for (g = 1 ; g <= wf->count ; g++) {
+        h += wf->period[periodshift_target(envOnset, g, wf->count, shiftMult, modVal, modType)];
+    }
+    return h;
+}
+
+void periodshift_bang(t_buf_periodshift *x, t_buffer_obj *buffer, t_buffer_obj *out, t_buffer_obj *mod, double modVal, int modType, long dryrun) {
 
     t_float        *tab;
     t_float        *envelope;
@@ -276,6 +367,8 @@ void periodshift_bang(t_buf_periodshift *x, t_buffer_obj *buffer, t_buffer_obj *
 
     long        frames, sampleRate, envelopeFrames ;
 
+    wes_budget_start(&x->budget);
+
     tab = ears_buffer_locksamples(buffer);
     frames = buffer_getframecount(buffer);
     sampleRate = buffer_getsamplerate(buffer);
@@ -285,75 +378,34 @@ void periodshift_bang(t_buf_periodshift *x, t_buffer_obj *buffer, t_buffer_obj *
     
     int nchan;
     nchan = buffer_getchannelcount(buffer);
-    double *inbuffer =  (double*) sysmem_newptr(frames * sizeof(double));
+    t_wes_planar planar;
+    wes_planar_init(&planar, &x->arena, tab, frames, nchan);
     
-    int maxcross = round(frames / (minsampl * ncross));
-    //int *zerocrossindex = (int*) malloc(maxcross * sizeof(int));
-    int *zerocrossindex = (int*) sysmem_newptr(maxcross * sizeof(int));
-    double *peakVal = (double*) sysmem_newptr(maxcross * sizeof(double));
     
    
-    int maxmemory = (int)(frames);
-    //double *dataout =  (double*) malloc(maxmemory * sizeof(double));
-    double *dataout =  (double*) sysmem_newptr(maxmemory * sizeof(double));
 
     ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-    int z, v , ver, frameout = 0;
+    int z;
+    long frameout = 0, skipped = 0;
+    t_wes_cost cost;
+    t_wes_index *linked = wes_cache_acquire_linked(buffer, &planar, x->linkchannels_in, x->keychannel_in, minsampl, ncross, x->indexdir_in, x->pyramid_in);
     for (z = 1 ; z < (nchan + 1) ; z++) {
-        int inc = 0;
-        
-        for (v = 0 ; v < (frames * nchan) ; v++) {
-            ver = (v % nchan) + 1;
-            if (ver == z) {
-                inc++;
-                inbuffer[inc] = tab[v];
-            }
-        }
+        const float *inbuffer = wes_planar_channel(&planar, z);
+        t_wes_resampler rs;
+        wes_resampler_init(&rs, x->quality_in, inbuffer, frames);
         
-        int  g = 1, minsamplcount = 0, h = 0, b = 0, j, k, ncrossindex = 0, a, n = 0,  currPeriod, newPeriod, shiftVal, crosscount = 0;
-        double bCF, aCF, res, idxD, scaleCF, maxPeak = 0, newPeakVal;
+        long g = 1, h = 0, k, n = 0,  currPeriod, newPeriod, shiftVal, crosscount = 0;
+        double scaleCF, newPeakVal, res[WES_RESAMPLE_BLOCK];
        
         // waveset segmentation
-        for (j = 0 ; j < frames ; j++) {
-            minsamplcount++;
-            
-            if (maxPeak < fabs(inbuffer[j])) {
-                maxPeak = fabs(inbuffer[j]);
-            }
-            
-            
-            if (inbuffer [j] >= 0 && inbuffer [j - 1] <= 0 && minsamplcount > minsampl) {
-                minsamplcount = 0;
-                ncrossindex++;
-                
-                if (ncrossindex == ncross) {
-                    ncrossindex = 0;
-                    crosscount++;
-                    if (crosscount >= maxcross) {
-                        maxcross = maxcross + round(maxcross/4);
-                        
-                        zerocrossindex = (int*) sysmem_resizeptrclear(zerocrossindex, maxcross * sizeof(int));
-                        peakVal = (double*) sysmem_resizeptrclear(peakVal, maxcross * sizeof(double));
-                        
-                    }
-                    
-                    
-                    zerocrossindex[crosscount] = j;
-                    peakVal[crosscount] = maxPeak;
-                    maxPeak = 0;
-                    
-                    
-                }
-            }
-        }
-        
-        
-        
-        zerocrossindex[0] = 0;
-        peakVal[0] = 0;
+        t_wes_index *index = wes_cache_acquire_channel(buffer, &planar, z, linked, minsampl, ncross, x->indexdir_in, x->pyramid_in);
+        t_wes_features *wf = &index->features;
+        double *peakVal = wf->absPeak;
+        crosscount = wf->count;
         
         ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-               float *envOnset = (float *)bach_newptr(crosscount * sizeof(float));
+               size_t mark = wes_arena_mark(&x->arena);
+               float *envOnset = wes_arena_envelope(&x->arena, crosscount);
                if (modType == 1) {
                     ears_resample_linear(envelope, envelopeFrames, &envOnset, crosscount, ((float)crosscount/(float)envelopeFrames), 1);
                } else {
@@ -363,21 +415,34 @@ void periodshift_bang(t_buf_periodshift *x, t_buffer_obj *buffer, t_buffer_obj *
                }
                ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
         
+        long planned = periodshift_plan(wf, envOnset, shiftMult, modVal, modType);
+        if (z == 1) {
+            frameout = planned - 1;
+            wes_budget_project(&x->budget, &cost, frames, nchan, crosscount, frameout, nchan, 0);
+            if (!wes_budget_admit((t_object *) x, &cost, x->membudget_in, dryrun, NULL)) {
+                if (!dryrun)
+                    ears_buffer_set_size_and_numchannels((t_object *) x, out, 0, nchan);
+                skipped = 1;
+                wes_cache_release(index);
+                break;
+            }
+            ears_buffer_set_size_and_numchannels((t_object *) x, out, frameout, nchan);
+            ears_buffer_set_sr((t_object *) x, out, sampleRate);
+        }
+        t_wes_output output;
+        wes_output_begin(&output, ears_buffer_locksamples(out), frameout, nchan, z);
         
         while (g <= crosscount) {
             
             
-            currPeriod = (zerocrossindex[g] - zerocrossindex[g  - 1]);
+            const float *wave = inbuffer + wf->start[g];
+            currPeriod = wf->period[g];
             
-            if (modType == 1) {
-                shiftVal = (g + (int)(CLAMP(envOnset[g], 0 , 1) * shiftMult)) % crosscount;
-            } else {
-                shiftVal = (g + (int)modVal) % crosscount;
-            }
+            shiftVal = periodshift_target(envOnset, g, crosscount, shiftMult, modVal, modType);
             
-            shiftVal = CLAMP(shiftVal, 0, crosscount);
-            
-            newPeriod = (zerocrossindex[shiftVal] - zerocrossindex[shiftVal - 1 ]);
+            // period[0] is 0, so that a shift landing on 0 outputs nothing
+            newPeriod = wf->period[shiftVal];
+            scaleCF = wes_resample_scale(currPeriod, newPeriod);
     
             if( peakVal[shiftVal] == 0 || peakVal[g] == 0) {
                 newPeakVal = 0;
@@ -387,60 +452,31 @@ void periodshift_bang(t_buf_periodshift *x, t_buffer_obj *buffer, t_buffer_obj *
             
             
             while (n < newPeriod) {
-       
-                scaleCF = ((double)currPeriod - 1) / ((double)newPeriod - 1);
-                idxD = (double)scaleCF * n;
-                a = (int)idxD;
-                b = a + 1;
-                bCF = idxD - a;
-                aCF = 1.0 - bCF;
-                res = (double)(aCF * inbuffer[a + zerocrossindex[g - 1]] + bCF * inbuffer[b + zerocrossindex[g - 1]]);
+                long len = MIN(WES_RESAMPLE_BLOCK, newPeriod - n);
+                wes_resample(&rs, wave, 0, scaleCF, n, 1, len, res);
                 
-                if (h >= maxmemory) {
-                    maxmemory = maxmemory + round(maxmemory/4);
-                    
-                    dataout =  (double*)sysmem_resizeptrclear(dataout, maxmemory * sizeof(double));
-                    
+                long skip, count = wes_output_clip(&output, h, len, &skip);
+                for (k = skip ; k < skip + count ; k++) {
+                    wes_output_write(&output, h + k, res[k] * newPeakVal);
                 }
-            
-                dataout[h] = res * newPeakVal;
-                n++;
-                h++;
+                h += len;
+                n += len;
             }
             g++;
             n = 0;
         }
         
-        if (z == 1) {
-            frameout = h - 1;
-        }
-        
-        
-        ears_buffer_set_size_and_numchannels((t_object *) x, out, frameout, nchan);
-        ears_buffer_set_sr((t_object *) x, out, sampleRate);
-        
-        float *outtab = ears_buffer_locksamples(out);
-        
-        
-        inc = 0;
-        for (k = 0 ; k < (frameout * nchan) ; k++) {
-            ver = (k % nchan) + 1;
-            if (ver == z) {
-                inc++;
-                double f = dataout[inc];
-                outtab[k] = f;
-            }
-            
-        }
+        wes_output_finish(&output, h);
         ears_buffer_unlocksamples(out);
-        bach_freeptr(envOnset);
+        wes_cache_release(index);
+        wes_arena_rewind(&x->arena, mark);
     }
     
     
     ears_buffer_unlocksamples(buffer);
-    sysmem_freeptr(dataout);
-    sysmem_freeptr(zerocrossindex);
-    sysmem_freeptr(peakVal);
-    sysmem_freeptr(inbuffer);
+    wes_cache_release(linked);
+    if (!skipped)
+        wes_budget_stop(&x->budget, (double)frameout * nchan);
+    wes_arena_end(&x->arena, wes_arena_megabytes(x->scratch_in));
     return;
 }
@@ -44,6 +44,13 @@
 #include "foundation/llll_commons_ext.h"
 #include "math/bach_math_utilities.h"
 #include "ears.object.h"
+#include "wes.cache.h"
+#include "wes.arena.h"
+#include "wes.planar.h"
+#include "wes.output.h"
+#include "wes.budget.h"
+#include "wes.resample.h"
+#include "wes.fade.h"
 
 
 
@@ -57,6 +64,15 @@ typedef struct _buf_uniform {
     long repeat_in;
     long freqMin_in;
     long lagmult_in;
+    t_symbol *indexdir_in;
+    char pyramid_in;
+    char linkchannels_in;
+    long keychannel_in;
+    char quality_in;
+    double scratch_in;
+    double membudget_in;
+    t_wes_arena arena;
+    t_wes_budget budget;
     t_llll  *envin;
     
 } t_buf_uniform;
@@ -68,18 +84,21 @@ typedef struct _buf_uniform {
 t_buf_uniform*         buf_uniform_new(t_symbol *s, short argc, t_atom *argv);
 void            buf_uniform_free(t_buf_uniform *x);
 void            buf_uniform_bang(t_buf_uniform *x);
+void            buf_uniform_dryrun(t_buf_uniform *x);
+void            buf_uniform_run(t_buf_uniform *x, long dryrun);
 void            buf_uniform_anything(t_buf_uniform *x, t_symbol *msg, long ac, t_atom *av);
 
 void buf_uniform_assist(t_buf_uniform *x, void *b, long m, long a, char *s);
 void buf_uniform_inletinfo(t_buf_uniform *x, void *b, long a, char *t);
 
-void uniform_bang(t_buf_uniform *x, t_buffer_obj *buffer, t_buffer_obj *out, t_buffer_obj *mod, double modVal, int modType);
+void uniform_bang(t_buf_uniform *x, t_buffer_obj *buffer, t_buffer_obj *out, t_buffer_obj *mod, double modVal, int modType, long dryrun);
 
 // Globals and Statics
 static t_class    *s_tag_class = NULL;
 static t_symbol    *ps_event = NULL;
 
 EARSBUFOBJ_ADD_IO_METHODS(uniform)
+WES_ARENA_ADD_SCRATCH_SETTER(uniform, t_buf_uniform)
 
 /**********************************************************************/
 // Class Definition and Life Cycle
@@ -109,9 +128,36 @@ void C74_EXPORT ext_main(void* moduleRef)
     // buffer name (depending on the <m>naming</m> attribute).
     EARSBUFOBJ_DECLARE_COMMON_METHODS_HANDLETHREAD(uniform)
     
+    // @method cacheinfo @digest Post waveset index cache statistics
+    // @description Posts the number of waveset indices shared by all wes objects, their memory use,
+    // and the cache hits, misses and evictions so far.
+    // @method cachesize @digest Set waveset index cache size
+    // @description Sets the memory cap, in megabytes, of the waveset index cache shared by all wes objects;
+    // least recently used indices are dropped beyond it.
+    // @marg 0 @name megabytes @optional 0 @type float
+    // @method cacheclear @digest Clear waveset index cache
+    // @description Drops every waveset index not currently in use and resets the cache statistics.
+    WES_DECLARE_CACHE_METHODS(c)
+    wes_fade_init();
+    
+    // @method dryrun @digest Post the projected cost of processing
+    // @description Posts, for each input buffer, the output frames, the memory and the time processing it would take,
+    // without synthesizing nor outputting anything.
+    class_addmethod(c, (method)buf_uniform_dryrun, "dryrun", 0);
+    
     CLASS_ATTR_LONG(c, "minsamp", 0, t_buf_uniform, sampMin_in);
     CLASS_ATTR_FLOAT(c, "freq", 0, t_buf_uniform, freq_in);
     CLASS_ATTR_LONG(c, "cross", 0, t_buf_uniform, cross_in);
+    CLASS_ATTR_SYM(c, "indexdir", 0, t_buf_uniform, indexdir_in);
+    CLASS_ATTR_CHAR(c, "pyramid", 0, t_buf_uniform, pyramid_in);
+    CLASS_ATTR_STYLE_LABEL(c,"pyramid",0,"onoff","Prepare Minsamp Levels");
+    CLASS_ATTR_CHAR(c, "linkchannels", 0, t_buf_uniform, linkchannels_in);
+    CLASS_ATTR_STYLE_LABEL(c,"linkchannels",0,"enumindex","Link Channels");
+    CLASS_ATTR_ENUMINDEX(c,"linkchannels", 0, "Off Mid \"Key Channel\"");
+    CLASS_ATTR_LONG(c, "keychannel", 0, t_buf_uniform, keychannel_in);
+    WES_DECLARE_QUALITY_ATTR(c, t_buf_uniform)
+    WES_DECLARE_BUDGET_ATTR(c, t_buf_uniform)
+    WES_DECLARE_SCRATCH_ATTR(c, uniform, t_buf_uniform)
     CLASS_ATTR_LONG(c, "repeat", 0, t_buf_uniform, repeat_in);
     CLASS_ATTR_LONG(c, "lagmultiply", 0, t_buf_uniform, lagmult_in);
 
@@ -158,6 +204,15 @@ t_buf_uniform *buf_uniform_new(t_symbol *s, short argc, t_atom *argv)
         x->sampMin_in = 15;
         x->freq_in = 100;
         x->cross_in = 1;
+        x->indexdir_in = gensym("");
+        x->pyramid_in = 0;
+        x->linkchannels_in = WES_LINK_OFF;
+        x->keychannel_in = 1;
+        x->quality_in = WES_QUALITY_LINEAR;
+        x->scratch_in = WES_ARENA_DEFAULT_SCRATCH;
+        x->membudget_in = 0;
+        wes_arena_init(&x->arena);
+        wes_budget_init(&x->budget);
         x->repeat_in = 3;
         x->lagmult_in = 3;
        
@@ -192,6 +247,7 @@ t_buf_uniform *buf_uniform_new(t_symbol *s, short argc, t_atom *argv)
 
 void buf_uniform_free(t_buf_uniform *x)
 {
+    wes_arena_free(&x->arena);
     llll_free(x->envin);
     earsbufobj_free((t_earsbufobj *)x);
     
@@ -201,6 +257,18 @@ void buf_uniform_free(t_buf_uniform *x)
 
 
 void buf_uniform_bang(t_buf_uniform *x)
+{
+    buf_uniform_run(x, 0);
+}
+
+
+void buf_uniform_dryrun(t_buf_uniform *x)
+{
+    buf_uniform_run(x, 1);
+}
+
+
+void buf_uniform_run(t_buf_uniform *x, long dryrun)
 {
     long num_buffers = earsbufobj_get_instore_size((t_earsbufobj *)x, 0);
     earsbufobj_refresh_outlet_names((t_earsbufobj *)x);
@@ -233,14 +301,15 @@ void buf_uniform_bang(t_buf_uniform *x)
         
         llll_free(env);
         
-        uniform_bang(x, in, out, mod, modVal, modType);
+        uniform_bang(x, in, out, mod, modVal, modType, dryrun);
         
         if (earsbufobj_iter_progress((t_earsbufobj *)x, count, num_buffers)) break;
     }
     
     earsbufobj_mutex_unlock((t_earsbufobj *)x);
 
-    earsbufobj_outlet_buffer((t_earsbufobj *)x, 0);
+    if (!dryrun)
+        earsbufobj_outlet_buffer((t_earsbufobj *)x, 0);
 }
 
 
@@ -270,7 +339,29 @@ void buf_uniform_anything(t_buf_uniform *x, t_symbol *msg, long ac, t_atom *av)
 }
 
 
-void uniform_bang(t_buf_uniform *x, t_buffer_obj *buffer, t_buffer_obj *out, t_buffer_obj *mod, double modVal, int modType) {
+// stretch of the cycle of waveset g, silence included
+static inline double uniform_lag(const float *envOnset, long g, float lagmultiply, int modType)
+{
+    if (modType == 1) {
+        return (CLAMP(envOnset[g], 0, 1) * lagmultiply) + 1;
+    } else {
+        return envOnset[g];
+    }
+}
+
+// number of samples synthesized from a channel
+static long uniform_plan(const t_wes_features *wf, const float *envOnset, long newPeriod, int repeat, float lagmultiply, int modType)
+{
+    long g, h = 0;
+    
+    for (g = 1 ; g < wf->count ; g++) {
+        long waveSilencePeriod = (float)newPeriod * uniform_lag(envOnset, g, lagmultiply, modType);
+        h += (long)repeat * (MAX(0, newPeriod) + MAX(0, waveSilencePeriod - newPeriod));
+    }
+    return h;
+}
+
+void uniform_bang(t_buf_uniform *x, t_buffer_obj *buffer, t_buffer_obj *out, t_buffer_obj *mod, double modVal, int modType, long dryrun) {
     
     t_float        *tab;
     t_float        *envelope;
@@ -286,6 +377,8 @@ void uniform_bang(t_buf_uniform *x, t_buffer_obj *buffer, t_buffer_obj *out, t_b
     
     long        frames, sampleRate, envelopeFrames ;
     
+    wes_budget_start(&x->budget);
+    
     tab = ears_buffer_locksamples(buffer);
     frames = buffer_getframecount(buffer);
     sampleRate = buffer_getsamplerate(buffer);
@@ -295,90 +388,35 @@ void uniform_bang(t_buf_uniform *x, t_buffer_obj *buffer, t_buffer_obj *out, t_b
     
     int nchan;
     nchan = buffer_getchannelcount(buffer);
-    double *inbuffer =  (double*) sysmem_newptr(frames * sizeof(double));
+    t_wes_planar planar;
+    wes_planar_init(&planar, &x->arena, tab, frames, nchan);
+    
+    long frameout = 0, skipped = 0;
     
-    int maxcross = round(frames / (minsampl * ncross));
-    int *zerocrossindex = (int*) sysmem_newptr(maxcross * sizeof(int));
-    int maxmemory = (int)(frames);
-    double *dataout =  (double*) sysmem_newptr(maxmemory * sizeof(double));
-    double *wavePosPeak = (double*) sysmem_newptr(maxcross * sizeof(double));
-    double *waveNegPeak = (double*) sysmem_newptr(maxcross * sizeof(double));
-    int frameout = 0;
+    t_wes_cost cost;
     ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-    int z, v , ver;
+    int z;
+    t_wes_index *linked = wes_cache_acquire_linked(buffer, &planar, x->linkchannels_in, x->keychannel_in, minsampl - 1, ncross, x->indexdir_in, x->pyramid_in);
     for (z = 1 ; z < (nchan + 1) ; z++) {
-        int inc = 0;
-        
-        for (v = 0 ; v < (frames * nchan) ; v++) {
-            ver = (v % nchan) + 1;
-            if (ver == z) {
-                inc++;
-                inbuffer[inc] = tab[v];
-            }
-        }
+        const float *inbuffer = wes_planar_channel(&planar, z);
+        t_wes_resampler rs;
+        wes_resampler_init(&rs, x->quality_in, inbuffer, frames);
         
-        int  g = 1, minsamplcount = 0, h = 0, j, k, ncrossindex = 0, n = 0,  currPeriod, newPeriod,nextPeriod, u = 0, crosscount = 0, window = 0, waveSilencePeriod;
-        double  maxPosPeak = 0, maxNegPeak = 0, posVal = 0, negVal = 0;
+        long g = 1, h = 0, k, n = 0, newPeriod, u = 0, crosscount = 0, window = 0, waveSilencePeriod;
         
-        double bCF, aCF, resA, resB, idxD, scaleCF, lagAmount;
-        int a = 0, b = 0;
+        double lagAmount, resA[WES_RESAMPLE_BLOCK], resB[WES_RESAMPLE_BLOCK];
         
         // waveset segmentation
-        
-        for (j = 0 ; j < frames ; j++) {
-            minsamplcount++;
-            
-            if (inbuffer [j] > 0) {
-                posVal = inbuffer [j];
-            } else {
-                negVal = inbuffer [j];
-            }
-            
-            if (maxPosPeak < posVal) {
-                maxPosPeak = posVal;
-            }
-            
-            
-            if (maxNegPeak > negVal) {
-                maxNegPeak = negVal;
-            }
-            
-            if (inbuffer [j] >= 0 && inbuffer [j - 1] <= 0 && minsamplcount >= minsampl) {
-                minsamplcount = 0;
-                ncrossindex++;
-                
-                if (ncrossindex == ncross) {
-                    ncrossindex = 0;
-                    crosscount++;
-                    if (crosscount >= maxcross) {
-                        maxcross = maxcross + round(maxcross/4);
-                        zerocrossindex = (int*) sysmem_resizeptrclear(zerocrossindex, maxcross * sizeof(int));
-                        wavePosPeak = (double*) sysmem_resizeptrclear(wavePosPeak, maxcross * sizeof(double));
-                        waveNegPeak = (double*) sysmem_resizeptrclear(waveNegPeak, maxcross * sizeof(double));
-                        
-                    }
-                    
-                    
-                    zerocrossindex[crosscount] = j;
-                    wavePosPeak[crosscount] = maxPosPeak;
-                    waveNegPeak[crosscount] = maxNegPeak;
-                    
-                    maxPosPeak = 0;
-                    maxNegPeak = 0;
-                    
-                    
-                }
-            }
-        }
-        
-
-        zerocrossindex[0] = 0;
-        wavePosPeak[0] = 0;
-        waveNegPeak[0] = 0;
+        t_wes_index *index = wes_cache_acquire_channel(buffer, &planar, z, linked, minsampl - 1, ncross, x->indexdir_in, x->pyramid_in);
+        t_wes_features *wf = &index->features;
+        double *wavePosPeak = wf->posPeak;
+        double *waveNegPeak = wf->negPeak;
+        crosscount = wf->count;
         
         
         ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-        float *envOnset = (float *)bach_newptr(crosscount * sizeof(float));
+        size_t mark = wes_arena_mark(&x->arena);
+        float *envOnset = wes_arena_envelope(&x->arena, crosscount);
         if (modType == 1) {
             ears_resample_linear(envelope, envelopeFrames, &envOnset, crosscount, ((float)crosscount/(float)envelopeFrames), 1);
         } else {
@@ -386,26 +424,40 @@ void uniform_bang(t_buf_uniform *x, t_buffer_obj *buffer, t_buffer_obj *out, t_b
                 envOnset[gg] = CLAMP(modVal, 1, 500);
             }
         }
+        
+        newPeriod = (1./(Freq/ncross)) * sampleRate;
+        long planned = uniform_plan(wf, envOnset, newPeriod, repeat, lagmultiply, modType);
+        if (z == 1) {
+            frameout = planned - 1;
+            wes_budget_project(&x->budget, &cost, frames, nchan, crosscount, frameout, nchan, 0);
+            if (!wes_budget_admit((t_object *) x, &cost, x->membudget_in, dryrun, NULL)) {
+                if (!dryrun)
+                    ears_buffer_set_size_and_numchannels((t_object *) x, out, 0, nchan);
+                skipped = 1;
+                wes_cache_release(index);
+                break;
+            }
+            ears_buffer_set_size_and_numchannels((t_object *) x, out, frameout, nchan);
+            ears_buffer_set_sr((t_object *) x, out, sampleRate);
+        }
+        t_wes_output output;
+        wes_output_begin(&output, ears_buffer_locksamples(out), frameout, nchan, z);
         ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
         
         
         while (g < crosscount) {
             
-            if (modType == 1) {
-                lagAmount = (CLAMP(envOnset[g], 0, 1) * lagmultiply) + 1;
-            } else {
-                lagAmount = envOnset[g];
-            }
-            
+            lagAmount = uniform_lag(envOnset, g, lagmultiply, modType);
             
-            currPeriod = (zerocrossindex[g] - zerocrossindex[g  - 1]);
-            nextPeriod = (zerocrossindex[g + 1] - zerocrossindex[g]);
-            
-            newPeriod = (1./(Freq/ncross)) * sampleRate;
+            // resample between the interpolated crossings, so that both wavesets start and end on 0
+            double fromA = wf->crossing[g - 1], fromB = wf->crossing[g];
+            double scaleA = wf->exactPeriod[g] / newPeriod;
+            double scaleB = wf->exactPeriod[g + 1] / newPeriod;
             
             waveSilencePeriod = (float)newPeriod * lagAmount;
              
-            int segmentDur = waveSilencePeriod * (repeat );
+            long segmentDur = waveSilencePeriod * (repeat );
+            double fadeRate = wes_fade_rate(segmentDur);
             
      
             while (u < repeat) {
@@ -426,65 +478,30 @@ void uniform_bang(t_buf_uniform *x, t_buffer_obj *buffer, t_buffer_obj *out, t_b
                 
                 
                 while (n < newPeriod) {
-
-                 
-                    scaleCF = ((double)currPeriod -1 ) / ((double)newPeriod -1);
-                    idxD = (double)scaleCF * n;
-                    a = (int)idxD;
-                    b = a + 1;
-                    bCF = idxD - a;
-                    aCF = 1.0 - bCF;
-                    resA = (double)(aCF * inbuffer[a + zerocrossindex[g - 1]] + bCF * inbuffer[b + zerocrossindex[g - 1]]);
+                    long len = MIN(WES_RESAMPLE_BLOCK, newPeriod - n);
+                    wes_resample(&rs, inbuffer, fromA, scaleA, n, 1, len, resA);
+                    wes_resample(&rs, inbuffer, fromB, scaleB, n, 1, len, resB);
                     
-
-                    scaleCF = ((double)nextPeriod -1 ) / ((double)newPeriod -1);
-                    idxD = (double)scaleCF * n;
-                    a = (int)idxD;
-                    b = a + 1;
-                    bCF = idxD - a;
-                    aCF = 1.0 - bCF;
-                    resB = (double)(aCF * inbuffer[a + zerocrossindex[g]] + bCF * inbuffer[b + zerocrossindex[g]]);
-
-                    window++;
-                    float fadeIn = sin(((float)window/(float)segmentDur) * (3.14159/2.));
-                    float fadeOut = cos(((float)window/(float)segmentDur) * (3.14159/2.));
-                    
-                    
-                    if (h >= maxmemory) {
-                        maxmemory = maxmemory + round(maxmemory/4);
-                        dataout =  (double*)sysmem_resizeptrclear(dataout, maxmemory * sizeof(double));
+                    long skip, count = wes_output_clip(&output, h, len, &skip);
+                    for (k = skip ; k < skip + count ; k++) {
+                        float fadeIn, fadeOut;
+                        wes_fade_gains((window + k + 1) * fadeRate, &fadeIn, &fadeOut);
+                        
+                        wes_output_write(&output, h + k, (resA[k] * fadeOut) + (resB[k] * fadeIn));
                     }
-                    
-                    
-                    float diffA = fabs(inbuffer[zerocrossindex[g - 1]]) + fabs(inbuffer[zerocrossindex[g] - 1]);
-                    
-                    float diffB = fabs(inbuffer[zerocrossindex[g]]) + fabs(inbuffer[zerocrossindex[g + 1] - 1]);
-                    
-                    float sampleCorrectionA = ((float)n/(newPeriod - 1)) * diffA - inbuffer[zerocrossindex[g - 1]];
-                    
-                    float sampleCorrectionB = ((float)n/(newPeriod - 1)) * diffB - inbuffer[zerocrossindex[g]];
-                    
-
-                    dataout[h] = (((resA + sampleCorrectionA) * fadeOut) + ((resB + sampleCorrectionB) * fadeIn)) ;
-           
-                    h++;
-                    n++;
+                    h += len;
+                    window += len;
+                    n += len;
                 }
                 
             
                 
                 
                 
-                for (int r = 0 ; r < (waveSilencePeriod - newPeriod) ; r++) {
-                    
-                    window++;
-                    if (h >= maxmemory) {
-                        maxmemory = maxmemory + round(maxmemory/4);
-                        dataout =  (double*)sysmem_resizeptrclear(dataout, maxmemory * sizeof(double));
-                    }
-                    dataout[h] = 0;
-                    h++;
-                }
+                long silence = MAX(0, waveSilencePeriod - newPeriod);
+                wes_output_silence(&output, h, silence);
+                h += silence;
+                window += silence;
                 n = 0;
                 
             }
@@ -494,37 +511,17 @@ void uniform_bang(t_buf_uniform *x, t_buffer_obj *buffer, t_buffer_obj *out, t_b
         }
         
         
-        if (z == 1) {
-            frameout = h - 1;;
-        }
-        
-        
-        ears_buffer_set_size_and_numchannels((t_object *) x, out, frameout, nchan);
-        ears_buffer_set_sr((t_object *) x, out, sampleRate);
-        
-        float *outtab = ears_buffer_locksamples(out);
-        
-        
-        inc = 0;
-        for (k = 0 ; k < (frameout * nchan) ; k++) {
-            ver = (k % nchan) + 1;
-            if (ver == z) {
-                inc++;
-                double f = dataout[inc];
-                outtab[k] = f;
-            }
-            
-        }
+        wes_output_finish(&output, h);
         ears_buffer_unlocksamples(out);
-        bach_freeptr(envOnset);
+        wes_cache_release(index);
+        wes_arena_rewind(&x->arena, mark);
     }
     
     ears_buffer_unlocksamples(buffer);
-    sysmem_freeptr(dataout);
-    sysmem_freeptr(zerocrossindex);
-    sysmem_freeptr(inbuffer);
-    sysmem_freeptr(wavePosPeak);
-    sysmem_freeptr(waveNegPeak);
+    wes_cache_release(linked);
+    if (!skipped)
+        wes_budget_stop(&x->budget, (double)frameout * nchan);
+    wes_arena_end(&x->arena, wes_arena_megabytes(x->scratch_in));
     
     return;
 }
@@ -0,0 +1,98 @@
+/**
+@file
+wes.curves.test.c
+
+@brief
+Regression test of the envelope curves kept across wavesets
+
+@description
+Runs the lookups of wes.repeat.enveloping~ through wes.curves.h outside Max,
+with sysmem_* backed by malloc: wavesets repeated 69 ... 72 times fill the
+slots 5 ... 8, then a waveset repeated 5 times looks up a rising pitch curve
+(slope 2) and a falling amplitude curve (slope 3), which hash to the same
+full slots. The pitch curve must outlive the lookup of the amplitude one.
+Build and run with, e.g.
+
+    cc -I<max-sdk>/source/c74support/max-includes -I../commons -fsanitize=address wes.curves.test.c -lm && ./a.out
+
+It exits with 0 when the curves are intact, and ASan reports any read of a
+freed table.
+
+@owner
+Marco Marasciuolo
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "wes.curves.h"
+
+t_ptr sysmem_newptr(long size)
+{
+    return (t_ptr)malloc(size);
+}
+
+void sysmem_freeptr(void *ptr)
+{
+    free(ptr);
+}
+
+
+// whether <values> is the curve of <repeat> values at <slope>, rising or falling
+static long check_curve(const float *values, int repeat, float slope, char fall)
+{
+    for (int u = 1; u <= repeat; u++) {
+        float expected = fall ? 1. - pow(1. - (float)u/repeat, slope) : pow((float)u/repeat, slope);
+        if (values[u - 1] != expected)
+            return 0;
+    }
+    return 1;
+}
+
+int main(void)
+{
+    t_wes_curves curves;
+    long failed = 0;
+
+    wes_curves_init(&curves);
+
+    // slots 5 ... 8 taken by earlier wavesets
+    for (int repeat = 69; repeat <= 72; repeat++) {
+        wes_curves_next(&curves);
+        wes_curves_get(&curves, repeat, 2, 0);
+    }
+
+    // the waveset being synthesized: both curves hash to slot 5, with no free slot among the probes
+    wes_curves_next(&curves);
+    const float *pitchCurve = wes_curves_get(&curves, 5, 2, 0);
+    const float *ampCurve = wes_curves_get(&curves, 5, 3, 1);
+
+    if (pitchCurve == ampCurve || !check_curve(pitchCurve, 5, 2, 0)) {
+        printf("FAIL: the amplitude curve evicted the pitch curve of the same waveset\n");
+        failed = 1;
+    }
+    if (!check_curve(ampCurve, 5, 3, 1)) {
+        printf("FAIL: wrong amplitude curve\n");
+        failed = 1;
+    }
+
+    // both are still found by the next waveset, and an evicted curve is computed again
+    wes_curves_next(&curves);
+    if (wes_curves_get(&curves, 5, 2, 0) != pitchCurve || wes_curves_get(&curves, 5, 3, 1) != ampCurve) {
+        printf("FAIL: the curves of the previous waveset were lost\n");
+        failed = 1;
+    }
+    wes_curves_next(&curves);
+    for (int repeat = 69; repeat <= 72; repeat++) {
+        if (!check_curve(wes_curves_get(&curves, repeat, 2, 0), repeat, 2, 0)) {
+            printf("FAIL: wrong curve for %d repeats\n", repeat);
+            failed = 1;
+        }
+        wes_curves_next(&curves);
+    }
+
+    wes_curves_free(&curves);
+    if (!failed)
+        printf("OK\n");
+    return failed;
+}